@@ -3,5 +3,12 @@ FRAMEWORK_PATHS="-F/Library/Frameworks/ "
 FRAMEWORKS="-framework SDL2 "
 FRAMEWORKS+="-framework OpenGL "
 FRAMEWORKS+="-framework CoreFoundation "
-gcc -Wall $* $INCLUDE_PATHS$FRAMEWORK_PATHS $FRAMEWORKS machine.c -o machine
+if [ "$HEADLESS" = "1" ]; then
+    # software gpu, no SDL or OpenGL needed
+    gcc -Wall -DSOFTWARE_GPU $* machine.c drive.c -o machine -lpthread -lm
+else
+    gcc -Wall $* $INCLUDE_PATHS$FRAMEWORK_PATHS $FRAMEWORKS machine.c drive.c -o machine
+fi
 gcc -Wall $* compiler.c -o compiler
+gcc -Wall $* decompiler.c -o decompiler
+gcc -Wall $* drivetool.c drive.c -o drivetool
@@ -2,10 +2,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 
 #include "system.h"
 
-#define MAX_LINE_LENGTH 256
+#define MAX_NAME_LENGTH 256
+
+// print the progress of the assembler with -v
+int verbose = 0;
+#define trace(...) do { if(verbose) printf(__VA_ARGS__); } while(0)
 
 // some basic helper function macros:
 #define inRange(x, m, M) ((m) <= (x) && (x) <= (M))
@@ -21,6 +30,8 @@ int parse_instruction(char* str)
         switch(str[0]) {
             case 'N':
                 if(strcmp(str, "NOP") == 0) return NOP; else return -1;
+            case 'H':
+                if(strcmp(str, "HLT") == 0) return HLT; else return -1;
             case 'I':
                 if(strcmp(str, "INT") == 0) return INT;
                 else if(strcmp(str, "INC") == 0) return INC;
@@ -30,6 +41,7 @@ int parse_instruction(char* str)
             case 'C':
                 if(strcmp(str, "CMP") == 0) return CMP;
                 else if(strcmp(str, "CPY") == 0) return CPY;
+                else if(strcmp(str, "CAS") == 0) return CAS;
                 else return -1;
             case 'A':
                 if(strcmp(str, "ADD") == 0) return ADD; else return -1;
@@ -55,6 +67,13 @@ int parse_instruction(char* str)
     else if(strcmp(str, "PUSH") == 0) return PUSH;
     else if(strcmp(str, "FETCH") == 0) return FETCH;
     else if(strcmp(str, "WRITE") == 0) return WRITE;
+    else if(strcmp(str, "IRET") == 0) return IRET;
+    else if(strcmp(str, "XADD") == 0) return XADD;
+    else if(strcmp(str, "XCHG") == 0) return XCHG;
+    else if(strcmp(str, "FENCE") == 0) return FENCE;
+    else if(strcmp(str, "TASK") == 0) return TASK;
+    else if(strcmp(str, "YIELD") == 0) return YIELD;
+    else if(strcmp(str, "JOIN") == 0) return JOIN;
 
     return -1;
 }
@@ -142,13 +161,17 @@ int sign_check(int i, int mode, int sign){
 int parse_value(char* str, int line, int mode, int sign) {
     if(str[0] == '\'') { // if it begins with a quote, then we parse as a byte
         if(str[1] == '\\') {
-            if(str[3] != '\'') { printf("Unexpecting value [%s] on line [%i].\n", str, line); exit(-1); }
-            return str[2];
+            if(str[3] != '\'' || str[4] != '\0') { printf("Unexpecting value [%s] on line [%i].\n", str, line); exit(-1); }
+            switch(str[2]) {
+                case 'n': return '\n';
+                case 't': return '\t';
+                case '0': return '\0';
+                default: return str[2]; // \\ and \'
+            }
         }
         else {
-            if(str[2] != '\'') {
-                return str[1];
-            }
+            if(str[1] == '\0' || str[2] != '\'' || str[3] != '\0') { printf("Unexpecting value [%s] on line [%i].\n", str, line); exit(-1); }
+            return str[1];
         }
     } else {
         int i = 0;
@@ -189,26 +212,41 @@ int parse_value(char* str, int line, int mode, int sign) {
 
 // label structure for defining offsets for assembly labels
 typedef struct Label {
-    char* name; // the name of the assembly label
-    int offset; // the offset in bytes
+    char* name;        // the name of the assembly label, stored once for all of its references
+    unsigned int hash; // the hash of the name
+    int offset;        // the offset in bytes
+    int line;          // the line on which the label is defined, or -1 if it has only been referenced so far
+    int absolute;      // 1 for #def values, which do not move when the module is linked
+    int exported;      // 1 if other modules may use the label (#export), only exported labels are global in an object
+    int hidden;        // 1 for the labels a linked object did not export, they can not be found by name
+    int file;          // the file the label is defined in, an index into label_files
 }Label;
 
+// every assembler thread has its own labels, symbols, post processors and offset,
+// so independent modules can be assembled at the same time (see assembleModules)
+
 // the labels array initally has enough space for 16 labels
 #define LABELS_ARRAY_INITAL_SIZE 16
-Label* labels = NULL;
-unsigned int labels_count = 0;
-unsigned int label_index = 0;
+_Thread_local Label* labels = NULL;
+_Thread_local unsigned int labels_count = 0;
+_Thread_local unsigned int label_index = 0;
+
+// labels are found through an open addressing hash table of indices into the labels array,
+// the table is kept at most half full
+#define LABEL_TABLE_INITIAL_SIZE 64 // must be a power of 2
+_Thread_local unsigned int* label_table = NULL; // label index + 1 for each slot, 0 if the slot is empty
+_Thread_local unsigned int label_table_size = 0;
 
 // the symbols array is initally enough to store 2048 characters
 #define SYMBOLS_ARRAY_INITIAL_SIZE 2048
-char* symbols; // the byte buffer for the source code to write
-unsigned int symbols_count = 0;
-unsigned int symbol_index = 0;
+_Thread_local char* symbols = NULL; // the byte buffer for the source code to write
+_Thread_local unsigned int symbols_count = 0;
+_Thread_local unsigned int symbol_index = 0;
 
 // the post processor structure the references to labels which need to be overwritten with byte offsets
 typedef struct PostProcessor
 {
-    char* name; // the name of the reference
+    int label;  // the index of the referenced label
     int offset; // the offset of the symbols to overwrite in bytes
     int line;   // the line number on which this reference appears
     int size;   // the size of the symbol in bytes to overwrite
@@ -216,25 +254,71 @@ typedef struct PostProcessor
 
 // the post processors array initally has enough room  for 64 post processor references
 #define POST_PROCESSOR_ARRAY_INITIAL_SIZE 64
-PostProcessor* post_processors;
-unsigned int  post_processors_count = 0;
-unsigned int  post_processors_index = 0;
+_Thread_local PostProcessor* post_processors = NULL;
+_Thread_local unsigned int  post_processors_count = 0;
+_Thread_local unsigned int  post_processors_index = 0;
+
+// the item structure records where each assembled instruction and each padding lies in the symbols, so the optimizer
+// can change the code. Bytes which are not covered by an item (strings, arrays and linked objects) are data and are never changed
+typedef struct Item
+{
+    int offset;  // the offset of the instruction's opcode in bytes
+    int size;    // the size of the instruction in bytes
+    int line;    // the line number of the instruction
+    int align;   // 0 for an instruction, the alignment for padding (NOPs), which is sized again whenever the code before it moves
+}Item;
+
+// the items array initally has enough room for 256 instructions
+#define ITEMS_ARRAY_INITIAL_SIZE 256
+_Thread_local Item* items = NULL;
+_Thread_local unsigned int items_count = 0;
+_Thread_local unsigned int item_index = 0;
+
+// the labels defined at the current offset, padding added there moves them past it
+#define OFFSET_LABELS_ARRAY_INITIAL_SIZE 16
+_Thread_local int* offset_labels = NULL;
+_Thread_local unsigned int offset_labels_count = 0;
+_Thread_local unsigned int offset_labels_index = 0;
+_Thread_local int offset_labels_at = -1; // the offset the labels were defined at
+
+_Thread_local int offset = 0; // the current offset in bytes
+
+// the names of the files labels have been defined in, for error messages
+_Thread_local char** label_files = NULL;
+_Thread_local int label_files_index = 0;
+_Thread_local int label_file = -1; // the file being read, -1 before any
 
 // allocate all the compilation arrays
 void allocArrays() {
     // initalize any data structures we need
     labels = (Label*) malloc(sizeof(Label) * LABELS_ARRAY_INITAL_SIZE);
+    label_table = (unsigned int*) calloc(LABEL_TABLE_INITIAL_SIZE, sizeof(unsigned int));
     symbols = (char*) malloc(SYMBOLS_ARRAY_INITIAL_SIZE);
     post_processors = (PostProcessor*) malloc(sizeof(PostProcessor) * POST_PROCESSOR_ARRAY_INITIAL_SIZE);
+    items = (Item*) malloc(sizeof(Item) * ITEMS_ARRAY_INITIAL_SIZE);
+    offset_labels = (int*) malloc(sizeof(int) * OFFSET_LABELS_ARRAY_INITIAL_SIZE);
 
-    if(!labels || !symbols || !post_processors) {
+    if(!labels || !label_table || !symbols || !post_processors || !items || !offset_labels) {
         puts("Memory allocation failure error.");
         exit(-1);
     }
 
     labels_count = LABELS_ARRAY_INITAL_SIZE;
+    label_table_size = LABEL_TABLE_INITIAL_SIZE;
     symbols_count = SYMBOLS_ARRAY_INITIAL_SIZE;
     post_processors_count = POST_PROCESSOR_ARRAY_INITIAL_SIZE;
+    items_count = ITEMS_ARRAY_INITIAL_SIZE;
+    offset_labels_count = OFFSET_LABELS_ARRAY_INITIAL_SIZE;
+    offset_labels_index = 0;
+    offset_labels_at = -1;
+    label_index = 0;
+    symbol_index = 0;
+    post_processors_index = 0;
+    item_index = 0;
+    offset = 0;
+    label_files = NULL;
+    label_files_index = 0;
+    label_file = -1;
 }
 
 // dealloc all the compilation arrays we used
@@ -242,17 +326,70 @@ void freeArrays() {
     int i = 0;
     for(; i < label_index; i++)
         free(labels[i].name);
-
-    for(i = 0; i < post_processors_index; i++)
-        free(post_processors[i].name);
+    for(i = 0; i < label_files_index; i++)
+        free(label_files[i]);
+    if(label_files) free(label_files);
+    label_files = NULL;
 
     if(labels) free(labels);
+    if(label_table) free(label_table);
     if(symbols) free(symbols);
     if(post_processors) free(post_processors);
+    if(items) free(items);
+    if(offset_labels) free(offset_labels);
+    labels = NULL;
+    label_table = NULL;
+    symbols = NULL;
+    post_processors = NULL;
+    items = NULL;
+    offset_labels = NULL;
+}
+
+// FNV-1a hash of a label name
+unsigned int hashName(const char* str) {
+    unsigned int hash = 2166136261u;
+    for(; *str; str++) {
+        hash ^= (unsigned char) *str;
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-// add a label to the labels array
-void addLabel(char* str, int offset) {
+// double the size of the hash table and re-insert every label
+void growLabelTable() {
+    unsigned int size = label_table_size * 2;
+    unsigned int* table = (unsigned int*) calloc(size, sizeof(unsigned int));
+    if(!table) {
+        puts("Memory expansion failure error.");
+        exit(-1);
+    }
+
+    unsigned int i = 0;
+    for(; i < label_index; i++) {
+        if(labels[i].hidden) continue;
+        unsigned int slot = labels[i].hash & (size - 1);
+        while(table[slot]) slot = (slot + 1) & (size - 1);
+        table[slot] = i + 1;
+    }
+
+    free(label_table);
+    label_table = table;
+    label_table_size = size;
+}
+
+// returns the slot of the label in the hash table, or the empty slot it would go in
+unsigned int findLabelSlot(const char* str, unsigned int hash) {
+    unsigned int slot = hash & (label_table_size - 1);
+    while(label_table[slot]) {
+        Label* label = &labels[label_table[slot] - 1];
+        if(label->hash == hash && strcmp(label->name, str) == 0) break;
+        slot = (slot + 1) & (label_table_size - 1);
+    }
+    return slot;
+}
+
+// add an undefined label to the labels array, without putting it in the hash table
+int newLabel(const char* str, unsigned int hash) {
     if(label_index >= labels_count) {
         labels = realloc(labels, sizeof(Label) * labels_count * 2);
         if(!labels) {
@@ -263,37 +400,111 @@ void addLabel(char* str, int offset) {
     }
 
     int len = strlen(str);
-    labels[label_index].name = (char*) malloc(len);
+    labels[label_index].name = (char*) malloc(len + 1);
     if(!labels[label_index].name) {
         puts("Memory allocation failure.");
         exit(-1);
     }
-    memcpy(labels[label_index].name, str, len);
-    labels[label_index].name[len] = '\0';
-    labels[label_index].offset = offset;
-    label_index ++;
+    memcpy(labels[label_index].name, str, len + 1);
+    labels[label_index].hash = hash;
+    labels[label_index].offset = 0;
+    labels[label_index].line = -1;
+    labels[label_index].absolute = 0;
+    labels[label_index].exported = 0;
+    labels[label_index].hidden = 0;
+    labels[label_index].file = -1;
+    return label_index++;
 }
 
-// DEFINITIONS ARE ALSO LABELS
-void addDefinition(char* str, int line) {
-    char* spc = strchr(str, ' ');
-    if(!spc) {
-        printf("Invalid expression on line [%i]: [%s]\n", line, str);
+// returns the index of the label with the name, adding an undefined label if it does not exist yet
+int internLabel(const char* str) {
+    unsigned int hash = hashName(str);
+    unsigned int slot = findLabelSlot(str, hash);
+    if(label_table[slot]) return label_table[slot] - 1;
+
+    int index = newLabel(str, hash);
+    label_table[slot] = index + 1;
+    if(label_index * 2 > label_table_size) growLabelTable();
+    return index;
+}
+
+// the name of the file the label was defined in
+const char* labelFile(const Label* label) {
+    return label->file == -1 ? "?" : label_files[label->file];
+}
+
+// define a label, it is an error to define the same name twice
+// returns the index of the label
+int addLabel(const char* str, int offset, int line) {
+    int index = internLabel(str); // may move the labels array
+    Label* label = &labels[index];
+    if(label->line != -1) {
+        printf("Error: Label [%s] on line %i of [%s] was already defined on line %i of [%s].\n",
+            str, line, label_file == -1 ? "?" : label_files[label_file], label->line, labelFile(label));
         exit(-1);
     }
-    char* name = (char*) malloc(spc - str + 1);
-    if(!name) { puts("Memory allocation failure."); exit(-1); }
-    memcpy(name, str, spc-str);
-    name[spc-str] = '\0';
-    int i = parse_value(spc + 1, line, PARSE_INT, UNSIGNED);
-    addLabel(name, i);
-    free(name);
+    label->offset = offset;
+    label->line = line;
+    label->file = label_file;
+    return index;
+}
+
+// define a label of a linked object which the object did not export, it is only reached through the object's relocations
+int addHiddenLabel(const char* str, int offset, int line) {
+    int index = newLabel(str, hashName(str));
+    labels[index].offset = offset;
+    labels[index].line = line;
+    labels[index].hidden = 1;
+    labels[index].file = label_file;
+    return index;
+}
+
+// make the file the one labels are being defined in, returns the file it replaces
+int enterFile(const char* path) {
+    int previous = label_file;
+    char** files = (char**) realloc(label_files, sizeof(char*) * (label_files_index + 1));
+    if(!files) {
+        puts("Memory expansion failure error.");
+        exit(-1);
+    }
+    label_files = files;
+    label_files[label_files_index] = strdup(path);
+    if(!label_files[label_files_index]) {
+        puts("Memory allocation failure.");
+        exit(-1);
+    }
+    label_file = label_files_index++;
+    return previous;
+}
+
+// expand a local label name (.name) into the name under its parent label (parent.name)
+// other names are copied as they are
+void scopeLabel(char* output, const char* scope, const char* str, int line) {
+    if(str[0] != '.') {
+        strcpy(output, str);
+        return;
+    }
+    if(scope[0] == '\0') {
+        printf("Error: Local label [%s] on line %i has no parent label.\n", str, line);
+        exit(-1);
+    }
+    if(strlen(scope) + strlen(str) >= MAX_NAME_LENGTH * 2) {
+        printf("Error: Local label [%s] on line %i is too long.\n", str, line);
+        exit(-1);
+    }
+    sprintf(output, "%s%s", scope, str);
+}
+
+// DEFINITIONS ARE ALSO LABELS
+void addDefinition(char* name, char* value, int line) {
+    int i = parse_value(value, line, PARSE_INT, UNSIGNED);
+    labels[addLabel(name, i, line)].absolute = 1;
 }
 
 // add the code to the symbols array
 void addSymbol(void* ptr, int bytes) {
     while(symbol_index + bytes >= symbols_count) {
-        printf("%i + %i = %i >= %i\n", symbol_index, bytes, symbol_index + bytes, symbols_count);
+        trace("%i + %i = %i >= %i\n", symbol_index, bytes, symbol_index + bytes, symbols_count);
         symbols = (char*) realloc(symbols, symbols_count * 2);
         if(!symbols) {
             puts("Memory expansion failure error.");
@@ -306,8 +517,8 @@ void addSymbol(void* ptr, int bytes) {
     symbol_index += bytes;
 }
 
-// add a new post processor to the post processors array
-void addPostProcessor(char* name, int offset, int line, int size) {
+// add a new post processor for the label at the index to the post processors array
+void addReference(int label, int offset, int line, int size) {
     if(post_processors_index >= post_processors_count) {
         post_processors = (PostProcessor*) realloc(post_processors, sizeof(PostProcessor) * post_processors_count * 2);
         if(!post_processors) {
@@ -317,105 +528,320 @@ void addPostProcessor(char* name, int offset, int line, int size) {
         post_processors_count *= 2;
     }
 
-    int len = strlen(name);
-    post_processors[post_processors_index].name = (char*) malloc(len + 1);
-    memcpy(post_processors[post_processors_index].name, name, len);
+    post_processors[post_processors_index].label = label;
     post_processors[post_processors_index].offset = offset;
     post_processors[post_processors_index].line = line;
     post_processors[post_processors_index].size = size;
     post_processors_index ++;
 }
 
-// find the label with the given name in the label's array
-Label* findLabel(const char* str) {
-    int o = 0;
-    for(o = 0; o < label_index; o++) {
-        if(strcmp(labels[o].name, str) == 0) {
-            return &labels[o];
+// add a new post processor for the label with the name
+void addPostProcessor(const char* name, int offset, int line, int size) {
+    addReference(internLabel(name), offset, line, size);
+}
+
+// record an assembled instruction
+void addItem(int offset, int size, int line) {
+    if(item_index >= items_count) {
+        items = (Item*) realloc(items, sizeof(Item) * items_count * 2);
+        if(!items) {
+            puts("Memory expansion failure error.");
+            exit(-1);
         }
+        items_count *= 2;
     }
 
-    return NULL;
+    items[item_index].offset = offset;
+    items[item_index].size = size;
+    items[item_index].line = line;
+    items[item_index].align = 0;
+    item_index ++;
 }
 
-int offset = 0; // the current offset in bytes
+// remember a label the parser defined at the current offset
+void noteLabel(int index) {
+    if(offset_labels_at != offset) {
+        offset_labels_at = offset;
+        offset_labels_index = 0;
+    }
+    if(offset_labels_index >= offset_labels_count) {
+        offset_labels = (int*) realloc(offset_labels, sizeof(int) * offset_labels_count * 2);
+        if(!offset_labels) {
+            puts("Memory expansion failure error.");
+            exit(-1);
+        }
+        offset_labels_count *= 2;
+    }
+    offset_labels[offset_labels_index++] = index;
+}
+
+// the bytes of padding needed at the offset to reach a multiple of align
+#define padding(offset, align) (((align) - (offset) % (align)) % (align))
+
+// pad the output with NOPs to a multiple of align bytes, the labels defined at the current offset move past the padding
+void addPadding(int align, int line) {
+    int size = padding(offset, align);
+    addItem(offset, size, line);
+    items[item_index - 1].align = align;
+
+    char nop = NOP;
+    int i = 0;
+    for(; i < size; i++) addSymbol(&nop, 1);
+    if(offset_labels_at == offset)
+        for(i = 0; i < offset_labels_index; i++) labels[offset_labels[i]].offset += size;
+    offset += size;
+    offset_labels_at = offset;
+}
 
-void read(const char* path);
-void link(const char* path);
+// find the defined label with the given name
+Label* findLabel(const char* str) {
+    unsigned int slot = findLabelSlot(str, hashName(str));
+    if(!label_table[slot]) return NULL;
+    Label* label = &labels[label_table[slot] - 1];
+    return label->line != -1 ? label : NULL;
+}
+
+void readSource(const char* path);
+void optimize(const char* path);
+void linkObject(const char* path);
+void linkBuffer(const char* path, char* data, long size);
+void relax();
+void substitute(const PostProcessor* p);
+void resolve();
+void writeObject(FILE* output);
+void writeRom(const char* path);
+char* assembleModule(const char* path, long* size);
+void assembleModules(const char** paths, char** objects, long* sizes, int count, int threads);
+int optimizing = 0; // -O runs the peephole optimizer over every module before its labels are resolved
+const char* cache_path = NULL; // -cache dir reuses the objects of unchanged modules
+atomic_int cache_hits = 0;
+atomic_int cache_misses = 0;
 
 int main(int argc, char* argv[])
 {
-    if(argc != 3) {
-        puts("Error: expected 3 arguments.");
+    // compiler [-v] [-c] [-O] [-j threads] [-cache dir] input... output
+    int a = 1;
+    int object = 0;  // -c writes a relocatable object instead of a ROM
+    int threads = 0; // the number of modules assembled at the same time, one per core by default
+    for(; a < argc && argv[a][0] == '-'; a++) {
+        if(strcmp(argv[a], "-v") == 0) verbose = 1;
+        else if(strcmp(argv[a], "-c") == 0) object = 1;
+        else if(strcmp(argv[a], "-O") == 0) optimizing = 1;
+        else if(strcmp(argv[a], "-j") == 0 && a + 1 < argc) threads = atoi(argv[++a]);
+        else if(strcmp(argv[a], "-cache") == 0 && a + 1 < argc) cache_path = argv[++a];
+        else {
+            printf("Error: Unknown option [%s].\n", argv[a]);
+            return -1;
+        }
+    }
+    int count = argc - a - 1;
+    const char* output_path = argv[argc - 1];
+    if(count < 1) {
+        puts("Error: expected an input and an output.");
+        return -1;
+    }
+    if(object && count != 1) {
+        puts("Error: -c takes a single input.");
         return -1;
     }
+    if(threads <= 0) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads > count) threads = count;
+    if(threads < 1) threads = 1;
+
+    if(count == 1 && !object && !cache_path) {
+        allocArrays();
+        readSource(argv[a]);
+        if(optimizing) optimize(argv[a]);
+        relax();
+        resolve();
+        writeRom(output_path);
+        freeArrays();
+        trace("Successful termination\n");
+        return 0;
+    }
 
-    allocArrays();
-    read(argv[1]);
+    // assemble every input into an object, then link them in the order they were given
+    char** objects = (char**) malloc(sizeof(char*) * count);
+    long* sizes = (long*) malloc(sizeof(long) * count);
+    if(!objects || !sizes) {
+        puts("Memory allocation failure.");
+        return -1;
+    }
+    assembleModules((const char**) argv + a, objects, sizes, count, threads);
 
-    puts("Writing output");
+    if(object) {
+        FILE* output = fopen(output_path, "wb");
+        if(!output) {
+            printf("Could not open output file [%s] for writing.\n", output_path);
+            return -1;
+        }
+        fwrite(objects[0], 1, sizes[0], output);
+        fclose(output);
+    }
+    else {
+        allocArrays();
+        int i = 0;
+        for(; i < count; i++)
+            linkBuffer(argv[a + i], objects[i], sizes[i]);
+        relax();
+        resolve();
+        writeRom(output_path);
+        freeArrays();
+    }
+
+    int i = 0;
+    for(; i < count; i++)
+        free(objects[i]);
+    free(objects);
+    free(sizes);
+
+    if(cache_path) printf("Cache: %i hits, %i misses.\n", cache_hits, cache_misses);
+    trace("Successful termination\n");
+    return 0;
+}
+
+// write the ROM: the code start followed by the code
+void writeRom(const char* path)
+{
+    trace("Writing output\n");
     // write the output
-    FILE* output = fopen(argv[2], "wb");
+    FILE* output = fopen(path, "wb");
     if(!output) {
-        printf("Could not open output file [%s] for writing.\n", argv[2]);
-        return -1;
+        printf("Could not open output file [%s] for writing.\n", path);
+        exit(-1);
     }
     Label* code_start = findLabel("_CODE_");
     unsigned int start = 0;
     if(code_start == NULL) start = 0; else start = code_start->offset;
-    printf("Code start: %i\n", start);
+    trace("Code start: %i\n", start);
     fwrite(&start, sizeof(unsigned int), 1, output);
 
     // write the code symbols
-    printf("Writing [%i] symbols.\n", symbol_index);
+    trace("Writing [%i] symbols.\n", symbol_index);
     fwrite(symbols, sizeof(char), symbol_index, output);
     fclose(output);
+}
 
-    freeArrays();
 
-    puts("Successful termination");
-    return 0;
+// tokens produced by the lexer:
+#define TOKEN_WORD    0 // an instruction, register, value, label reference, directive or path
+#define TOKEN_LABEL   1 // a label definition, the text is the name without the colon
+#define TOKEN_STRING  2 // a string, the text is its bytes with the escapes replaced
+#define TOKEN_TYPE    3 // an array type, the text is the type without the angle brackets
+#define TOKEN_OPEN    4 // [
+#define TOKEN_COMMA   5 // ,
+#define TOKEN_CLOSE   6 // ]
+#define TOKEN_NEWLINE 7
+#define TOKEN_END     8
+
+typedef struct Token
+{
+    int type;   // one of the TOKEN_* types
+    int text;   // the offset of the null terminated text in the source's text buffer
+    int length; // the length of the text in bytes
+    int line;   // the position of the token in the file, both counting from 1
+    int column;
+}Token;
+
+// a source file and its tokens
+typedef struct Source
+{
+    const char* path;
+    char* data;        // the whole file
+    long size;
+    Token* tokens;
+    int token_count;
+    int tokens_size;   // the capacity of the tokens array
+    char* text;        // the text of every token, it is never longer than the file plus a terminator per token
+    int text_index;
+}Source;
+
+#define TOKENS_ARRAY_INITIAL_SIZE 1024
+
+#define TOKEN_TEXT(source, token) ((source)->text + (token)->text)
+
+// characters which end a word
+#define isSeparator(x) ((x) == ' ' || (x) == '\t' || (x) == '\r' || (x) == '\n' || (x) == ';' || (x) == ',' || (x) == '[' || (x) == ']' || (x) == ':' || (x) == '"')
+
+void tokenError(Source* source, Token* token, const char* message) {
+    printf("Error in [%s] on line %i, column %i: %s [%s].\n", source->path, token->line, token->column, message, TOKEN_TEXT(source, token));
+    exit(-1);
 }
 
+// append a token with a copy of size bytes of text
+void addToken(Source* source, int type, const char* text, int size, int line, int column) {
+    if(source->token_count >= source->tokens_size) {
+        source->tokens_size = source->tokens_size ? source->tokens_size * 2 : TOKENS_ARRAY_INITIAL_SIZE;
+        source->tokens = (Token*) realloc(source->tokens, sizeof(Token) * source->tokens_size);
+        if(!source->tokens) {
+            puts("Memory expansion failure error.");
+            exit(-1);
+        }
+    }
 
-void read(const char* path)
-{
-    FILE* input = fopen(path, "r");
-    if(!input) {
-        printf("Could not open input file [%s] for reading.\n", path);
+    Token* token = &source->tokens[source->token_count++];
+    token->type = type;
+    token->text = source->text_index;
+    token->length = size;
+    token->line = line;
+    token->column = column;
+    memcpy(source->text + source->text_index, text, size);
+    source->text[source->text_index + size] = '\0';
+    source->text_index += size + 1;
+}
+
+// split the whole file into tokens in a single pass
+void lex(Source* source) {
+    source->text = (char*) malloc(source->size * 2 + 2);
+    if(!source->text) {
+        puts("Memory allocation failure.");
         exit(-1);
     }
 
-    // temporary use variables
-    char reg = 0; // the register
-    char opcode = 0; // the current opcode
-    unsigned int line = 0; // the current line number
-    unsigned int symbol = 0; // the current type of symbol being read (for the FSM)
+    const char* data = source->data;
+    long i = 0, line_start = 0;
+    int line = 1;
+    while(i < source->size) {
+        char c = data[i];
+        int column = i - line_start + 1;
+        long start = i;
 
-    char buffer[MAX_LINE_LENGTH]; // the buffer for the currently read string
-    unsigned int buffer_index = 0; // the index of the next character to be inserted
+        switch(c) {
+            case ' ':
+            case '\t':
+            case '\r':
+                i++;
+                break;
 
-    // temporary data types used for writing
-    unsigned char t_byte = 0;
-    unsigned short t_short = 0;
-    unsigned int t_int = 0;
-    float t_float = 0;
+            case ';': // skip the comment
+                while(i < source->size && data[i] != '\n') i++;
+                break;
 
-    while(1)
-    {
-        char c = fgetc(input);
-        if(feof(input) != 0) break;
-
-        switch(c)
-        {
-            case '"':
-                // read the string
-                printf("\"");
-                while(1) {
-                    c = fgetc(input);
+            case '\n':
+                addToken(source, TOKEN_NEWLINE, "", 0, line, column);
+                i++;
+                line++;
+                line_start = i;
+                break;
+
+            case '[': addToken(source, TOKEN_OPEN, "[", 1, line, column); i++; break;
+            case ',': addToken(source, TOKEN_COMMA, ",", 1, line, column); i++; break;
+            case ']': addToken(source, TOKEN_CLOSE, "]", 1, line, column); i++; break;
+
+            case '"': {
+                // decode the string straight into the text buffer
+                char* output = source->text + source->text_index;
+                int length = 0;
+                int string_line = line;
+                for(i++; ; i++) {
+                    if(i >= source->size) {
+                        printf("Unexpected end of file on line %i: string not terminated.\n", string_line);
+                        exit(-1);
+                    }
+                    c = data[i];
                     if(c == '"') break;
-                    else if(c == '\\') { // parsing special characters
-                        c = fgetc(input);
+                    if(c == '\\') { // parsing special characters
+                        c = ++i < source->size ? data[i] : 0;
                         switch(c) {
                             case 'n':
                                 c = '\n';
@@ -425,390 +851,1176 @@ void read(const char* path)
                                 exit(-1);
                         }
                     }
-                    offset++;
-                    printf("%c", c);
-                    if(feof(input) != 0) {
-                        printf("Unexpected end of file on line %i: string not terminated.\n", line);
-                        exit(-1);
+                    else if(c == '\n') {
+                        line++;
+                        line_start = i + 1;
                     }
-                    addSymbol(&c, 1);
+                    output[length++] = c;
                 }
-                printf("\"\n");
-                buffer_index = 0;
+                i++;
+                addToken(source, TOKEN_STRING, output, length, string_line, column);
                 break;
+            }
 
-            case '>':
-                buffer[buffer_index] = '\0';
-                if(buffer[0] != '<') {
+            case '<':
+                while(i < source->size && data[i] != '>' && data[i] != '\n') i++;
+                if(i >= source->size || data[i] != '>') {
                     printf("Bad array type expression on line %i.\n", line);
                     exit(-1);
                 }
+                addToken(source, TOKEN_TYPE, data + start + 1, i - start - 1, line, column);
+                i++;
+                break;
 
-                // get the type of the array:
-                if(strcmp(buffer + 1, "byte") == 0){ printf("bytes: "); symbol = 2; }
-                else if(strcmp(buffer + 1, "short") == 0){ printf("shorts: "); symbol = 3; }
-                else if(strcmp(buffer + 1, "int") == 0){ printf("integers: "); symbol = 4; }
-                else if(strcmp(buffer + 1, "float") == 0){ printf("floats: "); symbol = 5; }
-                else {
-                    printf("Invalid array type [%s] on line %i.\n", buffer, line);
-                    exit(-1);
-                }
+            case '\'': // a character value, which may be a separator
+                i += i + 1 < source->size && data[i + 1] == '\\' ? 2 : 1;
+                if(i + 1 < source->size && data[i + 1] == '\'') i += 2;
+                while(i < source->size && !isSeparator(data[i])) i++;
+                addToken(source, TOKEN_WORD, data + start, i - start, line, column);
+                break;
 
-                if(fgetc(input) != '[') {
-                    printf("Error expected array beginning on line %i.\n", line);
-                    exit(-1);
+            default:
+                while(i < source->size && !isSeparator(data[i])) i++;
+                if(i < source->size && data[i] == ':') {
+                    addToken(source, TOKEN_LABEL, data + start, i - start, line, column);
+                    i++;
                 }
-                buffer_index = 0;
+                else addToken(source, TOKEN_WORD, data + start, i - start, line, column);
+                break;
+        }
+    }
+    addToken(source, TOKEN_END, "", 0, line, (int) (i - line_start + 1));
+}
+
+// returns the register of the token, which must be the next operand on the line
+int registerOperand(Source* source, Token* token) {
+    if(token->type != TOKEN_WORD) tokenError(source, token, "Expected a register");
+    int reg = parse_register(TOKEN_TEXT(source, token));
+    if(reg == -1) tokenError(source, token, "Invalid register");
+    trace("r:%i ", reg);
+    return reg;
+}
+
+// the size of the register in bytes
+int registerSize(int reg) {
+    if(inRange(reg, AL, DH)) return 1;
+    if(inRange(reg, AX, DX)) return 2;
+    return 4;
+}
+
+// write a size byte value operand, label references are filled in later
+void valueOperand(Source* source, Token* token, int size, const char* scope) {
+    if(token->type != TOKEN_WORD) tokenError(source, token, "Expected a value");
+    char* text = TOKEN_TEXT(source, token);
+    char name[MAX_NAME_LENGTH * 2];
+    unsigned char t_byte = 0;
+    unsigned short t_short = 0;
+    unsigned int t_int = 0;
+
+    if(isLetter(text[0]) || text[0] == '.') {
+        if(token->length >= MAX_NAME_LENGTH) tokenError(source, token, "Label name too long");
+        // insert lookup symbol
+        scopeLabel(name, scope, text, token->line);
+        addPostProcessor(name, offset, token->line, size);
+        trace("%c:[%s]\n", size == 1 ? 'b' : size == 2 ? 's' : 'i', name);
+    }
+    else if(size == 1) {
+        t_byte = parse_value(text, token->line, PARSE_BYTE, UNSIGNED);
+        trace("b:%i\n", t_byte);
+    }
+    else if(size == 2) {
+        t_short = parse_value(text, token->line, PARSE_SHORT, UNSIGNED);
+        trace("s:%i\n", t_short);
+    }
+    else {
+        t_int = parse_value(text, token->line, PARSE_INT, UNSIGNED);
+        trace("i:%i\n", t_int);
+    }
+
+    if(size == 1) addSymbol(&t_byte, 1);
+    else if(size == 2) addSymbol(&t_short, 2);
+    else addSymbol(&t_int, 4);
+    offset += size;
+}
+
+// assemble an instruction and its operands, returns the token after it
+Token* parseInstruction(Source* source, Token* token, const char* scope) {
+    int start = offset;
+    int line = token->line;
+    char opcode = parse_instruction(TOKEN_TEXT(source, token));
+    if(opcode == -1) tokenError(source, token, "Invalid instruction");
+
+    int operands; // the operands which follow the opcode:
+    // 0: none
+    // 1: a register followed by a value of the register's size
+    // 6: a byte
+    // 8: an integer
+    // 9: 2 registers of the same size
+    // 10: a single register
+    switch(opcode) {
+        case NOP:   trace("%i: NOP\n",   offset); operands = 0;  break;
+        case INT:   trace("%i: INT ",    offset); operands = 6;  break;
+        case MOV:   trace("%i: MOV ",    offset); operands = 1;  break;
+        case CPY:   trace("%i: CPY ",    offset); operands = 9;  break;
+        case ADD:   trace("%i: ADD ",    offset); operands = 9;  break;
+        case SUB:   trace("%i: SUB ",    offset); operands = 9;  break;
+        case INC:   trace("%i: INC ",    offset); operands = 1;  break;
+        case DEC:   trace("%i: DEC ",    offset); operands = 1;  break;
+        case CMP:   trace("%i: CMP ",    offset); operands = 9;  break;
+        case JMP:   trace("%i: JMP ",    offset); operands = 8;  break;
+        case JEQ:   trace("%i: JEQ ",    offset); operands = 8;  break;
+        case JLE:   trace("%i: JLE ",    offset); operands = 8;  break;
+        case JGE:   trace("%i: JGE ",    offset); operands = 8;  break;
+        case JNE:   trace("%i: JNE ",    offset); operands = 8;  break;
+        case PUSH:  trace("%i: PUSH ",   offset); operands = 10; break;
+        case POP:   trace("%i: POP ",    offset); operands = 10; break;
+        case FETCH: trace("%i: FETCH ",  offset); operands = 10; break;
+        case WRITE: trace("%i: WRITE ",  offset); operands = 10; break;
+        case RET:   trace("%i: RET\n",   offset); operands = 0;  break;
+        case HLT:   trace("%i: HLT\n",   offset); operands = 0;  break;
+        case IRET:  trace("%i: IRET\n",  offset); operands = 0;  break;
+        case CALL:  trace("%i: CALL ",   offset); operands = 8;  break;
+        case CCMP:  trace("%i: CCMP ",   offset); operands = 1;  break;
+        case CAS:   trace("%i: CAS ",    offset); operands = 9;  break;
+        case XADD:  trace("%i: XADD ",   offset); operands = 10; break;
+        case XCHG:  trace("%i: XCHG ",   offset); operands = 10; break;
+        case FENCE: trace("%i: FENCE\n", offset); operands = 0;  break;
+        case TASK:  trace("%i: TASK ",   offset); operands = 10; break;
+        case YIELD: trace("%i: YIELD\n", offset); operands = 0;  break;
+        case JOIN:  trace("%i: JOIN ",   offset); operands = 10; break;
+        default:
+            tokenError(source, token, "Unknown opcode");
+            return token;
+    }
+
+    addSymbol(&opcode, 1);
+    offset ++;
+    token++;
+
+    char reg;
+    switch(operands) {
+        case 1:
+        case 9:
+        case 10:
+            reg = registerOperand(source, token++);
+            addSymbol(&reg, 1);
+            offset ++; // register indices are byte-sized
+
+            if(operands == 9) {
+                char second = registerOperand(source, token);
+                if(registerSize(second) != registerSize(reg)) tokenError(source, token, "Register size mismatch");
+                token++;
+                trace("\n");
+                addSymbol(&second, 1);
+                offset ++;
+            }
+            else if(operands == 1) valueOperand(source, token++, registerSize(reg), scope);
+            else trace("\n");
+            break;
+
+        case 6:
+            valueOperand(source, token++, 1, scope);
+            break;
+
+        case 8:
+            valueOperand(source, token++, 4, scope);
+            break;
+    }
+    addItem(start, offset - start, line);
+    return token;
+}
+
+// assemble an array <type>[e0, e1, ...], which may span several lines, returns the token after it
+Token* parseArray(Source* source, Token* token) {
+    char* type = TOKEN_TEXT(source, token);
+    int mode;
+    if(strcmp(type, "byte") == 0){ trace("bytes: "); mode = PARSE_BYTE; }
+    else if(strcmp(type, "short") == 0){ trace("shorts: "); mode = PARSE_SHORT; }
+    else if(strcmp(type, "int") == 0){ trace("integers: "); mode = PARSE_INT; }
+    else if(strcmp(type, "float") == 0){ trace("floats: "); mode = PARSE_FLOAT; }
+    else {
+        tokenError(source, token, "Invalid array type");
+        return token;
+    }
+    // arrays are aligned to the size of their elements
+    if(mode == PARSE_SHORT) addPadding(2, token->line);
+    else if(mode != PARSE_BYTE) addPadding(4, token->line);
+    token++;
+    if(token->type != TOKEN_OPEN) tokenError(source, token, "Expected the array beginning");
+    token++;
+
+    unsigned char t_byte = 0;
+    unsigned short t_short = 0;
+    unsigned int t_int = 0;
+    float t_float = 0;
+    while(1) {
+        while(token->type == TOKEN_NEWLINE) token++;
+        if(token->type != TOKEN_WORD) tokenError(source, token, "Expected an array element");
+        char* text = TOKEN_TEXT(source, token);
+        switch(mode) {
+            case PARSE_BYTE:
+                t_byte = parse_value(text, token->line, PARSE_BYTE, UNSIGNED);
+                trace(", %i", t_byte);
+                addSymbol(&t_byte, 1);
+                offset ++;
                 break;
 
-            case ':':
-                buffer[buffer_index] = '\0'; // if it is a label, terminate at the color
-                printf("New label: %s\n", buffer);
-                addLabel(buffer, offset);
-                buffer_index = 0;
+            case PARSE_SHORT:
+                t_short = parse_value(text, token->line, PARSE_SHORT, UNSIGNED);
+                trace(", %i", t_short);
+                addSymbol(&t_short, 2);
+                offset += 2;
                 break;
 
-            case ';':
-                buffer[buffer_index] = '\0';
-                while(fgetc(input) != '\n' && feof(input) == 0) {} // skip the comment line
-            case '\n':
-                line++;
-            case ' ':
-            case '\t':
-                if(buffer_index == 0)  { line++; break; } // empty string test
-                buffer[buffer_index++] = '\0'; // null terminate the string
-
-                // check if this is an include statement
-                if(buffer[0] == '#') {
-                    if(strcmp(buffer + 1, "include") == 0) {
-                        symbol = 14;
-                    } else if(strcmp(buffer + 1, "link") == 0) {
-                        symbol = 15;
-                    } else if(strcmp(buffer + 1, "def") == 0) {
-                        symbol = 16;
-                    } else {
-                        printf("Unknown directive [%s] on line [%i].\n", buffer, line);
-                        exit(-1);
-                    }
-                    buffer_index = 0;
-                    break;
-                }
+            case PARSE_INT:
+                t_int = parse_value(text, token->line, PARSE_INT, UNSIGNED);
+                trace(", %i", t_int);
+                addSymbol(&t_int, 4);
+                offset += 4;
+                break;
 
-                switch(symbol)
-                {
-                    case 0: // opcode mode
-                        opcode = parse_instruction(buffer);
-                        if(opcode == -1) {
-                            printf("Invalid instruction on line %i: [%s]\n", line, buffer);
-                            exit(-1);
-                        }
+            case PARSE_FLOAT:
+                t_float = parse_value(text, token->line, PARSE_FLOAT, UNSIGNED);
+                trace(", %ff", t_float);
+                addSymbol(&t_float, 4);
+                offset += 4;
+                break;
+        }
+        token++;
+        while(token->type == TOKEN_NEWLINE) token++;
+        if(token->type == TOKEN_CLOSE) break;
+        if(token->type != TOKEN_COMMA) tokenError(source, token, "Expected a comma or the array end");
+        token++;
+    }
+    trace("\n");
+    return token + 1;
+}
 
-                        switch(opcode) {
-                            case NOP:   opcode = NOP;   printf("%i: NOP\n",  offset); symbol = 0;  break;
-                            case INT:   opcode = INT;   printf("%i: INT ",   offset); symbol = 6;  break;
-                            case MOV:   opcode = MOV;   printf("%i: MOV ",   offset); symbol = 1;  break;
-                            case CPY:   opcode = CPY;   printf("%i: CPY ",   offset); symbol = 9;  break;
-                            case ADD:   opcode = ADD;   printf("%i: ADD ",   offset); symbol = 9;  break;
-                            case SUB:   opcode = SUB;   printf("%i: SUB ",   offset); symbol = 9;  break;
-                            case INC:   opcode = INC;   printf("%i: INC ",   offset); symbol = 1;  break;
-                            case DEC:   opcode = DEC;   printf("%i: DEC ",   offset); symbol = 1;  break;
-                            case CMP:   opcode = CMP;   printf("%i: CMP ",   offset); symbol = 9;  break;
-                            case JMP:   opcode = JMP;   printf("%i: JMP ",   offset); symbol = 8;  break;
-                            case JEQ:   opcode = JEQ;   printf("%i: JEQ ",   offset); symbol = 8;  break;
-                            case JLE:   opcode = JLE;   printf("%i: JLE ",   offset); symbol = 8;  break;
-                            case JGE:   opcode = JGE;   printf("%i: JGE ",   offset); symbol = 8;  break;
-                            case JNE:   opcode = JNE;   printf("%i: JNE ",   offset); symbol = 8;  break;
-                            case PUSH:  opcode = PUSH;  printf("%i: PUSH ",  offset); symbol = 10; break;
-                            case POP:   opcode = POP;   printf("%i: POP ",   offset); symbol = 10; break;
-                            case FETCH: opcode = FETCH; printf("%i: FETCH ", offset); symbol = 10; break;
-                            case WRITE: opcode = WRITE; printf("%i: WRITE ", offset); symbol = 10; break;
-                            case RET:   opcode = RET;   printf("%i: RET\n",  offset); symbol = 0;  break;
-                            case CALL:  opcode = CALL;  printf("%i: CALL ",  offset); symbol = 8;  break;
-                            case CCMP:  opcode = CCMP;  printf("%i: CCMP ",  offset); symbol = 1;  break;
-                            default:
-                                printf("Unknown opcode [%s] on line %i.\n", buffer, line);
-                                exit(-1);
-                        }
+// handle a #include, #link, #def, #align or #export directive, returns the token after it
+Token* parseDirective(Source* source, Token* token) {
+    char* directive = TOKEN_TEXT(source, token);
+    Token* argument = token + 1;
+    if(argument->type != TOKEN_WORD) tokenError(source, token, "Expected an argument to the directive");
 
-                        addSymbol(&opcode, 1);
-                        buffer_index = 0;
-                        offset ++;
-                        break;
-
-                    case 14: // expecting the path to the source file to include
-                        read(buffer);
-                        buffer_index = 0;
-                        break;
-                    case 15: // expecting the path to the source file to link to
-                        link(buffer);
-                        buffer_index = 0;
-                        break;
-                    case 16: // expecting the define statement's name
-                        if(c == '\n') { // only read the expression on a new line
-                            addDefinition(buffer, line);
-                            buffer_index = 0;
-                        }
-                        else {
-                            buffer[buffer_index - 1] = ' '; // replace the terminator with a newline
-                        }
-                        break;
-
-                    case 1:  // expecing a register followed by a value
-                    case 9:  // expecting 2 registers
-                    case 10: // expecting a single register
-                        reg = parse_register(buffer);
-                        if(reg == -1) {
-                            printf("Invalid register on line %i: [%s]\n", line, buffer);
-                            exit(-1);
-                        }
-                        printf("r:%i ", reg);
-                        addSymbol(&reg, 1);
-                        buffer_index = 0;
-                        offset ++; // register indices are byte-sized
-
-                        if(symbol == 9) { // if we are expecting 2 registers, then we pass control to the state which checks for specific register sizes
-                            switch(reg) {
-                                case AL:
-                                case AH:
-                                case BL:
-                                case BH:
-                                case CL:
-                                case CH:
-                                case DL:
-                                case DH:
-                                    symbol = 11;
-                                    break;
-
-                                case AX:
-                                case BX:
-                                case CX:
-                                case DX:
-                                    symbol = 12;
-                                    break;
-
-                                case EAX:
-                                case EBX:
-                                case ECX:
-                                case EDX:
-                                case ESB:
-                                case ESP:
-                                case ESI:
-                                case EDI:
-                                case EIP:
-                                case FLG:
-                                    symbol = 13;
-                                    break;
-                            }
-                        }
-                        else if(symbol == 1) { // if we are expecting the register followed by an integer, pass control to the state which reads the correct value sizes
-                            switch(reg) {
-                                case AL:
-                                case AH:
-                                case BL:
-                                case BH:
-                                case CL:
-                                case CH:
-                                case DL:
-                                case DH:
-                                    symbol = 6;
-                                    break;
-
-                                case AX:
-                                case BX:
-                                case CX:
-                                case DX:
-                                    symbol = 7;
-                                    break;
-
-                                case EAX:
-                                case EBX:
-                                case ECX:
-                                case EDX:
-                                case ESB:
-                                case ESP:
-                                case ESI:
-                                case EDI:
-                                case EIP:
-                                case FLG:
-                                    symbol = 8;
-                                    break;
-                            }
-                        }
-                        else {
-                            symbol = 0;
-                            printf("\n");
-                        }
-                        break;
-
-                    case 11: // expecting an 8 bit register
-                    case 12: // expecting a 16 bit register
-                    case 13: // expecting a 32 bit register
-                        reg = parse_register(buffer);
-                        if(reg == -1) {
-                            printf("Invalid register on line %i: [%s]\n", line, buffer);
-                            exit(-1);
-                        }
+    if(strcmp(directive + 1, "include") == 0) {
+        readSource(TOKEN_TEXT(source, argument));
+        return argument + 1;
+    }
+    if(strcmp(directive + 1, "link") == 0) {
+        linkObject(TOKEN_TEXT(source, argument));
+        return argument + 1;
+    }
+    if(strcmp(directive + 1, "align") == 0) { // #align bytes
+        int align = parse_value(TOKEN_TEXT(source, argument), argument->line, PARSE_INT, UNSIGNED);
+        if(align <= 0 || (align & (align - 1)) != 0) tokenError(source, argument, "The alignment must be a power of 2");
+        if(align > 1) addPadding(align, argument->line);
+        return argument + 1;
+    }
+    if(strcmp(directive + 1, "export") == 0) { // #export name, other modules may use the label
+        labels[internLabel(TOKEN_TEXT(source, argument))].exported = 1;
+        return argument + 1;
+    }
+    if(strcmp(directive + 1, "def") == 0) { // #def name value
+        Token* value = argument + 1;
+        if(value->type != TOKEN_WORD) tokenError(source, argument, "Expected a value for the definition");
+        addDefinition(TOKEN_TEXT(source, argument), TOKEN_TEXT(source, value), argument->line);
+        return value + 1;
+    }
 
-                        if((symbol==11 && !inRange(reg, AL, DH)) || (symbol==12 && !inRange(reg, AX, DX)) || (symbol==13 && !inRange(reg, EAX, FLG))) {
-                            printf("Register size mismatch on line %i.\n", line);
-                            exit(-1);
-                        }
+    tokenError(source, token, "Unknown directive");
+    return token;
+}
 
-                        printf("r:%i\n", reg);
-                        addSymbol(&reg, 1);
-                        symbol = 0;
-                        buffer_index = 0;
-                        offset ++;
-                        break;
-
-                    case 6: // expecting a byte
-                        if(isLetter(buffer[0])) {
-                            t_byte = 0;
-                            // insert lookup symbol
-                            addPostProcessor(buffer, offset, line, 1);
-                            printf("b:[%s]\n", buffer);
-                        }
-                        else {
-                            t_byte = parse_value(buffer, line, PARSE_BYTE, UNSIGNED);
-                            printf("b:%i\n", t_byte);
-                        }
+// assemble the tokens of a source file
+void parse(Source* source) {
+    char scope[MAX_NAME_LENGTH] = ""; // the last label which was not local, the parent of local (.name) labels
+    char name[MAX_NAME_LENGTH * 2];   // a label name with its scope
+
+    Token* token = source->tokens;
+    while(token->type != TOKEN_END) {
+        char* text = TOKEN_TEXT(source, token);
+        switch(token->type) {
+            case TOKEN_NEWLINE:
+                token++;
+                break;
 
-                        addSymbol(&t_byte, 1);
-                        offset ++;
-                        buffer_index = 0;
-                        symbol = 0;
-                        break;
-
-                    case 7: // expecting a short
-                        if(isLetter(buffer[0])) {
-                            t_short = 0;
-                            // insert lookup symbol
-                            addPostProcessor(buffer, offset, line, 2);
-                            printf("s:[%s]\n", buffer);
-                        }
-                        else {
-                            t_short = parse_value(buffer, line, PARSE_SHORT, UNSIGNED);
-                            printf("s:%i\n", t_short);
-                        }
+            case TOKEN_LABEL:
+                if(token->length >= MAX_NAME_LENGTH) tokenError(source, token, "Label name too long");
+                scopeLabel(name, scope, text, token->line);
+                if(text[0] != '.') strcpy(scope, text);
+                trace("New label: %s\n", name);
+                noteLabel(addLabel(name, offset, token->line));
+                token++;
+                break;
 
-                        addSymbol(&t_short, 2);
-                        offset += 2;
-                        buffer_index = 0;
-                        symbol = 0;
-                        break;
-
-                    case 8: // expecting an integer
-                        if(isLetter(buffer[0])) {
-                            t_int = 0;
-                            // insert lookup symbol
-                            addPostProcessor(buffer, offset, line, 4);
-                            printf("i:[%s]\n", buffer);
-                        }
-                        else {
-                            t_int = parse_value(buffer, line, PARSE_INT, UNSIGNED);
-                            printf("i:%i\n", t_int);
-                        }
+            case TOKEN_STRING:
+                trace("\"%s\"\n", text);
+                addSymbol(text, token->length);
+                offset += token->length;
+                token++;
+                break;
 
-                        addSymbol(&t_int, 4);
-                        offset += 4;
-                        buffer_index = 0;
-                        symbol = 0;
-                        break;
-                }
+            case TOKEN_TYPE:
+                token = parseArray(source, token);
                 break;
 
-            case ',':
-            case ']':
-                buffer[buffer_index] = '\0';
-                switch(symbol) {
-                    case 2: // byte array reading mode
-                        t_byte = parse_value(buffer, line, PARSE_BYTE, UNSIGNED);
-                        printf(", %i", t_byte);
-                        addSymbol(&t_byte, 1);
-                        offset ++;
-                        break;
-
-                    case 3: // short array reading mode
-                        t_short = parse_value(buffer, line, PARSE_SHORT, UNSIGNED);
-                        printf(", %i", t_short);
-                        addSymbol(&t_short, 2);
-                        offset += 2;
-                        break;
-
-                    case 4: // integer array reading mode
-                        t_int = parse_value(buffer, line, PARSE_INT, UNSIGNED);
-                        printf(", %i", t_int);
-                        addSymbol(&t_int, 4);
-                        offset += 4;
-                        break;
-
-                    case 5: // float array reading mode
-                        t_float = parse_value(buffer, line, PARSE_FLOAT, UNSIGNED);
-                        printf(", %ff", t_float);
-                        addSymbol(&t_float, 4);
-                        offset += 4;
-                        break;
-
-                    default:
-                        printf("Unexpected symbol [%c] on line %i.\n", c, line);
-                        exit(-1);
-                }
-                buffer_index = 0;
-                if(c == ']') symbol = 0;
+            case TOKEN_WORD:
+                if(text[0] == '#') token = parseDirective(source, token);
+                else token = parseInstruction(source, token, scope);
+                // an instruction or directive must end its line
+                if(token->type != TOKEN_NEWLINE && token->type != TOKEN_END) tokenError(source, token, "Unexpected symbol");
                 break;
 
             default:
-                buffer[buffer_index++] = c;
-                break;
+                tokenError(source, token, "Unexpected symbol");
         }
     }
+}
+
+// read a whole file into memory, with a spare byte after its end
+char* readFile(const char* path, long* size)
+{
+    FILE* input = fopen(path, "rb");
+    if(!input) {
+        printf("Could not open input file [%s] for reading.\n", path);
+        exit(-1);
+    }
+
+    fseek(input, 0L, SEEK_END);
+    *size = ftell(input);
+    fseek(input, 0L, SEEK_SET);
+    char* data = (char*) malloc(*size + 1);
+    if(!data) {
+        puts("Memory allocation failure.");
+        exit(-1);
+    }
+    if(fread(data, 1, *size, input) != *size) {
+        printf("Could not read input file [%s].\n", path);
+        exit(-1);
+    }
+    fclose(input);
+    return data;
+}
+
+// read the whole source file into memory and split it into tokens
+void load(Source* source, const char* path)
+{
+    memset(source, 0, sizeof(Source));
+    source->path = path;
+    source->data = readFile(path, &source->size);
+    lex(source);
+    trace("Read [%s]: %li bytes, %i tokens.\n", path, source->size, source->token_count);
+}
 
+void unload(Source* source)
+{
+    free(source->data);
+    free(source->tokens);
+    free(source->text);
+}
+
+// read the whole source file into memory and assemble it
+void readSource(const char* path)
+{
+    Source source;
+    load(&source, path);
+    int previous = enterFile(path);
+    parse(&source);
+    label_file = previous;
+    unload(&source);
+}
+
+// write the assembled module as a relocatable object
+// #def values are substituted here and are not written, they belong to the module like its unexported labels.
+// Every other label reference becomes a relocation.
+void writeObject(FILE* output)
+{
+    trace("Writing object\n");
+    // the symbol written for each label, -1 for #def values
+    int* symbol = (int*) malloc(sizeof(int) * (label_index + 1));
+    if(!symbol) {
+        puts("Memory allocation failure.");
+        exit(-1);
+    }
+    unsigned int symbol_count = 0, relocation_count = 0;
     int i = 0;
-    for(; i < post_processors_index; i++) {
-        printf("Substituting %i of %i: ", i, post_processors_index);
+    for(; i < label_index; i++) {
+        Label* label = &labels[i];
+        if(label->exported && label->line == -1) {
+            printf("Error: Exported label [%s] is not defined.\n", label->name);
+            exit(-1);
+        }
+        if(label->exported && label->absolute) {
+            printf("Error: [%s] is a #def value, which can not be exported. Include its definition instead.\n", label->name);
+            exit(-1);
+        }
+        symbol[i] = label->absolute ? -1 : (int) symbol_count++;
+    }
+    for(i = 0; i < post_processors_index; i++) {
+        if(symbol[post_processors[i].label] == -1) substitute(&post_processors[i]);
+        else relocation_count++;
+    }
+
+    fwrite(OBJECT_MAGIC, 1, 4, output);
+    fwrite(&symbol_index, sizeof(unsigned int), 1, output);
+    fwrite(&symbol_count, sizeof(unsigned int), 1, output);
+    fwrite(&relocation_count, sizeof(unsigned int), 1, output);
+    fwrite(&item_index, sizeof(unsigned int), 1, output);
+    unsigned int alignment = 1;
+    for(i = 0; i < item_index; i++)
+        if(items[i].align > alignment) alignment = items[i].align;
+    fwrite(&alignment, sizeof(unsigned int), 1, output);
+    fwrite(symbols, sizeof(char), symbol_index, output);
+
+    // the entry point is always global, so the ROM can find it wherever its module is linked
+    for(i = 0; i < label_index; i++) {
+        Label* label = &labels[i];
+        if(symbol[i] == -1) continue;
+        char kind = label->line == -1 ? OBJECT_SYMBOL_IMPORT
+            : label->exported || strcmp(label->name, "_CODE_") == 0 ? OBJECT_SYMBOL_LABEL : OBJECT_SYMBOL_LOCAL;
+        unsigned short length = strlen(label->name);
+        fwrite(&label->offset, sizeof(int), 1, output);
+        fwrite(&kind, sizeof(char), 1, output);
+        fwrite(&label->line, sizeof(int), 1, output);
+        fwrite(&length, sizeof(unsigned short), 1, output);
+        fwrite(label->name, sizeof(char), length, output);
+    }
+
+    for(i = 0; i < post_processors_index; i++) {
         PostProcessor* p = &post_processors[i];
-        printf("%s\n", p->name);
-        Label* label = findLabel(p->name);
-        printf("Line %i: Swap [%s] at byte [%i] of size [%i].\n", p->line, p->name, p->offset, p->size);
+        if(symbol[p->label] == -1) continue;
+        char size = p->size;
+        fwrite(&p->offset, sizeof(int), 1, output);
+        fwrite(&symbol[p->label], sizeof(int), 1, output);
+        fwrite(&size, sizeof(char), 1, output);
+        fwrite(&p->line, sizeof(int), 1, output);
+    }
 
-        if(label == NULL) {
-            printf("Error: Could not find label [%s].\n", p->name);
+    for(i = 0; i < item_index; i++) {
+        fwrite(&items[i].offset, sizeof(int), 1, output);
+        fwrite(&items[i].size, sizeof(int), 1, output);
+        fwrite(&items[i].line, sizeof(int), 1, output);
+        fwrite(&items[i].align, sizeof(int), 1, output);
+    }
+    trace("Wrote [%i] bytes, [%i] symbols and [%i] relocations.\n", symbol_index, symbol_count, relocation_count);
+    free(symbol);
+}
+
+// copy the next bytes of an object file, exiting if the file ends first
+void objectRead(const char* path, const char* data, long size, long* position, void* output, long bytes)
+{
+    if(bytes < 0 || *position + bytes > size) {
+        printf("Error: Object file [%s] is corrupt.\n", path);
+        exit(-1);
+    }
+    memcpy(output, data + *position, bytes);
+    *position += bytes;
+}
+
+// link a relocatable object (compiler -c) into the output at the current offset
+void linkObject(const char* path)
+{
+    long size = 0;
+    char* data = readFile(path, &size);
+    linkBuffer(path, data, size);
+    free(data);
+}
+
+// link an object which has been read into memory,
+// its labels are defined here and its relocations are resolved with everything else
+void linkBuffer(const char* path, char* data, long size)
+{
+    long position = 4;
+    if(size < 24 || memcmp(data, OBJECT_MAGIC, 4) != 0) {
+        printf("Error: [%s] is not an object file.\n", path);
+        exit(-1);
+    }
+
+    unsigned int code_size, symbol_count, relocation_count, item_count, alignment;
+    objectRead(path, data, size, &position, &code_size, sizeof(unsigned int));
+    objectRead(path, data, size, &position, &symbol_count, sizeof(unsigned int));
+    objectRead(path, data, size, &position, &relocation_count, sizeof(unsigned int));
+    objectRead(path, data, size, &position, &item_count, sizeof(unsigned int));
+    objectRead(path, data, size, &position, &alignment, sizeof(unsigned int));
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0) objectRead(path, data, size, &position, NULL, -1);
+    if(code_size > size - position) objectRead(path, data, size, &position, NULL, -1);
+
+    // the module moves to the current offset, aligned so the padding inside it stays correct
+    if(alignment > 1) addPadding(alignment, 0);
+    int base = offset;
+    addSymbol(data + position, code_size);
+    offset += code_size;
+    position += code_size;
+    trace("Linking [%s] at %i: %u bytes, %u symbols, %u relocations.\n", path, base, code_size, symbol_count, relocation_count);
+    int previous = enterFile(path);
+
+    // the label index of each of the object's symbols
+    int* map = (int*) malloc(sizeof(int) * (symbol_count + 1));
+    if(!map) {
+        puts("Memory allocation failure.");
+        exit(-1);
+    }
+
+    char name[MAX_NAME_LENGTH * 2];
+    int i = 0;
+    for(; i < symbol_count; i++) {
+        int value, line;
+        char kind;
+        unsigned short length;
+        objectRead(path, data, size, &position, &value, sizeof(int));
+        objectRead(path, data, size, &position, &kind, sizeof(char));
+        objectRead(path, data, size, &position, &line, sizeof(int));
+        objectRead(path, data, size, &position, &length, sizeof(unsigned short));
+        if(length == 0 || length >= sizeof(name)) objectRead(path, data, size, &position, NULL, -1);
+        objectRead(path, data, size, &position, name, length);
+        name[length] = '\0';
+
+        switch(kind) {
+            case OBJECT_SYMBOL_LABEL:
+                map[i] = addLabel(name, base + value, line);
+                labels[map[i]].exported = 1; // still exported if this module is written as an object in turn
+                if(base + value == offset) noteLabel(map[i]); // a label at the end of the module moves past padding after it
+                break;
+            case OBJECT_SYMBOL_LOCAL:
+                map[i] = addHiddenLabel(name, base + value, line);
+                if(base + value == offset) noteLabel(map[i]);
+                break;
+            case OBJECT_SYMBOL_IMPORT:
+                map[i] = internLabel(name);
+                break;
+            default:
+                objectRead(path, data, size, &position, NULL, -1);
+        }
+    }
+
+    for(i = 0; i < relocation_count; i++) {
+        int at, symbol, line;
+        char bytes;
+        objectRead(path, data, size, &position, &at, sizeof(int));
+        objectRead(path, data, size, &position, &symbol, sizeof(int));
+        objectRead(path, data, size, &position, &bytes, sizeof(char));
+        objectRead(path, data, size, &position, &line, sizeof(int));
+        if(!inRange(symbol, 0, (int) symbol_count - 1) || (bytes != 1 && bytes != 2 && bytes != 4) || at < 0 || at + bytes > code_size)
+            objectRead(path, data, size, &position, NULL, -1);
+        addReference(map[symbol], base + at, line, bytes);
+    }
+
+    // the object's instructions, so its branches can be shortened like the rest of the ROM
+    int end = 0;
+    for(i = 0; i < item_count; i++) {
+        int at, bytes, line, align;
+        objectRead(path, data, size, &position, &at, sizeof(int));
+        objectRead(path, data, size, &position, &bytes, sizeof(int));
+        objectRead(path, data, size, &position, &line, sizeof(int));
+        objectRead(path, data, size, &position, &align, sizeof(int));
+        if(at < end || bytes < 0 || (bytes == 0 && align == 0) || at + bytes > code_size || align < 0 || align > alignment)
+            objectRead(path, data, size, &position, NULL, -1);
+        addItem(base + at, bytes, line);
+        items[item_index - 1].align = align;
+        end = at + bytes;
+    }
+
+    label_file = previous;
+    free(map);
+}
+
+// the build cache keys a module's object by a 64 bit FNV-1a hash of the module's source, the sources it includes and
+// the objects it links, in the order they are read. #def values are part of those sources, so changing one changes the key.
+// Cached objects are stored as dir/key.o
+#define CACHE_VERSION 4 // change this whenever the assembler's output changes
+
+unsigned long long hashBytes(unsigned long long hash, const void* data, long size) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    long i = 0;
+    for(; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// hash a source file followed by every file it includes or links
+unsigned long long hashSource(unsigned long long hash, const char* path) {
+    Source source;
+    load(&source, path);
+    hash = hashBytes(hash, &source.size, sizeof(long));
+    hash = hashBytes(hash, source.data, source.size);
+
+    Token* token = source.tokens;
+    for(; token->type != TOKEN_END; token++) {
+        if(token->type != TOKEN_WORD || token[1].type != TOKEN_WORD) continue;
+        char* text = TOKEN_TEXT(&source, token);
+        if(strcmp(text, "#include") == 0) hash = hashSource(hash, TOKEN_TEXT(&source, token + 1));
+        else if(strcmp(text, "#link") == 0) {
+            long size = 0;
+            char* data = readFile(TOKEN_TEXT(&source, token + 1), &size);
+            hash = hashBytes(hash, &size, sizeof(long));
+            hash = hashBytes(hash, data, size);
+            free(data);
+        }
+    }
+
+    unload(&source);
+    return hash;
+}
+
+unsigned long long cacheKey(const char* path) {
+    int version = CACHE_VERSION;
+    unsigned long long hash = hashBytes(14695981039346656037ull, OBJECT_MAGIC, 4);
+    hash = hashBytes(hash, &version, sizeof(int));
+    hash = hashBytes(hash, &optimizing, sizeof(int));
+    hash = hashSource(hash, path);
+    trace("Cache key of [%s]: %016llx\n", path, hash);
+    return hash;
+}
+
+// read the cached object with the key, returns NULL on a miss
+char* cacheLoad(unsigned long long key, long* size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016llx.o", cache_path, key);
+    FILE* cached = fopen(path, "rb");
+    if(!cached) {
+        trace("Cache miss [%s]\n", path);
+        cache_misses++;
+        return NULL;
+    }
+    fclose(cached);
+    trace("Cache hit [%s]\n", path);
+    cache_hits++;
+    return readFile(path, size);
+}
+
+// store the object under the key, renaming it into place so a reader never sees half of it
+// the cache only saves time, so failing to store an object is not an error
+void cacheStore(unsigned long long key, const char* module, const char* data, long size) {
+    char path[PATH_MAX], temporary[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016llx.o", cache_path, key);
+    snprintf(temporary, sizeof(temporary), "%s/%016llx.o.XXXXXX", cache_path, key);
+
+    if(mkdir(cache_path, 0777) != 0 && errno != EEXIST) {
+        printf("Warning: Could not create the cache directory [%s].\n", cache_path);
+        return;
+    }
+    int file = mkstemp(temporary);
+    FILE* output = file == -1 ? NULL : fdopen(file, "wb");
+    if(!output) {
+        printf("Warning: Could not store [%s] in the cache.\n", module);
+        if(file != -1) {
+            close(file);
+            remove(temporary);
+        }
+        return;
+    }
+    int written = fwrite(data, 1, size, output) == size;
+    if(fclose(output) != 0 || !written || rename(temporary, path) != 0) {
+        printf("Warning: Could not store [%s] in the cache.\n", module);
+        remove(temporary);
+    }
+}
+
+// assemble a source file into an object in memory with this thread's labels and symbols,
+// the object is taken from the cache instead when it has not changed
+char* assembleModule(const char* path, long* size)
+{
+    unsigned long long key = 0;
+    if(cache_path) {
+        key = cacheKey(path);
+        char* cached = cacheLoad(key, size);
+        if(cached) return cached;
+    }
+
+    char* data = NULL;
+    size_t length = 0;
+    FILE* output = open_memstream(&data, &length);
+    if(!output) {
+        puts("Memory allocation failure.");
+        exit(-1);
+    }
+    allocArrays();
+    readSource(path);
+    if(optimizing) optimize(path);
+    writeObject(output);
+    freeArrays();
+    fclose(output);
+    *size = length;
+
+    if(cache_path) cacheStore(key, path, data, *size);
+    return data;
+}
+
+// the modules shared by the assembler threads, each thread takes the next module until none are left
+typedef struct Modules
+{
+    const char** paths;
+    char** objects;
+    long* sizes;
+    int count;
+    atomic_int next;
+}Modules;
+
+void* moduleThread(void* argument)
+{
+    Modules* modules = (Modules*) argument;
+    int i;
+    while((i = atomic_fetch_add(&modules->next, 1)) < modules->count)
+        modules->objects[i] = assembleModule(modules->paths[i], &modules->sizes[i]);
+    return NULL;
+}
+
+// assemble the modules into objects on a pool of threads, the calling thread is one of them
+// the objects are kept in the order of the paths, so linking them does not depend on which thread finished first
+void assembleModules(const char** paths, char** objects, long* sizes, int count, int threads)
+{
+    Modules modules;
+    modules.paths = paths;
+    modules.objects = objects;
+    modules.sizes = sizes;
+    modules.count = count;
+    atomic_init(&modules.next, 0);
+
+    pthread_t* pool = (pthread_t*) malloc(sizeof(pthread_t) * threads);
+    if(!pool) {
+        puts("Memory allocation failure.");
+        exit(-1);
+    }
+    int i = 1;
+    for(; i < threads; i++) {
+        if(pthread_create(&pool[i], NULL, moduleThread, &modules) != 0) {
+            puts("Error: Could not start an assembler thread.");
             exit(-1);
         }
+    }
+    trace("Assembling %i modules on %i threads.\n", count, threads);
+    moduleThread(&modules);
+    for(i = 1; i < threads; i++)
+        pthread_join(pool[i], NULL);
+    free(pool);
+}
 
-        switch(p->size) {
-            case 1:
-                if(!inRange(label->offset, SCHAR_MIN, SCHAR_MAX)) {
-                    printf("Error: Label [%s] offset exceeds the value of a char. Substitution failure at line %i.\n", p->name, p->line);
-                    exit(-1);
-                }
-                t_byte = (char) label->offset;
-                memcpy(symbols + p->offset, &t_byte, sizeof(char));
-                printf("Substituted %i\n", t_byte);
-                break;
+// the peephole optimizer (-O) removes instructions which do nothing and folds neighbouring ones:
+//   INC r 0                    - removed
+//   INC r a, INC r b           - INC r a+b
+//   CPY r r                    - removed
+//   CPY a b, CPY a b / CPY b a - the second copy is removed
+//   PUSH r, POP r              - both are removed
+//   JMP/Jcc/CALL to a JMP      - retargeted to the JMP's label
+//   JMP/Jcc to the next byte   - removed
+// two instructions are only combined when no label points between them, the code is then moved up over the removed
+// instructions and every label and reference behind them with it. Code which computes addresses without labels will break.
+
+// the registers each instruction accepts in the machine, so an instruction which would crash is never removed
+#define incRegister(r) (inRange((r), AL, DX) || inRange((r), EAX, EDX) || (r) == ESP || (r) == ESI || (r) == EDI)
+#define copyRegisters(a, b) ((inRange((a), AL, DX) || inRange((a), EAX, EDX) || (a) == ESP || (a) == ESI) && (registerSize(a) < 4 || (b) <= EDI))
+#define stackRegister(r) (inRange((r), EAX, ESB) || (r) == ESI || (r) == EDI)
+
+// the item containing the offset, or -1 if it is data
+int findItem(int offset) {
+    int low = 0, high = (int) item_index - 1;
+    while(low <= high) {
+        int middle = (low + high) / 2;
+        if(items[middle].offset > offset) high = middle - 1;
+        else if(offset >= items[middle].offset + items[middle].size) low = middle + 1;
+        else return middle;
+    }
+    return -1;
+}
 
-            case 2:
-                if(!inRange(label->offset, SHRT_MIN, SHRT_MAX)) {
-                    printf("Error: Label [%s] offset exceeds the value of a short. Substition failure at line %i.\n", p->name, p->line);
-                    exit(-1);
-                }
-                t_short = (short) label->offset;
-                memcpy(symbols + p->offset, &t_short, sizeof(short));
-                printf("Substituted %i\n", t_short);
-                break;
+int readOperand(const unsigned char* code, int size) {
+    if(size == 1) return (char) code[0];
+    if(size == 2) { short s; memcpy(&s, code, 2); return s; }
+    int i; memcpy(&i, code, 4); return i;
+}
 
-            case 4:
-                memcpy(symbols + p->offset, &label->offset, sizeof(int));
-                printf("Substituted %i\n", *(int*) (symbols + p->offset));
-                break;
+void writeOperand(unsigned char* code, int size, int value) {
+    if(size == 1) code[0] = (unsigned char) value;
+    else if(size == 2) { short s = (short) value; memcpy(code, &s, 2); }
+    else memcpy(code, &value, 4);
+}
+
+// the number of items which begin before the offset, padding at the offset counts as before it because labels point past padding
+int itemsBefore(int offset) {
+    int low = 0, high = item_index;
+    while(low < high) {
+        int middle = (low + high) / 2;
+        if(items[middle].offset < offset) low = middle + 1; else high = middle;
+    }
+    while(low < item_index && items[low].offset == offset && items[low].align) low++;
+    return low;
+}
+
+// the first offset at or after the offset which is not in a removed instruction
+int skipRemoved(const char* removed, int offset) {
+    int i = findItem(offset);
+    while(i != -1 && i < item_index && removed[i] && items[i].offset == offset) {
+        offset += items[i].size;
+        i++;
+    }
+    return offset;
+}
+
+// the instruction after the item when only removed instructions and no labels lie between them, otherwise -1
+int nextItem(const char* removed, const int* labelled, int i) {
+    int end = items[i].offset + items[i].size;
+    int j = i + 1;
+    for(; j < item_index; j++) {
+        if(items[j].offset != end || items[j].align) return -1;
+        if(!removed[j]) break;
+        end += items[j].size;
+    }
+    if(j >= item_index) return -1;
+    // labelled[n] counts the labels before byte n
+    if(labelled[items[j].offset + 1] != labelled[items[i].offset + 1]) return -1;
+    return j;
+}
+
+void optimize(const char* path)
+{
+    if(item_index == 0) return;
+    char* removed = (char*) calloc(item_index, sizeof(char));
+    int* reference = (int*) malloc(sizeof(int) * item_index); // the post processor of each instruction's value, or -1
+    int* labelled = (int*) calloc(symbol_index + 2, sizeof(int));
+    int* shift = (int*) malloc(sizeof(int) * (item_index + 1));
+    if(!removed || !reference || !labelled || !shift) {
+        puts("Memory allocation failure.");
+        exit(-1);
+    }
+
+    int i, j;
+    for(i = 0; i < item_index; i++) reference[i] = -1;
+    for(i = 0; i < post_processors_index; i++) {
+        j = findItem(post_processors[i].offset);
+        if(j != -1) reference[j] = i;
+    }
+    for(i = 0; i < label_index; i++)
+        if(labels[i].line != -1 && !labels[i].absolute && inRange(labels[i].offset, 0, (int) symbol_index))
+            labelled[labels[i].offset + 1]++;
+    for(i = 1; i <= symbol_index + 1; i++) labelled[i] += labelled[i - 1];
+
+    int instructions = 0, retargeted = 0;
+    int changed = 1;
+    while(changed) {
+        changed = 0;
+        for(i = 0; i < item_index; i++) {
+            if(removed[i] || items[i].align) continue;
+            unsigned char* code = (unsigned char*) symbols + items[i].offset;
+            j = nextItem(removed, labelled, i);
+            unsigned char* next = j == -1 ? NULL : (unsigned char*) symbols + items[j].offset;
+
+            switch(code[0]) {
+                case INC:
+                    if(reference[i] != -1 || !incRegister(code[1])) break;
+                    int size = registerSize(code[1]);
+                    int value = readOperand(code + 2, size);
+                    if(value == 0) {
+                        removed[i] = 1;
+                        changed = 1;
+                    }
+                    else if(next && next[0] == INC && next[1] == code[1] && reference[j] == -1) {
+                        writeOperand(code + 2, size, value + readOperand(next + 2, size));
+                        removed[j] = 1;
+                        changed = 1;
+                    }
+                    break;
+
+                case CPY:
+                    if(code[1] == code[2] && copyRegisters(code[1], code[2])) {
+                        removed[i] = 1;
+                        changed = 1;
+                    }
+                    else if(next && next[0] == CPY && ((next[1] == code[1] && next[2] == code[2])
+                            || (next[1] == code[2] && next[2] == code[1] && copyRegisters(next[1], next[2])))) {
+                        removed[j] = 1;
+                        changed = 1;
+                    }
+                    break;
+
+                case PUSH:
+                    if(next && next[0] == POP && next[1] == code[1] && stackRegister(code[1])) {
+                        removed[i] = removed[j] = 1;
+                        changed = 1;
+                    }
+                    break;
+            }
         }
     }
 
-    fclose(input);
+    // thread jumps through the JMPs they land on
+    for(i = 0; i < item_index; i++) {
+        unsigned char op = symbols[items[i].offset];
+        if(removed[i] || reference[i] == -1 || (op != JMP && op != JEQ && op != JNE && op != JLE && op != JGE && op != CALL)) continue;
+        PostProcessor* p = &post_processors[reference[i]];
+        int first = p->label;
+        int hops = 0;
+        for(; hops < 16; hops++) {
+            Label* target = &labels[p->label];
+            if(target->line == -1 || target->absolute) break;
+            j = findItem(skipRemoved(removed, target->offset));
+            if(j == -1 || removed[j] || items[j].offset != skipRemoved(removed, target->offset)) break;
+            if((unsigned char) symbols[items[j].offset] != JMP || reference[j] == -1) break;
+            int label = post_processors[reference[j]].label;
+            if(label == p->label || label == first) break;
+            p->label = label;
+        }
+        if(p->label != first) retargeted++;
+    }
+
+    // then remove jumps to the next instruction, until removing one leaves no jump before it landing next to itself
+    changed = 1;
+    while(changed) {
+        changed = 0;
+        for(i = 0; i < item_index; i++) {
+            unsigned char op = symbols[items[i].offset];
+            if(removed[i] || reference[i] == -1 || (op != JMP && op != JEQ && op != JNE && op != JLE && op != JGE)) continue;
+            Label* target = &labels[post_processors[reference[i]].label];
+            if(target->line != -1 && !target->absolute && target->offset >= items[i].offset + items[i].size
+                    && skipRemoved(removed, target->offset) == skipRemoved(removed, items[i].offset + items[i].size)) {
+                removed[i] = 1;
+                changed = 1;
+            }
+        }
+    }
+
+    // move the code up over the removed instructions, sizing the padding for its new offset
+    int from = 0, to = 0;
+    shift[0] = 0;
+    for(i = 0; i < item_index; i++) {
+        shift[i + 1] = shift[i];
+        if(items[i].align) {
+            int size = padding(items[i].offset - shift[i], items[i].align);
+            memmove(symbols + to, symbols + from, items[i].offset - from);
+            to += items[i].offset - from;
+            from = items[i].offset + items[i].size;
+            memset(symbols + to, NOP, size);
+            to += size;
+            shift[i + 1] += items[i].size - size;
+            continue;
+        }
+        if(!removed[i]) continue;
+        memmove(symbols + to, symbols + from, items[i].offset - from);
+        to += items[i].offset - from;
+        from = items[i].offset + items[i].size;
+        shift[i + 1] += items[i].size;
+        instructions++;
+    }
+    memmove(symbols + to, symbols + from, symbol_index - from);
+    int bytes = shift[item_index];
+    symbol_index -= bytes;
+    offset -= bytes;
+
+    // every offset moves up by the size of the removed instructions before it
+    for(i = 0; i < label_index; i++) {
+        Label* label = &labels[i];
+        if(label->line == -1 || label->absolute) continue;
+        label->offset -= shift[itemsBefore(label->offset)];
+    }
+    int kept = 0;
+    for(i = 0; i < post_processors_index; i++) {
+        PostProcessor* p = &post_processors[i];
+        j = findItem(p->offset);
+        if(j != -1 && removed[j]) continue;
+        p->offset -= shift[itemsBefore(p->offset)];
+        post_processors[kept++] = *p;
+    }
+    post_processors_index = kept;
+    for(i = 0, kept = 0; i < item_index; i++) {
+        if(removed[i]) continue;
+        items[kept] = items[i];
+        items[kept].offset -= shift[i];
+        items[kept].size -= shift[i + 1] - shift[i];
+        kept++;
+    }
+    item_index = kept;
+
+    printf("Optimized [%s]: removed %i instructions (%i bytes), retargeted %i jumps.\n", path, instructions, bytes, retargeted);
+    free(removed);
+    free(reference);
+    free(labelled);
+    free(shift);
 }
 
-void link(const char* path)
+// branches to labels are assembled with an absolute int target, relax shortens every one it can to a
+// JMP8 ... CALL8 (a char) or JMP16 ... CALL16 (a short) displacement from the end of the branch.
+// All branches start in the shortest form and only ever grow until every displacement fits, so the sizes always settle.
+// The code after a branch moves up with every byte it saves, and the labels and references move with it.
+// A branch to a number can not move with the code, so if there is one no branch is shortened and the code stays put.
+#define BRANCH_REL8  0
+#define BRANCH_REL16 1
+#define BRANCH_ABS32 2
+
+const int BRANCH_SIZES[3] = {2, 3, 5};
+
+// the short form of a branch opcode, or -1 if the opcode is not a branch
+int shortBranch(int opcode, int form) {
+    int i;
+    switch(opcode) {
+        case JMP:  i = 0; break;
+        case JEQ:  i = 1; break;
+        case JLE:  i = 2; break;
+        case JGE:  i = 3; break;
+        case JNE:  i = 4; break;
+        case CALL: i = 5; break;
+        default: return -1;
+    }
+    return (form == BRANCH_REL8 ? JMP8 : JMP16) + i;
+}
+
+void relax()
 {
+    if(item_index == 0) return;
+    char* form = (char*) malloc(item_index);                      // the form of each branch, -1 for other instructions
+    int* reference = (int*) malloc(sizeof(int) * item_index);     // the post processor of each branch's target
+    int* shift = (int*) malloc(sizeof(int) * (item_index + 1));   // the bytes saved before each item
+    if(!form || !reference || !shift) {
+        puts("Memory allocation failure.");
+        exit(-1);
+    }
+
+    int i, j;
+    for(i = 0; i < item_index; i++) {
+        form[i] = -1;
+        reference[i] = -1;
+    }
+    for(i = 0; i < post_processors_index; i++) {
+        PostProcessor* p = &post_processors[i];
+        j = findItem(p->offset);
+        if(j == -1 || p->size != 4 || p->offset != items[j].offset + 1 || items[j].size != BRANCH_SIZES[BRANCH_ABS32]) continue;
+        Label* label = &labels[p->label];
+        if(shortBranch(symbols[items[j].offset], BRANCH_REL8) == -1) continue;
+        reference[j] = i;
+        if(label->line != -1 && !label->absolute) form[j] = BRANCH_REL8;
+    }
+    for(i = 0; i < item_index; i++) {
+        if(items[i].align || items[i].size != BRANCH_SIZES[BRANCH_ABS32] || shortBranch(symbols[items[i].offset], BRANCH_REL8) == -1) continue;
+        if(reference[i] != -1 && (form[i] != -1 || labels[post_processors[reference[i]].label].line == -1)) continue;
+        printf("Warning: Line %i branches to a number, no branches are shortened so the code keeps its addresses.\n", items[i].line);
+        free(form);
+        free(reference);
+        free(shift);
+        return;
+    }
+
+    int changed = 1;
+    while(changed) {
+        changed = 0;
+        shift[0] = 0;
+        for(i = 0; i < item_index; i++) {
+            int size = items[i].size;
+            if(form[i] != -1) size = BRANCH_SIZES[(int) form[i]];
+            else if(items[i].align) size = padding(items[i].offset - shift[i], items[i].align);
+            shift[i + 1] = shift[i] + items[i].size - size;
+        }
+
+        for(i = 0; i < item_index; i++) {
+            if(form[i] == -1 || form[i] == BRANCH_ABS32) continue;
+            int target = labels[post_processors[reference[i]].label].offset;
+            int displacement = (target - shift[itemsBefore(target)]) - (items[i].offset - shift[i] + BRANCH_SIZES[(int) form[i]]);
+            if(form[i] == BRANCH_REL8 && !inRange(displacement, SCHAR_MIN, SCHAR_MAX)) form[i] = BRANCH_REL16;
+            else if(form[i] == BRANCH_REL16 && !inRange(displacement, SHRT_MIN, SHRT_MAX)) form[i] = BRANCH_ABS32;
+            else continue;
+            changed = 1;
+        }
+    }
+
+    // write the short branches and move the code up
+    int from = 0, to = 0, shortened = 0;
+    for(i = 0; i < item_index; i++) {
+        if(!items[i].align && (form[i] == -1 || form[i] == BRANCH_ABS32)) continue;
+        memmove(symbols + to, symbols + from, items[i].offset - from);
+        to += items[i].offset - from;
+        from = items[i].offset + items[i].size;
+        if(items[i].align) {
+            memset(symbols + to, NOP, items[i].size - (shift[i + 1] - shift[i]));
+            to += items[i].size - (shift[i + 1] - shift[i]);
+            continue;
+        }
 
+        int size = BRANCH_SIZES[(int) form[i]];
+        int target = labels[post_processors[reference[i]].label].offset;
+        int displacement = (target - shift[itemsBefore(target)]) - (to + size);
+        symbols[to] = shortBranch(symbols[items[i].offset], form[i]);
+        writeOperand((unsigned char*) symbols + to + 1, size - 1, displacement);
+        to += size;
+        shortened++;
+    }
+    memmove(symbols + to, symbols + from, symbol_index - from);
+    int bytes = shift[item_index];
+    symbol_index -= bytes;
+    offset -= bytes;
+
+    for(i = 0; i < label_index; i++) {
+        Label* label = &labels[i];
+        if(label->line == -1 || label->absolute) continue;
+        label->offset -= shift[itemsBefore(label->offset)];
+    }
+    int kept = 0;
+    for(i = 0; i < post_processors_index; i++) {
+        PostProcessor* p = &post_processors[i];
+        j = findItem(p->offset);
+        if(j != -1 && reference[j] == i && form[j] != -1 && form[j] != BRANCH_ABS32) continue; // the displacement has been written
+        p->offset -= shift[itemsBefore(p->offset)];
+        post_processors[kept++] = *p;
+    }
+    post_processors_index = kept;
+    for(i = 0; i < item_index; i++) {
+        items[i].offset -= shift[i];
+        items[i].size -= shift[i + 1] - shift[i];
+    }
+
+    trace("Shortened %i branches, saving %i bytes.\n", shortened, bytes);
+    free(form);
+    free(reference);
+    free(shift);
+}
+
+// overwrite a label reference with the label's offset
+void substitute(const PostProcessor* p)
+{
+    unsigned char t_byte = 0;
+    unsigned short t_short = 0;
+    Label* label = &labels[p->label];
+    trace("Line %i: Swap [%s] at byte [%i] of size [%i].\n", p->line, label->name, p->offset, p->size);
+
+    switch(p->size) {
+        case 1:
+            if(!inRange(label->offset, SCHAR_MIN, SCHAR_MAX)) {
+                printf("Error: Label [%s] offset exceeds the value of a char. Substitution failure at line %i.\n", label->name, p->line);
+                exit(-1);
+            }
+            t_byte = (char) label->offset;
+            memcpy(symbols + p->offset, &t_byte, sizeof(char));
+            trace("Substituted %i\n", t_byte);
+            break;
+
+        case 2:
+            if(!inRange(label->offset, SHRT_MIN, SHRT_MAX)) {
+                printf("Error: Label [%s] offset exceeds the value of a short. Substition failure at line %i.\n", label->name, p->line);
+                exit(-1);
+            }
+            t_short = (short) label->offset;
+            memcpy(symbols + p->offset, &t_short, sizeof(short));
+            trace("Substituted %i\n", t_short);
+            break;
+
+        case 4:
+            memcpy(symbols + p->offset, &label->offset, sizeof(int));
+            trace("Substituted %i\n", *(int*) (symbols + p->offset));
+            break;
+    }
+}
+
+// overwrite every label reference with the label's offset once all the sources have been read
+void resolve()
+{
+    int i = 0;
+    for(; i < post_processors_index; i++) {
+        trace("Substituting %i of %i: ", i, post_processors_index);
+        PostProcessor* p = &post_processors[i];
+        trace("%s\n", labels[p->label].name);
+        if(labels[p->label].line == -1) {
+            printf("Error: Could not find label [%s].\n", labels[p->label].name);
+            exit(-1);
+        }
+        substitute(p);
+    }
 }
 
@@ -4,6 +4,153 @@
 
 #include "system.h"
 
+// decompiler: turns a ROM back into assembly the compiler accepts
+// usage: decompiler input output
+// The bytes before the code start are written as byte arrays and the code is decoded from the code start to the end of
+// the ROM. Every branch target becomes a label (L<offset>), short branches are written as the JMP ... CALL they were
+// assembled from. Values which were labels in the source (MOV ESI data) stay numbers.
+
+// the operands which follow each opcode, as in the compiler:
+#define OPERANDS_NONE     0  // none
+#define OPERANDS_VALUE    1  // a register followed by a value of the register's size
+#define OPERANDS_BYTE     6  // a byte
+#define OPERANDS_INT      8  // an integer
+#define OPERANDS_REGISTERS 9 // 2 registers
+#define OPERANDS_REGISTER 10 // a single register
+#define OPERANDS_REL8     11 // a char displacement from the end of the instruction
+#define OPERANDS_REL16    12 // a short displacement from the end of the instruction
+
+typedef struct Opcode
+{
+    const char* name; // NULL if the opcode does not exist
+    int operands;
+}Opcode;
+
+static const Opcode OPCODES[256] = {
+    [NOP] = {"NOP", OPERANDS_NONE},       [INT] = {"INT", OPERANDS_BYTE},
+    [MOV] = {"MOV", OPERANDS_VALUE},      [CPY] = {"CPY", OPERANDS_REGISTERS},
+    [ADD] = {"ADD", OPERANDS_REGISTERS},  [INC] = {"INC", OPERANDS_VALUE},
+    [DEC] = {"DEC", OPERANDS_VALUE},      [SUB] = {"SUB", OPERANDS_REGISTERS},
+    [CMP] = {"CMP", OPERANDS_REGISTERS},  [CCMP] = {"CCMP", OPERANDS_VALUE},
+    [JMP] = {"JMP", OPERANDS_INT},        [JEQ] = {"JEQ", OPERANDS_INT},
+    [JLE] = {"JLE", OPERANDS_INT},        [JGE] = {"JGE", OPERANDS_INT},
+    [JNE] = {"JNE", OPERANDS_INT},        [PUSH] = {"PUSH", OPERANDS_REGISTER},
+    [POP] = {"POP", OPERANDS_REGISTER},   [FETCH] = {"FETCH", OPERANDS_REGISTER},
+    [WRITE] = {"WRITE", OPERANDS_REGISTER}, [CALL] = {"CALL", OPERANDS_INT},
+    [RET] = {"RET", OPERANDS_NONE},       [HLT] = {"HLT", OPERANDS_NONE},
+    [IRET] = {"IRET", OPERANDS_NONE},     [CAS] = {"CAS", OPERANDS_REGISTERS},
+    [XADD] = {"XADD", OPERANDS_REGISTER}, [XCHG] = {"XCHG", OPERANDS_REGISTER},
+    [FENCE] = {"FENCE", OPERANDS_NONE},   [TASK] = {"TASK", OPERANDS_REGISTER},
+    [YIELD] = {"YIELD", OPERANDS_NONE},   [JOIN] = {"JOIN", OPERANDS_REGISTER},
+    [JMP8] = {"JMP", OPERANDS_REL8},      [JEQ8] = {"JEQ", OPERANDS_REL8},
+    [JLE8] = {"JLE", OPERANDS_REL8},      [JGE8] = {"JGE", OPERANDS_REL8},
+    [JNE8] = {"JNE", OPERANDS_REL8},      [CALL8] = {"CALL", OPERANDS_REL8},
+    [JMP16] = {"JMP", OPERANDS_REL16},    [JEQ16] = {"JEQ", OPERANDS_REL16},
+    [JLE16] = {"JLE", OPERANDS_REL16},    [JGE16] = {"JGE", OPERANDS_REL16},
+    [JNE16] = {"JNE", OPERANDS_REL16},    [CALL16] = {"CALL", OPERANDS_REL16},
+};
+
+static const char* REGISTER_NAMES[] = {
+    "EAX", "EBX", "ECX", "EDX", "ESB", "ESP", "ESI", "EDI", "EIP", "FLG",
+    "AL", "AH", "BL", "BH", "CL", "CH", "DL", "DH",
+    "AX", "BX", "CX", "DX"
+};
+#define REGISTER_NAME_COUNT (sizeof(REGISTER_NAMES) / sizeof(REGISTER_NAMES[0]))
+
+// the size of the register in bytes
+int register_size(int reg) {
+    if(reg >= AL && reg <= DH) return 1;
+    if(reg >= AX && reg <= DX) return 2;
+    return 4;
+}
+
+// a decoded instruction
+typedef struct Instruction
+{
+    int opcode;
+    int size;     // the size of the instruction in bytes
+    int r0, r1;   // the register operands
+    int value;    // the value operand
+    int target;   // the address a branch jumps to, or -1
+}Instruction;
+
+// decode the instruction at the offset, returns 0 if the bytes are not a complete instruction
+int decode(const unsigned char* rom, int size, int offset, Instruction* instruction)
+{
+    memset(instruction, 0, sizeof(Instruction));
+    instruction->opcode = rom[offset];
+    instruction->target = -1;
+    const Opcode* opcode = &OPCODES[rom[offset]];
+    if(!opcode->name) return 0;
+
+    int i = offset + 1;
+    int bytes = 0; // the size of the value operand
+    switch(opcode->operands) {
+        case OPERANDS_VALUE:
+        case OPERANDS_REGISTERS:
+        case OPERANDS_REGISTER:
+            if(i >= size || rom[i] >= REGISTER_NAME_COUNT) return 0;
+            instruction->r0 = rom[i++];
+            if(opcode->operands == OPERANDS_REGISTERS) {
+                if(i >= size || rom[i] >= REGISTER_NAME_COUNT) return 0;
+                instruction->r1 = rom[i++];
+            }
+            else if(opcode->operands == OPERANDS_VALUE) bytes = register_size(instruction->r0);
+            break;
+        case OPERANDS_BYTE:  bytes = 1; break;
+        case OPERANDS_INT:   bytes = 4; break;
+        case OPERANDS_REL8:  bytes = 1; break;
+        case OPERANDS_REL16: bytes = 2; break;
+    }
+    if(i + bytes > size) return 0;
+
+    unsigned short s;
+    switch(bytes) {
+        case 1: instruction->value = opcode->operands == OPERANDS_REL8 ? (signed char) rom[i] : rom[i]; break;
+        case 2:
+            memcpy(&s, rom + i, 2);
+            instruction->value = opcode->operands == OPERANDS_REL16 ? (short) s : s;
+            break;
+        case 4: memcpy(&instruction->value, rom + i, 4); break;
+    }
+    instruction->size = i + bytes - offset;
+
+    if(opcode->operands == OPERANDS_INT && instruction->opcode != INT) instruction->target = instruction->value;
+    if(opcode->operands == OPERANDS_REL8 || opcode->operands == OPERANDS_REL16)
+        instruction->target = offset + instruction->size + instruction->value;
+    return 1;
+}
+
+// write the label for the offset if anything branches to it
+void write_label(FILE* output, const char* labels, int offset, int code_start)
+{
+    if(offset == code_start) fprintf(output, "_CODE_:\n");
+    else if(labels[offset]) fprintf(output, "L%i:\n", offset);
+}
+
+// write the bytes as byte arrays, starting a new array at every label
+void write_data(FILE* output, const unsigned char* rom, const char* labels, int start, int end, int code_start)
+{
+    int i = start;
+    int count = 0;
+    for(; i < end; i++) {
+        if(i != start && (labels[i] || i == code_start)) {
+            if(count) fprintf(output, "]\n");
+            count = 0;
+        }
+        if(count == 0) {
+            write_label(output, labels, i, code_start);
+            fprintf(output, "<byte>[");
+        }
+        fprintf(output, count ? ", %i" : "%i", rom[i]);
+        if(++count == 16) {
+            fprintf(output, "]\n");
+            count = 0;
+        }
+    }
+    if(count) fprintf(output, "]\n");
+}
+
 int main(int argc, char* argv[])
 {
     if(argc != 3) {
@@ -11,196 +158,94 @@ int main(int argc, char* argv[])
         return -1;
     }
 
-    FILE* input = fopen(argv[1], "r");
+    FILE* input = fopen(argv[1], "rb");
     if(!input) {
         printf("Error: Could not open file [%s] for reading.\n", argv[1]);
         return -1;
     }
 
+    unsigned int code_start = 0;
+    if(fread(&code_start, sizeof(unsigned int), 1, input) != 1) {
+        printf("Error: [%s] is not a ROM.\n", argv[1]);
+        return -1;
+    }
+    fseek(input, 0L, SEEK_END);
+    int size = (int) ftell(input) - 4;
+    fseek(input, 4L, SEEK_SET);
+    unsigned char* rom = (unsigned char*) malloc(size + 1);
+    char* labels = (char*) calloc(size + 1, sizeof(char));     // 1 for every offset something branches to
+    char* boundaries = (char*) calloc(size + 1, sizeof(char)); // 1 for every offset at which an instruction or data byte begins
+    if(!rom || !labels || !boundaries) {
+        puts("Memory allocation failure.");
+        return -1;
+    }
+    if(fread(rom, 1, size, input) != size) {
+        printf("Error: Could not read [%s].\n", argv[1]);
+        return -1;
+    }
+    fclose(input);
+    if(code_start > size) code_start = size;
+
+    // find the instructions and the branch targets, an undecodable byte ends the code and the rest is data
+    Instruction instruction;
+    int i = 0;
+    for(; i < code_start; i++) boundaries[i] = 1;
+    int code_end = code_start;
+    while(code_end < size && decode(rom, size, code_end, &instruction)) {
+        boundaries[code_end] = 1;
+        if(instruction.target >= 0 && instruction.target < size) labels[instruction.target] = 1;
+        code_end += instruction.size;
+    }
+    for(i = code_end; i < size; i++) boundaries[i] = 1;
+    for(i = 0; i < size; i++) labels[i] &= boundaries[i]; // a branch into the middle of an instruction stays a number
+
     FILE* output = fopen(argv[2], "w");
     if(!output) {
         printf("Error: Could not open file [%s] for writing.\n", argv[2]);
         return -1;
     }
 
-    int code_start;
-    fread(&code_start, sizeof(int), 1, input);
-
-
-    // 2 temporary use integers:
-    int i = 0;
-    int e = 0;
-
-    printf("{");
-    if(code_start > 0) fprintf(output, "{");
+    write_data(output, rom, labels, 0, code_start, code_start);
 
-    for(; i < code_start - 1; i++) {
-        fread(&e, sizeof(int), 1, input);
-        if((char) e == '\n')
-        {
-            printf("\\n");
-            fprintf(output, "\\n");
-        }
-        else
-        {
-            printf("%c", (char) e);
-            fprintf(output, "%c", (char) e);
-        }
-    }
+    int offset = code_start;
+    while(offset < code_end) {
+        decode(rom, size, offset, &instruction);
+        const Opcode* opcode = &OPCODES[instruction.opcode];
+        write_label(output, labels, offset, code_start);
+        fprintf(output, "    %s", opcode->name);
 
-    printf("}");
-    if(code_start > 0) fprintf(output, "}\n");
-
-    printf("_CODE_:\n");
-    fprintf(output, "_CODE_:\n");
-
-    int state = 0;
-
-    // start interpretation:
-    while(1) {
-        if(fread(&i, sizeof(int), 1, input) != 1) break;
-
-        switch(state)
-        {
-            case 0: // expecting op-code:
-                switch(i)
-                {
-                    case NOP:
-                        printf("NOP ");
-                        fprintf(output, "NOP ");
-                        state = 0;
-                        break;
-                    case INT:
-                        printf("INT ");
-                        fprintf(output, "INT ");
-                        state = 1;
-                        break;
-                    case MOV:
-                        printf("MOV ");
-                        fprintf(output, "MOV ");
-                        state = 3;
-                        break;
-                    case CPY:
-                        printf("CPY ");
-                        fprintf(output, "CPY ");
-                        state = 4;
-                        break;
-                    case ADD:
-                        printf("ADD ");
-                        fprintf(output, "ADD ");
-                        state = 4;
-                        break;
-                    case INC:
-                        printf("INC ");
-                        fprintf(output, "INC ");
-                        state = 3;
-                        break;
-                    case DEC:
-                        printf("DEC ");
-                        fprintf(output, "DEC ");
-                        state = 3;
-                        break;
-                    case SUB:
-                        printf("SUB ");
-                        fprintf(output, "SUB ");
-                        state = 4;
-                        break;
-                    case CMP:
-                        printf("CMP ");
-                        fprintf(output, "CMP ");
-                        state = 4;
-                        break;
-                    case JMP:
-                        printf("JMP ");
-                        fprintf(output, "JMP ");
-                        state = 1;
-                        break;
-                    case JEQ:
-                        printf("JEQ ");
-                        fprintf(output, "JEQ ");
-                        state = 1;
-                        break;
-                    case JLE:
-                        printf("JLE ");
-                        fprintf(output, "JLE ");
-                        state = 1;
-                        break;
-                    case JGE:
-                        printf("JGE ");
-                        fprintf(output, "JGE ");
-                        state = 1;
-                        break;
-                    case PUSH:
-                        printf("PUSH ");
-                        fprintf(output, "PUSH ");
-                        state = 2;
-                        break;
-                    case POP:
-                        printf("POP ");
-                        fprintf(output, "POP ");
-                        state = 2;
-                        break;
-                    case GET:
-                        printf("GET ");
-                        fprintf(output, "GET ");
-                        state = 4;
-                        break;
-                    case SET:
-                        printf("SET ");
-                        fprintf(output, "SET ");
-                        state = 4;
-                        break;
-                }
+        switch(opcode->operands) {
+            case OPERANDS_VALUE:
+                if(register_size(instruction.r0) == 4) fprintf(output, " %s %i", REGISTER_NAMES[instruction.r0], instruction.value);
+                else fprintf(output, " %s %u", REGISTER_NAMES[instruction.r0], (unsigned int) instruction.value);
                 break;
-            
-            case 1: // expecting integer
-                printf("%i\n", i);
-                fprintf(output, "%i\n", i);
-                state = 0;
+            case OPERANDS_REGISTERS:
+                fprintf(output, " %s %s", REGISTER_NAMES[instruction.r0], REGISTER_NAMES[instruction.r1]);
                 break;
-
-            case 4: // expecting a register followed by a register
-            case 3: // expecting a register followed by an integer
-            case 2: // expecting register
-                switch(i)
-                {
-                    case EAX: printf("EAX"); fprintf(output, "EAX"); break;
-                    case EBX: printf("EBX"); fprintf(output, "EBX"); break;
-                    case ECX: printf("ECX"); fprintf(output, "ECX"); break;
-                    case EDX: printf("EDX"); fprintf(output, "EDX"); break;
-                    case ESP: printf("ESP"); fprintf(output, "ESP"); break;
-                    default:
-                        puts("Unknown register error in input file.");
-                        return -1;
-                        break;
-                }
-
-                switch(state)
-                {
-                    case 2:
-                        printf("\n");
-                        fprintf(output, "\n");
-                        state = 0;
-                        break;
-                    case 3:
-                        printf(" ");
-                        fprintf(output, " ");
-                        state = 1;
-                        break;
-                    case 4:
-                        printf(" ");
-                        fprintf(output, " ");
-                        state = 2;
-                        break;
-                }
-
+            case OPERANDS_REGISTER:
+                fprintf(output, " %s", REGISTER_NAMES[instruction.r0]);
+                break;
+            case OPERANDS_BYTE:
+                fprintf(output, " %i", instruction.value);
+                break;
+            case OPERANDS_INT:
+            case OPERANDS_REL8:
+            case OPERANDS_REL16:
+                if(instruction.target >= 0 && instruction.target < size && (labels[instruction.target] || instruction.target == code_start))
+                    fprintf(output, instruction.target == code_start ? " _CODE_" : " L%i", instruction.target);
+                else fprintf(output, " %i", instruction.target);
                 break;
         }
+        fprintf(output, "\n");
+        offset += instruction.size;
     }
 
-    fclose(input);
+    write_data(output, rom, labels, code_end, size, code_start);
     fclose(output);
 
+    printf("Decompiled [%s]: %i bytes of code, %i bytes of data.\n", argv[1], code_end - code_start, size - (code_end - code_start));
+    free(rom);
+    free(labels);
+    free(boundaries);
     return 0;
 }
-
@@ -0,0 +1,534 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "drive.h"
+
+// read size bytes at the offset in the file
+static int file_read(FILE* file, long offset, void* buffer, unsigned int size) {
+    if(fseek(file, offset, SEEK_SET) != 0) return -1;
+    if(fread(buffer, 1, size, file) != size) return -1;
+    return 0;
+}
+
+// write size bytes at the offset in the file
+static int file_write(FILE* file, long offset, const void* buffer, unsigned int size) {
+    if(fseek(file, offset, SEEK_SET) != 0) return -1;
+    if(fwrite(buffer, 1, size, file) != size) return -1;
+    return 0;
+}
+
+static int overlay_open(Drive* drive, const char* path) {
+    unsigned int header[3]; // block size, drive size, base path length
+    if(file_read(drive->file, 4, header, sizeof(header)) != 0) {
+        printf("Error: Truncated overlay header in [%s].\n", path);
+        return -1;
+    }
+
+    drive->block_size = header[0];
+    drive->size = header[1];
+    if(drive->block_size == 0) {
+        printf("Error: Invalid overlay block size in [%s].\n", path);
+        return -1;
+    }
+    drive->block_count = (drive->size + drive->block_size - 1) / drive->block_size;
+
+    char* base_path = (char*) malloc(header[2] + 1);
+    if(!base_path) { puts("Memory allocation failure."); return -1; }
+    if(fread(base_path, 1, header[2], drive->file) != header[2]) {
+        printf("Error: Truncated overlay header in [%s].\n", path);
+        free(base_path);
+        return -1;
+    }
+    base_path[header[2]] = '\0';
+
+    // a relative base path is relative to the directory the overlay is in, not to where the machine runs
+    const char* slash = strrchr(path, '/');
+    if(base_path[0] != '/' && slash) {
+        size_t directory = slash - path + 1;
+        char* resolved = (char*) malloc(directory + header[2] + 1);
+        if(!resolved) { puts("Memory allocation failure."); free(base_path); return -1; }
+        memcpy(resolved, path, directory);
+        memcpy(resolved + directory, base_path, header[2] + 1);
+        free(base_path);
+        base_path = resolved;
+    }
+
+    // the base is shared between instances so it is never written to
+    drive->base = drive_open(base_path, 0);
+    if(!drive->base) {
+        printf("Error: Could not open the base image [%s] of overlay [%s].\n", base_path, path);
+        free(base_path);
+        return -1;
+    }
+    free(base_path);
+
+    unsigned int bitmap_size = (drive->block_count + 7) / 8;
+    drive->bitmap_offset = 4 + sizeof(header) + header[2];
+    drive->data_offset = drive->bitmap_offset + bitmap_size;
+    drive->bitmap = (unsigned char*) malloc(bitmap_size + 1);
+    drive->block = (unsigned char*) malloc(drive->block_size);
+    if(!drive->bitmap || !drive->block) { puts("Memory allocation failure."); return -1; }
+    if(file_read(drive->file, drive->bitmap_offset, drive->bitmap, bitmap_size) != 0) {
+        printf("Error: Truncated overlay bitmap in [%s].\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int packed_open(Drive* drive, const char* path) {
+    unsigned int header[2]; // block size, drive size
+    if(file_read(drive->file, 4, header, sizeof(header)) != 0) {
+        printf("Error: Truncated packed header in [%s].\n", path);
+        return -1;
+    }
+
+    drive->block_size = header[0];
+    drive->size = header[1];
+    if(drive->block_size == 0) {
+        printf("Error: Invalid packed block size in [%s].\n", path);
+        return -1;
+    }
+    drive->block_count = (drive->size + drive->block_size - 1) / drive->block_size;
+
+    drive->index = (unsigned int*) malloc(sizeof(unsigned int) * (drive->block_count + 1));
+    drive->packed = (unsigned char*) malloc(drive->block_size);
+    drive->cache = (unsigned char*) malloc((size_t) drive->block_size * DRIVE_CACHE_BLOCKS);
+    drive->cache_tags = (unsigned int*) malloc(sizeof(unsigned int) * DRIVE_CACHE_BLOCKS);
+    if(!drive->index || !drive->packed || !drive->cache || !drive->cache_tags) { puts("Memory allocation failure."); return -1; }
+    memset(drive->cache_tags, 0xFF, sizeof(unsigned int) * DRIVE_CACHE_BLOCKS); // no block is cached
+
+    if(fread(drive->index, sizeof(unsigned int), drive->block_count + 1, drive->file) != drive->block_count + 1) {
+        printf("Error: Truncated packed index in [%s].\n", path);
+        return -1;
+    }
+
+    unsigned int i = 0;
+    for(; i < drive->block_count; i++) {
+        if(drive->index[i + 1] < drive->index[i] || drive->index[i + 1] - drive->index[i] > drive->block_size) {
+            printf("Error: Corrupt packed index in [%s].\n", path);
+            return -1;
+        }
+    }
+
+    // the images are read only; writes belong in an overlay
+    drive->writable = 0;
+    return 0;
+}
+
+// get the decompressed block from the cache, decompressing it on a miss
+static unsigned char* packed_block(Drive* drive, unsigned int block) {
+    unsigned int slot = block % DRIVE_CACHE_BLOCKS;
+    unsigned char* data = drive->cache + (size_t) slot * drive->block_size;
+    if(drive->cache_tags[slot] == block) {
+        drive->cache_hits ++;
+        return data;
+    }
+    drive->cache_misses ++;
+
+    unsigned int length = drive->block_size;
+    if(block == drive->block_count - 1 && drive->size % drive->block_size != 0) length = drive->size % drive->block_size;
+    unsigned int stored = drive->index[block + 1] - drive->index[block];
+
+    drive->cache_tags[slot] = UINT_MAX;
+    if(stored == length) {
+        if(file_read(drive->file, drive->index[block], data, length) != 0) return NULL;
+    }
+    else {
+        if(file_read(drive->file, drive->index[block], drive->packed, stored) != 0) return NULL;
+        if(lz_decompress(drive->packed, stored, data, length) != 0) return NULL;
+    }
+    drive->cache_tags[slot] = block;
+    return data;
+}
+
+Drive* drive_open(const char* path, int writable) {
+    Drive* drive = (Drive*) calloc(1, sizeof(Drive));
+    if(!drive) { puts("Memory allocation failure."); return NULL; }
+
+    drive->writable = writable;
+    drive->file = writable ? fopen(path, "r+b") : NULL;
+    if(!drive->file) {
+        // fall back to a read-only drive
+        drive->file = fopen(path, "rb");
+        drive->writable = 0;
+    }
+    if(!drive->file) {
+        free(drive);
+        return NULL;
+    }
+
+    char magic[4] = {0};
+    fseek(drive->file, 0L, SEEK_END);
+    long size = ftell(drive->file);
+    fseek(drive->file, 0L, SEEK_SET);
+
+    if(size >= 4 && fread(magic, 1, 4, drive->file) == 4 && memcmp(magic, DRIVE_OVERLAY_MAGIC, 4) == 0) {
+        drive->format = DRIVE_OVERLAY;
+        if(overlay_open(drive, path) != 0) {
+            drive_close(drive);
+            return NULL;
+        }
+    }
+    else if(size >= 4 && memcmp(magic, DRIVE_PACKED_MAGIC, 4) == 0) {
+        drive->format = DRIVE_PACKED;
+        if(packed_open(drive, path) != 0) {
+            drive_close(drive);
+            return NULL;
+        }
+    }
+    else {
+        drive->format = DRIVE_RAW;
+        drive->size = (unsigned int) size;
+    }
+
+    return drive;
+}
+
+#define overlay_has_block(d, b) ((d)->bitmap[(b) / 8] & (1 << ((b) % 8)))
+
+int drive_read(Drive* drive, unsigned int position, void* buffer, unsigned int size) {
+    if(position > drive->size || size > drive->size - position) return -1;
+
+    switch(drive->format) {
+        case DRIVE_RAW:
+            return file_read(drive->file, position, buffer, size);
+
+        case DRIVE_OVERLAY:
+            while(size > 0) {
+                unsigned int block = position / drive->block_size;
+                unsigned int start = position % drive->block_size;
+                unsigned int count = drive->block_size - start;
+                if(count > size) count = size;
+
+                // untouched blocks fall through to the base image
+                if(overlay_has_block(drive, block)) {
+                    if(file_read(drive->file, drive->data_offset + (long) block * drive->block_size + start, buffer, count) != 0) return -1;
+                }
+                else {
+                    if(drive_read(drive->base, position, buffer, count) != 0) return -1;
+                }
+
+                buffer = (char*) buffer + count;
+                position += count;
+                size -= count;
+            }
+            return 0;
+
+        case DRIVE_PACKED:
+            while(size > 0) {
+                unsigned int block = position / drive->block_size;
+                unsigned int start = position % drive->block_size;
+                unsigned int count = drive->block_size - start;
+                if(count > size) count = size;
+
+                unsigned char* data = packed_block(drive, block);
+                if(!data) return -1;
+                memcpy(buffer, data + start, count);
+
+                buffer = (char*) buffer + count;
+                position += count;
+                size -= count;
+            }
+            return 0;
+    }
+
+    return -1;
+}
+
+int drive_write(Drive* drive, unsigned int position, const void* buffer, unsigned int size) {
+    if(!drive->writable) return -1;
+
+    switch(drive->format) {
+        case DRIVE_RAW:
+            if(file_write(drive->file, position, buffer, size) != 0) return -1;
+            if(position + size > drive->size) drive->size = position + size;
+            return 0;
+
+        case DRIVE_OVERLAY:
+            if(position > drive->size || size > drive->size - position) return -1;
+            while(size > 0) {
+                unsigned int block = position / drive->block_size;
+                unsigned int start = position % drive->block_size;
+                unsigned int count = drive->block_size - start;
+                if(count > size) count = size;
+                long block_offset = drive->data_offset + (long) block * drive->block_size;
+
+                if(overlay_has_block(drive, block)) {
+                    if(file_write(drive->file, block_offset + start, buffer, count) != 0) return -1;
+                }
+                else {
+                    // copy the block up from the base before the first write to it
+                    unsigned int block_start = block * drive->block_size;
+                    unsigned int block_end = block_start + drive->block_size;
+                    if(block_end > drive->size) block_end = drive->size;
+
+                    memset(drive->block, 0, drive->block_size);
+                    if(count != block_end - block_start) {
+                        if(drive_read(drive->base, block_start, drive->block, block_end - block_start) != 0) return -1;
+                    }
+                    memcpy(drive->block + start, buffer, count);
+                    if(file_write(drive->file, block_offset, drive->block, drive->block_size) != 0) return -1;
+
+                    // only mark the block once its data is in place
+                    drive->bitmap[block / 8] |= 1 << (block % 8);
+                    if(file_write(drive->file, drive->bitmap_offset + block / 8, &drive->bitmap[block / 8], 1) != 0) return -1;
+                }
+
+                buffer = (const char*) buffer + count;
+                position += count;
+                size -= count;
+            }
+            return 0;
+    }
+
+    return -1;
+}
+
+void drive_close(Drive* drive) {
+    if(!drive) return;
+    if(drive->base) drive_close(drive->base);
+    if(drive->bitmap) free(drive->bitmap);
+    if(drive->block) free(drive->block);
+    if(drive->index) free(drive->index);
+    if(drive->packed) free(drive->packed);
+    if(drive->cache) free(drive->cache);
+    if(drive->cache_tags) free(drive->cache_tags);
+    if(drive->file) fclose(drive->file);
+    free(drive);
+}
+
+int drive_create_overlay(const char* base_path, const char* path) {
+    Drive* base = drive_open(base_path, 0);
+    if(!base) {
+        printf("Error: Could not open base image [%s].\n", base_path);
+        return -1;
+    }
+    unsigned int size = base->size;
+    drive_close(base);
+
+    // store the full path so the overlay finds its base from any directory
+    char full_path[PATH_MAX];
+    if(!realpath(base_path, full_path)) {
+        printf("Error: Could not resolve the path of base image [%s].\n", base_path);
+        return -1;
+    }
+    base_path = full_path;
+    unsigned int header[3] = { DRIVE_OVERLAY_BLOCK_SIZE, size, strlen(base_path) };
+
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        printf("Error: Could not open overlay [%s] for writing.\n", path);
+        return -1;
+    }
+
+    unsigned int block_count = (header[1] + header[0] - 1) / header[0];
+    long data_offset = 4 + sizeof(header) + header[2] + (block_count + 7) / 8;
+
+    fwrite(DRIVE_OVERLAY_MAGIC, 1, 4, file);
+    fwrite(header, sizeof(unsigned int), 3, file);
+    fwrite(base_path, 1, header[2], file);
+    // extend the file over the empty bitmap without writing it out
+    if(data_offset > ftell(file)) {
+        fseek(file, data_offset - 1, SEEK_SET);
+        fputc(0, file);
+    }
+
+    if(fclose(file) != 0) {
+        printf("Error: Could not write overlay [%s].\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int drive_pack(Drive* drive, const char* path, unsigned int block_size) {
+    if(block_size == 0) {
+        puts("Error: Invalid block size.");
+        return -1;
+    }
+
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        printf("Error: Could not open packed image [%s] for writing.\n", path);
+        return -1;
+    }
+
+    unsigned int block_count = (drive->size + block_size - 1) / block_size;
+    unsigned int* index = (unsigned int*) malloc(sizeof(unsigned int) * (block_count + 1));
+    unsigned char* input = (unsigned char*) malloc(block_size);
+    unsigned char* output = (unsigned char*) malloc(block_size);
+    if(!index || !input || !output) { puts("Memory allocation failure."); exit(-1); }
+
+    unsigned int header[2] = { block_size, drive->size };
+    fwrite(DRIVE_PACKED_MAGIC, 1, 4, file);
+    fwrite(header, sizeof(unsigned int), 2, file);
+    // the index is written once all the block offsets are known
+    fseek(file, sizeof(unsigned int) * (block_count + 1), SEEK_CUR);
+
+    int result = 0;
+    unsigned int i = 0;
+    for(; i < block_count; i++) {
+        index[i] = (unsigned int) ftell(file);
+        unsigned int length = drive->size - i * block_size;
+        if(length > block_size) length = block_size;
+
+        if(drive_read(drive, i * block_size, input, length) != 0) {
+            printf("Error: Could not read block [%i] of the drive.\n", i);
+            result = -1;
+            break;
+        }
+
+        // keep the block uncompressed if compressing it does not save anything
+        unsigned int packed = lz_compress(input, length, output, length - 1);
+        if(packed == 0) fwrite(input, 1, length, file);
+        else fwrite(output, 1, packed, file);
+    }
+    index[block_count] = (unsigned int) ftell(file);
+
+    fseek(file, 4 + sizeof(header), SEEK_SET);
+    fwrite(index, sizeof(unsigned int), block_count + 1, file);
+
+    if(fclose(file) != 0) {
+        printf("Error: Could not write packed image [%s].\n", path);
+        result = -1;
+    }
+
+    free(index);
+    free(input);
+    free(output);
+    return result;
+}
+
+/*******************************************************************/
+/*************************** compression ***************************/
+/*******************************************************************/
+
+// A small LZ77 block format:
+// each sequence is a token byte, literals, then a match
+// token: the high 4 bits are the literal count, the low 4 bits are the match length - LZ_MIN_MATCH
+// a count of 15 is followed by extension bytes which are added on until one is below 255
+// a match is a 2 byte little endian offset back into the output followed by the match length extension
+// the last sequence of a block only has literals
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static inline unsigned int lz_hash(const unsigned char* p) {
+    unsigned int v;
+    memcpy(&v, p, sizeof(unsigned int));
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// write a length extension, returns the new output position or NULL if it does not fit
+static unsigned char* lz_write_length(unsigned char* op, unsigned char* oend, unsigned int length) {
+    while(length >= 255) {
+        if(op >= oend) return NULL;
+        *op++ = 255;
+        length -= 255;
+    }
+    if(op >= oend) return NULL;
+    *op++ = (unsigned char) length;
+    return op;
+}
+
+static unsigned char* lz_write_sequence(unsigned char* op, unsigned char* oend, const unsigned char* literals, unsigned int literal_count, unsigned int offset, unsigned int match_length) {
+    unsigned int match = match_length ? match_length - LZ_MIN_MATCH : 0;
+    if(op >= oend) return NULL;
+    *op++ = (unsigned char) (((literal_count < 15 ? literal_count : 15) << 4) | (match < 15 ? match : 15));
+    if(literal_count >= 15 && !(op = lz_write_length(op, oend, literal_count - 15))) return NULL;
+
+    if((unsigned int) (oend - op) < literal_count) return NULL;
+    memcpy(op, literals, literal_count);
+    op += literal_count;
+
+    if(match_length == 0) return op; // the last sequence
+    if(oend - op < 2) return NULL;
+    *op++ = (unsigned char) (offset & 0xFF);
+    *op++ = (unsigned char) (offset >> 8);
+    if(match >= 15 && !(op = lz_write_length(op, oend, match - 15))) return NULL;
+    return op;
+}
+
+unsigned int lz_compress(const unsigned char* input, unsigned int size, unsigned char* output, unsigned int capacity) {
+    unsigned int table[1 << LZ_HASH_BITS]; // the last position + 1 of each hash, 0 is empty
+    memset(table, 0, sizeof(table));
+
+    unsigned char* op = output;
+    unsigned char* oend = output + capacity;
+    unsigned int anchor = 0; // the start of the pending literals
+    unsigned int ip = 0;
+
+    while(size >= LZ_MIN_MATCH && ip <= size - LZ_MIN_MATCH) {
+        unsigned int h = lz_hash(input + ip);
+        unsigned int ref = table[h];
+        table[h] = ip + 1;
+
+        if(ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || memcmp(input + ref - 1, input + ip, LZ_MIN_MATCH) != 0) {
+            ip ++;
+            continue;
+        }
+        ref --;
+
+        unsigned int length = LZ_MIN_MATCH;
+        while(ip + length < size && input[ref + length] == input[ip + length]) length ++;
+
+        op = lz_write_sequence(op, oend, input + anchor, ip - anchor, ip - ref, length);
+        if(!op) return 0;
+        ip += length;
+        anchor = ip;
+    }
+
+    if(anchor < size) {
+        op = lz_write_sequence(op, oend, input + anchor, size - anchor, 0, 0);
+        if(!op) return 0;
+    }
+    return (unsigned int) (op - output);
+}
+
+// read a length extension, returns -1 if the input runs out
+static int lz_read_length(const unsigned char** ip, const unsigned char* iend, unsigned int* length) {
+    unsigned char b;
+    do {
+        if(*ip >= iend) return -1;
+        b = *(*ip)++;
+        *length += b;
+    } while(b == 255);
+    return 0;
+}
+
+int lz_decompress(const unsigned char* input, unsigned int size, unsigned char* output, unsigned int output_size) {
+    const unsigned char* ip = input;
+    const unsigned char* iend = input + size;
+    unsigned char* op = output;
+    unsigned char* oend = output + output_size;
+
+    while(op < oend) {
+        if(ip >= iend) return -1;
+        unsigned char token = *ip++;
+
+        unsigned int literal_count = token >> 4;
+        if(literal_count == 15 && lz_read_length(&ip, iend, &literal_count) != 0) return -1;
+        if((unsigned int) (iend - ip) < literal_count || (unsigned int) (oend - op) < literal_count) return -1;
+        memcpy(op, ip, literal_count);
+        ip += literal_count;
+        op += literal_count;
+
+        if(op == oend) break; // the last sequence
+
+        if(iend - ip < 2) return -1;
+        unsigned int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        unsigned int length = token & 15;
+        if(length == 15 && lz_read_length(&ip, iend, &length) != 0) return -1;
+        length += LZ_MIN_MATCH;
+
+        if(offset == 0 || offset > (unsigned int) (op - output) || (unsigned int) (oend - op) < length) return -1;
+        // the match may overlap the output being written so copy forwards byte by byte
+        const unsigned char* match = op - offset;
+        while(length--) *op++ = *match++;
+    }
+
+    return ip == iend ? 0 : -1;
+}
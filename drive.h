@@ -0,0 +1,90 @@
+#ifndef DRIVE_H
+#define DRIVE_H
+
+#include <stdio.h>
+
+// drive image formats:
+#define DRIVE_RAW     0 // a flat file; byte N of the file is byte N of the drive
+#define DRIVE_OVERLAY 1 // a copy-on-write delta file layered over a read-only base image
+#define DRIVE_PACKED  2 // a read-only image stored as independently compressed blocks
+
+// overlay files begin with this magic string
+#define DRIVE_OVERLAY_MAGIC "VMOV"
+// the default overlay block size in bytes
+#define DRIVE_OVERLAY_BLOCK_SIZE 4096
+
+// Overlay file layout:
+// char[4]      - magic ("VMOV")
+// unsigned int - block size in bytes
+// unsigned int - drive size in bytes
+// unsigned int - length of the base image path
+// char[...]    - base image path (not null terminated), written as a full path, a relative one is relative to the overlay
+// bitmap       - one bit per block, set once the block has been written to the overlay
+// ------------------------------
+// Block data...  (block N lives at data offset + N * block size, untouched blocks are never allocated)
+
+// packed files begin with this magic string
+#define DRIVE_PACKED_MAGIC "VMCZ"
+// the default packed block size in bytes
+#define DRIVE_PACKED_BLOCK_SIZE 16384
+// the number of decompressed blocks kept in memory (direct mapped)
+#define DRIVE_CACHE_BLOCKS 64
+
+// Packed file layout:
+// char[4]        - magic ("VMCZ")
+// unsigned int   - block size in bytes
+// unsigned int   - drive size in bytes
+// unsigned int[] - index: block count + 1 file offsets, block N is stored between index[N] and index[N + 1]
+// ------------------------------
+// Block data... (blocks which did not shrink are stored uncompressed)
+
+typedef struct Drive
+{
+    int format;         // one of the DRIVE_* formats
+    FILE* file;         // the image file
+    unsigned int size;  // the size of the drive in bytes
+    int writable;       // 1 if the drive may be written to
+
+    // overlay images only:
+    struct Drive* base;          // the image reads fall through to
+    unsigned int block_size;     // the size of a block in bytes
+    unsigned int block_count;    // the number of blocks in the drive
+    unsigned char* bitmap;       // the blocks present in the overlay
+    long bitmap_offset;          // the offset of the bitmap in the file
+    long data_offset;            // the offset of the first block in the file
+    unsigned char* block;        // scratch space for copying up partial blocks
+
+    // packed images only:
+    unsigned int* index;         // the file offset of each block
+    unsigned char* packed;       // scratch space for reading a compressed block
+    unsigned char* cache;        // the decompressed block cache
+    unsigned int* cache_tags;    // the block held in each cache slot
+    unsigned int cache_hits;
+    unsigned int cache_misses;
+}Drive;
+
+// open the drive image at the path, detecting the image format
+// returns NULL on failure
+Drive* drive_open(const char* path, int writable);
+
+// read/write size bytes at the position on the drive
+// return 0 on success and -1 on failure
+int drive_read(Drive* drive, unsigned int position, void* buffer, unsigned int size);
+int drive_write(Drive* drive, unsigned int position, const void* buffer, unsigned int size);
+
+void drive_close(Drive* drive);
+
+// create an empty overlay at the path over the base image
+// only the header and the (sparse) bitmap are written so this does not depend on the drive size
+int drive_create_overlay(const char* base_path, const char* path);
+
+// pack the contents of the drive into a packed image at the path
+int drive_pack(Drive* drive, const char* path, unsigned int block_size);
+
+// the block compressor used by packed images
+// lz_compress returns the compressed size, or 0 if the output does not fit in the capacity
+// lz_decompress returns 0 if exactly size bytes were decompressed and -1 if the input is corrupt
+unsigned int lz_compress(const unsigned char* input, unsigned int size, unsigned char* output, unsigned int capacity);
+int lz_decompress(const unsigned char* input, unsigned int size, unsigned char* output, unsigned int output_size);
+
+#endif
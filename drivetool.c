@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "drive.h"
+
+// drive image tool
+// usage:
+// drivetool overlay [base] [overlay] - create a copy-on-write overlay over the base image
+// drivetool pack [drive] [output] (block size) - convert any drive image into a packed (block compressed) image
+int main(int argc, char* argv[])
+{
+    if(argc < 2) {
+        puts("Error: Expected a command.");
+        return -1;
+    }
+
+    if(strcmp(argv[1], "overlay") == 0) {
+        if(argc != 4) {
+            puts("Error: Expected 4 arguments.");
+            return -1;
+        }
+        if(drive_create_overlay(argv[2], argv[3]) != 0) return -1;
+        printf("Created overlay [%s] over [%s].\n", argv[3], argv[2]);
+        return 0;
+    }
+
+    if(strcmp(argv[1], "pack") == 0) {
+        if(argc != 4 && argc != 5) {
+            puts("Error: Expected 4 or 5 arguments.");
+            return -1;
+        }
+        unsigned int block_size = argc == 5 ? (unsigned int) atoi(argv[4]) : DRIVE_PACKED_BLOCK_SIZE;
+
+        Drive* drive = drive_open(argv[2], 0);
+        if(!drive) {
+            printf("Error: Could not open drive [%s].\n", argv[2]);
+            return -1;
+        }
+        if(drive_pack(drive, argv[3], block_size) != 0) {
+            drive_close(drive);
+            return -1;
+        }
+        unsigned int size = drive->size;
+        drive_close(drive);
+
+        FILE* file = fopen(argv[3], "rb");
+        if(!file) return -1;
+        fseek(file, 0L, SEEK_END);
+        long packed = ftell(file);
+        fclose(file);
+        printf("Packed [%s] into [%s]: %u bytes -> %li bytes.\n", argv[2], argv[3], size, packed);
+        return 0;
+    }
+
+    printf("Error: Unknown command [%s].\n", argv[1]);
+    return -1;
+}
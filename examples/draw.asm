@@ -37,10 +37,11 @@ loop:
     JMP loop ; otherwise loop
 
 break:
+INT 7 ; redraw the window
 
 ; while the window isn't closed
 wait:
+    HLT ; sleep until there is an event
     INT 6 ; poll the window's events
-    ; INT 7 ; redraw the window
     JMP wait
 
@@ -1,20 +1,13 @@
 ; hello world program
 
 str_start: "  HELLO WORLD\n" ; RAW data
-str_end:
+<byte>[0] ; null terminator
 
 _CODE_:
 
-MOV ESI str_start ; stack source index set to the string start
-MOV EDX str_end ; EDX used to mark the string end
+MOV ESI str_start ; source index set to the string start
+MOV EAX 0 ; the string is null terminated
 
-print:
-FETCH EAX ; memory access at point ESP
-
-INT 3; system interupt
-INC ESI 1 ; increment the stack pointer to the next character
-
-CMP ESI EDX
-JLE print
+INT 10 ; print string interupt
 
 INT 1 ; interreupt with termination status in EAX
@@ -0,0 +1,146 @@
+#ifndef FONT_H
+#define FONT_H
+
+// the built-in 8x16 bitmap font used by the text console
+// printable ascii only (FONT_FIRST to FONT_LAST), rasterized from DejaVu Sans Mono
+// each glyph is 16 rows from the top, the most significant bit of a row is its leftmost pixel
+//
+// The glyphs are derived from the DejaVu fonts, whose license follows. DejaVu changes are in the public domain.
+//
+// Copyright (c) 2003 by Bitstream, Inc. All Rights Reserved. Bitstream Vera is a trademark of Bitstream, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of the fonts accompanying this
+// license ("Fonts") and associated documentation files (the "Font Software"), to reproduce and distribute the Font
+// Software, including without limitation the rights to use, copy, merge, publish, distribute, and/or sell copies of
+// the Font Software, and to permit persons to whom the Font Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright and trademark notices and this permission notice shall be included in all copies of one or
+// more of the Font Software typefaces.
+//
+// The Font Software may be modified, altered, or added to, and in particular the designs of glyphs or characters in
+// the Fonts may be modified and additional glyphs or characters may be added to the Fonts, only if the fonts are
+// renamed to names not containing either the words "Bitstream" or the word "Vera".
+//
+// This License becomes null and void to the extent applicable to Fonts or Font Software that has been modified and
+// is distributed under the "Bitstream Vera" names.
+//
+// The Font Software may be sold as part of a larger software package but no copy of one or more of the Font Software
+// typefaces may be sold by itself.
+//
+// THE FONT SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+// TO ANY WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF COPYRIGHT, PATENT,
+// TRADEMARK, OR OTHER RIGHT. IN NO EVENT SHALL BITSTREAM OR THE GNOME FOUNDATION BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, INCLUDING ANY GENERAL, SPECIAL, INDIRECT, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, WHETHER IN AN
+// ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF THE USE OR INABILITY TO USE THE FONT SOFTWARE OR FROM
+// OTHER DEALINGS IN THE FONT SOFTWARE.
+//
+// Except as contained in this notice, the names of Gnome, the Gnome Foundation, and Bitstream Inc., shall not be used
+// in advertising or otherwise to promote the sale, use or other dealings in this Font Software without prior written
+// authorization from the Gnome Foundation or Bitstream Inc., respectively. For further information, contact:
+// fonts at gnome dot org.
+
+#define FONT_WIDTH  8
+#define FONT_HEIGHT 16
+#define FONT_FIRST  32
+#define FONT_LAST   126
+
+static const unsigned char FONT[FONT_LAST - FONT_FIRST + 1][FONT_HEIGHT] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // space
+    { 0x00, 0x00, 0x18, 0x18, 0x18, 0x18, 0x18, 0x08, 0x00, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00 }, // !
+    { 0x00, 0x00, 0x34, 0x34, 0x34, 0x34, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // "
+    { 0x00, 0x00, 0x1A, 0x12, 0x12, 0x7F, 0x34, 0x24, 0xFF, 0x2C, 0x68, 0x48, 0x00, 0x00, 0x00, 0x00 }, // #
+    { 0x00, 0x08, 0x08, 0x3C, 0x6A, 0x68, 0x68, 0x3C, 0x0A, 0x0B, 0x4A, 0x3E, 0x08, 0x08, 0x00, 0x00 }, // $
+    { 0x00, 0x00, 0x70, 0xD8, 0xD8, 0x73, 0x0C, 0x30, 0x46, 0x09, 0x09, 0x0F, 0x00, 0x00, 0x00, 0x00 }, // %
+    { 0x00, 0x00, 0x3C, 0x20, 0x20, 0x30, 0x70, 0x59, 0xCD, 0xC7, 0x66, 0x3F, 0x00, 0x00, 0x00, 0x00 }, // &
+    { 0x00, 0x00, 0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // quote
+    { 0x00, 0x04, 0x08, 0x08, 0x18, 0x10, 0x10, 0x10, 0x10, 0x18, 0x08, 0x08, 0x04, 0x00, 0x00, 0x00 }, // (
+    { 0x00, 0x10, 0x10, 0x18, 0x08, 0x08, 0x0C, 0x0C, 0x08, 0x08, 0x18, 0x10, 0x10, 0x00, 0x00, 0x00 }, // )
+    { 0x00, 0x00, 0x08, 0x6A, 0x3C, 0x3C, 0x6A, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // *
+    { 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0xFF, 0x08, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00 }, // +
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x18, 0x10, 0x00, 0x00 }, // ,
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3C, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // -
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00 }, // .
+    { 0x00, 0x00, 0x02, 0x06, 0x04, 0x0C, 0x08, 0x08, 0x18, 0x10, 0x30, 0x20, 0x60, 0x40, 0x00, 0x00 }, // /
+    { 0x00, 0x00, 0x3C, 0x26, 0x62, 0x43, 0x43, 0x5B, 0x43, 0x62, 0x26, 0x3C, 0x00, 0x00, 0x00, 0x00 }, // 0
+    { 0x00, 0x00, 0x18, 0x28, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x3F, 0x00, 0x00, 0x00, 0x00 }, // 1
+    { 0x00, 0x00, 0x3C, 0x46, 0x02, 0x06, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x7E, 0x00, 0x00, 0x00, 0x00 }, // 2
+    { 0x00, 0x00, 0x3C, 0x46, 0x02, 0x06, 0x1C, 0x06, 0x02, 0x02, 0x46, 0x3C, 0x00, 0x00, 0x00, 0x00 }, // 3
+    { 0x00, 0x00, 0x0E, 0x0E, 0x16, 0x36, 0x26, 0x46, 0x7F, 0x06, 0x06, 0x06, 0x00, 0x00, 0x00, 0x00 }, // 4
+    { 0x00, 0x00, 0x7E, 0x60, 0x60, 0x7C, 0x46, 0x02, 0x02, 0x02, 0x46, 0x3C, 0x00, 0x00, 0x00, 0x00 }, // 5
+    { 0x00, 0x00, 0x1C, 0x32, 0x60, 0x40, 0x7C, 0x66, 0x63, 0x63, 0x66, 0x3C, 0x00, 0x00, 0x00, 0x00 }, // 6
+    { 0x00, 0x00, 0x7E, 0x02, 0x06, 0x04, 0x0C, 0x0C, 0x08, 0x18, 0x10, 0x30, 0x00, 0x00, 0x00, 0x00 }, // 7
+    { 0x00, 0x00, 0x3C, 0x66, 0x62, 0x66, 0x3C, 0x66, 0x43, 0x43, 0x66, 0x3C, 0x00, 0x00, 0x00, 0x00 }, // 8
+    { 0x00, 0x00, 0x3C, 0x66, 0x42, 0x42, 0x67, 0x3F, 0x02, 0x02, 0x06, 0x3C, 0x00, 0x00, 0x00, 0x00 }, // 9
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00 }, // :
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00, 0x18, 0x18, 0x18, 0x10, 0x00, 0x00 }, // ;
+    { 0x00, 0x00, 0x00, 0x00, 0x03, 0x0E, 0x78, 0xE0, 0x78, 0x0E, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 }, // <
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // =
+    { 0x00, 0x00, 0x00, 0x00, 0x40, 0x78, 0x0E, 0x03, 0x0E, 0x78, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00 }, // >
+    { 0x00, 0x00, 0x3C, 0x26, 0x02, 0x06, 0x0C, 0x18, 0x18, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00 }, // ?
+    { 0x00, 0x00, 0x1E, 0x23, 0x41, 0xCF, 0x9B, 0x91, 0x91, 0x9B, 0xCF, 0x40, 0x30, 0x1E, 0x00, 0x00 }, // @
+    { 0x00, 0x00, 0x18, 0x1C, 0x34, 0x34, 0x26, 0x26, 0x7E, 0x42, 0x43, 0xC1, 0x00, 0x00, 0x00, 0x00 }, // A
+    { 0x00, 0x00, 0x7C, 0x66, 0x62, 0x66, 0x7C, 0x62, 0x63, 0x63, 0x63, 0x7E, 0x00, 0x00, 0x00, 0x00 }, // B
+    { 0x00, 0x00, 0x1E, 0x32, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x32, 0x1E, 0x00, 0x00, 0x00, 0x00 }, // C
+    { 0x00, 0x00, 0x7C, 0x46, 0x42, 0x43, 0x43, 0x43, 0x43, 0x42, 0x46, 0x7C, 0x00, 0x00, 0x00, 0x00 }, // D
+    { 0x00, 0x00, 0x7F, 0x60, 0x60, 0x60, 0x7E, 0x60, 0x60, 0x60, 0x60, 0x7F, 0x00, 0x00, 0x00, 0x00 }, // E
+    { 0x00, 0x00, 0x7F, 0x60, 0x60, 0x60, 0x7E, 0x60, 0x60, 0x60, 0x60, 0x60, 0x00, 0x00, 0x00, 0x00 }, // F
+    { 0x00, 0x00, 0x1E, 0x32, 0x60, 0x40, 0x40, 0x47, 0x43, 0x63, 0x33, 0x1E, 0x00, 0x00, 0x00, 0x00 }, // G
+    { 0x00, 0x00, 0x43, 0x43, 0x43, 0x43, 0x7F, 0x43, 0x43, 0x43, 0x43, 0x43, 0x00, 0x00, 0x00, 0x00 }, // H
+    { 0x00, 0x00, 0x7E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x7E, 0x00, 0x00, 0x00, 0x00 }, // I
+    { 0x00, 0x00, 0x3E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x4C, 0x78, 0x00, 0x00, 0x00, 0x00 }, // J
+    { 0x00, 0x00, 0x43, 0x46, 0x4C, 0x58, 0x78, 0x68, 0x4C, 0x46, 0x42, 0x43, 0x00, 0x00, 0x00, 0x00 }, // K
+    { 0x00, 0x00, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x7F, 0x00, 0x00, 0x00, 0x00 }, // L
+    { 0x00, 0x00, 0xE3, 0xE7, 0xE7, 0xD7, 0xDB, 0xDB, 0xC3, 0xC3, 0xC3, 0xC3, 0x00, 0x00, 0x00, 0x00 }, // M
+    { 0x00, 0x00, 0x63, 0x63, 0x73, 0x53, 0x5B, 0x4B, 0x4F, 0x47, 0x47, 0x47, 0x00, 0x00, 0x00, 0x00 }, // N
+    { 0x00, 0x00, 0x3C, 0x66, 0x62, 0x43, 0x43, 0x43, 0x43, 0x62, 0x66, 0x3C, 0x00, 0x00, 0x00, 0x00 }, // O
+    { 0x00, 0x00, 0x7E, 0x63, 0x63, 0x63, 0x63, 0x7E, 0x60, 0x60, 0x60, 0x60, 0x00, 0x00, 0x00, 0x00 }, // P
+    { 0x00, 0x00, 0x3C, 0x66, 0x62, 0x43, 0x43, 0x43, 0x43, 0x62, 0x66, 0x3C, 0x06, 0x02, 0x00, 0x00 }, // Q
+    { 0x00, 0x00, 0x7C, 0x46, 0x42, 0x42, 0x46, 0x7C, 0x46, 0x42, 0x43, 0x41, 0x00, 0x00, 0x00, 0x00 }, // R
+    { 0x00, 0x00, 0x3C, 0x62, 0x40, 0x60, 0x38, 0x1E, 0x02, 0x03, 0x46, 0x3C, 0x00, 0x00, 0x00, 0x00 }, // S
+    { 0x00, 0x00, 0xFF, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00 }, // T
+    { 0x00, 0x00, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x62, 0x66, 0x3C, 0x00, 0x00, 0x00, 0x00 }, // U
+    { 0x00, 0x00, 0xC3, 0x43, 0x62, 0x62, 0x26, 0x26, 0x34, 0x1C, 0x1C, 0x18, 0x00, 0x00, 0x00, 0x00 }, // V
+    { 0x00, 0x00, 0xC1, 0xC1, 0xC1, 0xD9, 0x5B, 0x5F, 0x77, 0x76, 0x66, 0x66, 0x00, 0x00, 0x00, 0x00 }, // W
+    { 0x00, 0x00, 0x43, 0x62, 0x36, 0x1C, 0x18, 0x1C, 0x34, 0x26, 0x62, 0xC3, 0x00, 0x00, 0x00, 0x00 }, // X
+    { 0x00, 0x00, 0xC3, 0x62, 0x26, 0x34, 0x1C, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00 }, // Y
+    { 0x00, 0x00, 0x7F, 0x03, 0x06, 0x04, 0x0C, 0x18, 0x10, 0x30, 0x60, 0x7F, 0x00, 0x00, 0x00, 0x00 }, // Z
+    { 0x00, 0x1C, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1C, 0x00, 0x00, 0x00 }, // [
+    { 0x00, 0x00, 0x40, 0x60, 0x20, 0x30, 0x10, 0x18, 0x08, 0x08, 0x0C, 0x04, 0x06, 0x02, 0x00, 0x00 }, // backslash
+    { 0x00, 0x38, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x38, 0x00, 0x00, 0x00 }, // ]
+    { 0x00, 0x00, 0x18, 0x3C, 0x26, 0x43, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // ^
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x00 }, // _
+    { 0x30, 0x10, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // `
+    { 0x00, 0x00, 0x00, 0x00, 0x3C, 0x66, 0x02, 0x3E, 0x62, 0x42, 0x66, 0x3A, 0x00, 0x00, 0x00, 0x00 }, // a
+    { 0x00, 0x60, 0x60, 0x60, 0x7C, 0x66, 0x63, 0x63, 0x63, 0x63, 0x66, 0x7C, 0x00, 0x00, 0x00, 0x00 }, // b
+    { 0x00, 0x00, 0x00, 0x00, 0x1E, 0x32, 0x60, 0x60, 0x60, 0x60, 0x32, 0x1E, 0x00, 0x00, 0x00, 0x00 }, // c
+    { 0x00, 0x02, 0x02, 0x02, 0x3E, 0x66, 0x42, 0x42, 0x42, 0x42, 0x66, 0x3E, 0x00, 0x00, 0x00, 0x00 }, // d
+    { 0x00, 0x00, 0x00, 0x00, 0x3C, 0x62, 0x43, 0x7F, 0x40, 0x60, 0x62, 0x3E, 0x00, 0x00, 0x00, 0x00 }, // e
+    { 0x00, 0x0E, 0x18, 0x18, 0x7E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00 }, // f
+    { 0x00, 0x00, 0x00, 0x00, 0x3E, 0x66, 0x42, 0x42, 0x42, 0x42, 0x66, 0x3E, 0x02, 0x26, 0x3C, 0x00 }, // g
+    { 0x00, 0x60, 0x60, 0x60, 0x7C, 0x66, 0x62, 0x62, 0x62, 0x62, 0x62, 0x62, 0x00, 0x00, 0x00, 0x00 }, // h
+    { 0x00, 0x08, 0x08, 0x00, 0x38, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x7F, 0x00, 0x00, 0x00, 0x00 }, // i
+    { 0x00, 0x08, 0x08, 0x00, 0x38, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x78, 0x00 }, // j
+    { 0x00, 0x60, 0x60, 0x60, 0x62, 0x64, 0x68, 0x78, 0x6C, 0x66, 0x62, 0x63, 0x00, 0x00, 0x00, 0x00 }, // k
+    { 0x00, 0x70, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x18, 0x18, 0x0E, 0x00, 0x00, 0x00, 0x00 }, // l
+    { 0x00, 0x00, 0x00, 0x00, 0x7E, 0x5B, 0x4B, 0x4B, 0x4B, 0x4B, 0x4B, 0x4B, 0x00, 0x00, 0x00, 0x00 }, // m
+    { 0x00, 0x00, 0x00, 0x00, 0x7C, 0x66, 0x62, 0x62, 0x62, 0x62, 0x62, 0x62, 0x00, 0x00, 0x00, 0x00 }, // n
+    { 0x00, 0x00, 0x00, 0x00, 0x3C, 0x66, 0x62, 0x43, 0x43, 0x62, 0x66, 0x3C, 0x00, 0x00, 0x00, 0x00 }, // o
+    { 0x00, 0x00, 0x00, 0x00, 0x7C, 0x66, 0x62, 0x63, 0x63, 0x62, 0x66, 0x7C, 0x60, 0x60, 0x60, 0x00 }, // p
+    { 0x00, 0x00, 0x00, 0x00, 0x3E, 0x66, 0x62, 0x42, 0x42, 0x62, 0x66, 0x3A, 0x02, 0x02, 0x02, 0x00 }, // q
+    { 0x00, 0x00, 0x00, 0x00, 0x3F, 0x38, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x00, 0x00, 0x00, 0x00 }, // r
+    { 0x00, 0x00, 0x00, 0x00, 0x3C, 0x22, 0x60, 0x38, 0x0E, 0x02, 0x66, 0x3C, 0x00, 0x00, 0x00, 0x00 }, // s
+    { 0x00, 0x00, 0x10, 0x10, 0x7E, 0x10, 0x10, 0x10, 0x10, 0x10, 0x18, 0x0E, 0x00, 0x00, 0x00, 0x00 }, // t
+    { 0x00, 0x00, 0x00, 0x00, 0x62, 0x62, 0x62, 0x62, 0x62, 0x62, 0x66, 0x3A, 0x00, 0x00, 0x00, 0x00 }, // u
+    { 0x00, 0x00, 0x00, 0x00, 0x43, 0x62, 0x66, 0x26, 0x34, 0x34, 0x1C, 0x18, 0x00, 0x00, 0x00, 0x00 }, // v
+    { 0x00, 0x00, 0x00, 0x00, 0x81, 0xC1, 0xD9, 0x5B, 0x5B, 0x76, 0x76, 0x26, 0x00, 0x00, 0x00, 0x00 }, // w
+    { 0x00, 0x00, 0x00, 0x00, 0x62, 0x26, 0x3C, 0x18, 0x18, 0x34, 0x66, 0x43, 0x00, 0x00, 0x00, 0x00 }, // x
+    { 0x00, 0x00, 0x00, 0x00, 0x43, 0x62, 0x22, 0x26, 0x34, 0x1C, 0x1C, 0x18, 0x18, 0x10, 0x70, 0x00 }, // y
+    { 0x00, 0x00, 0x00, 0x00, 0x7E, 0x06, 0x04, 0x08, 0x18, 0x30, 0x20, 0x7E, 0x00, 0x00, 0x00, 0x00 }, // z
+    { 0x00, 0x0E, 0x08, 0x08, 0x08, 0x18, 0x18, 0x70, 0x18, 0x18, 0x08, 0x08, 0x08, 0x0E, 0x00, 0x00 }, // {
+    { 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x00 }, // |
+    { 0x00, 0x70, 0x18, 0x18, 0x18, 0x18, 0x08, 0x0E, 0x08, 0x18, 0x18, 0x18, 0x18, 0x70, 0x00, 0x00 }, // }
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x79, 0x0E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }  // ~
+};
+
+#endif
@@ -1,11 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "system.h"
+#include "drive.h"
+#include "font.h"
 
-#include <SDL.h>
-#include <OpenGL/gl3.h>
+// build with -DSOFTWARE_GPU to draw into an in-memory framebuffer instead of an OpenGL window
+#ifndef SOFTWARE_GPU
+    #include <SDL.h>
+    #include <OpenGL/gl3.h>
+#endif
 
 #define CONSOLE_WIDTH 640
 #define CONSOLE_HEIGHT 480
@@ -20,6 +35,30 @@
 #endif
 
 static unsigned char* RAM;
+static int MACHINE_STATS = 0; // print the device statistics on exit
+static atomic_int MACHINE_RUNNING = 1; // cleared to stop every CPU
+static atomic_int MACHINE_CRASHED = 0; // set when any CPU crashes, the machine still shuts down normally
+
+static int MACHINE_ENTRY = 0;    // the address the code begins at
+static int MACHINE_ROM_SIZE = 0; // the stacks begin after the ROM
+
+static int CPU_COUNT = 1;
+static _Thread_local int CPU_ID = 0; // the CPU running on this host thread
+
+static _Thread_local unsigned long long MACHINE_INSTRUCTIONS = 0; // instructions executed by this CPU
+static _Thread_local unsigned long long MACHINE_CYCLES = 0;       // modelled cycles executed by this CPU
+static unsigned long long CPU_INSTRUCTIONS[CPU_MAX];               // the final counts of each CPU
+static unsigned long long CPU_CYCLES[CPU_MAX];
+
+// the modelled cost of each opcode in cycles
+static const unsigned char OPCODE_CYCLES[256] = {
+    [NOP] = 1, [INT] = 20, [MOV] = 1, [CPY] = 1, [ADD] = 1, [INC] = 1, [DEC] = 1, [SUB] = 1,
+    [CMP] = 1, [CCMP] = 1, [JMP] = 2, [JEQ] = 2, [JLE] = 2, [JGE] = 2, [JNE] = 2,
+    [PUSH] = 2, [POP] = 2, [FETCH] = 3, [WRITE] = 3, [CALL] = 3, [RET] = 3, [HLT] = 1, [IRET] = 4,
+    [CAS] = 6, [XADD] = 6, [XCHG] = 6, [FENCE] = 4, [TASK] = 12, [YIELD] = 10, [JOIN] = 10,
+    [JMP8] = 2, [JEQ8] = 2, [JLE8] = 2, [JGE8] = 2, [JNE8] = 2, [CALL8] = 3,
+    [JMP16] = 2, [JEQ16] = 2, [JLE16] = 2, [JGE16] = 2, [JNE16] = 2, [CALL16] = 3
+};
 
 #define L 0
 #define H 1
@@ -32,31 +71,26 @@ typedef union REG32
     float f32;
 }REG32;
 
-static REG32 REGISTERS[REGISTER_COUNT];
+// every CPU has its own registers
+static _Thread_local REG32 REGISTERS[REGISTER_COUNT];
 
 #define REG8_OFFSET AL
-// 8 bit sub-register pointers
-static char* REG8[] =
-{
-    &REGISTERS[EAX].m8[L],
-    &REGISTERS[EAX].m8[H],
-    &REGISTERS[EBX].m8[L],
-    &REGISTERS[EBX].m8[H],
-    &REGISTERS[ECX].m8[L],
-    &REGISTERS[ECX].m8[H],
-    &REGISTERS[EDX].m8[L],
-    &REGISTERS[EDX].m8[H]
-};
+// 8 bit sub-register pointers (AL, AH, BL, BH, ...)
+static _Thread_local char* REG8[8];
 
 #define REG16_OFFSET AX
-// 16 bit sub-register pointers
-static short* REG16[] =
-{
-    &REGISTERS[EAX].m16,
-    &REGISTERS[EBX].m16,
-    &REGISTERS[ECX].m16,
-    &REGISTERS[EDX].m16
-};
+// 16 bit sub-register pointers (AX, BX, CX, DX)
+static _Thread_local short* REG16[4];
+
+// point the sub-register tables at the registers of the calling host thread
+void bind_registers() {
+    int r;
+    for(r = 0; r < 4; r++) {
+        REG8[r * 2 + L] = &REGISTERS[EAX + r].m8[L];
+        REG8[r * 2 + H] = &REGISTERS[EAX + r].m8[H];
+        REG16[r] = &REGISTERS[EAX + r].m16;
+    }
+}
 
 int readROM()
 {
@@ -72,11 +106,10 @@ int readROM()
         return -1;
     }
 
-    fread(&REGISTERS[EIP].m32, sizeof(int), 1, file);
+    fread(&MACHINE_ENTRY, sizeof(int), 1, file);
 
     if(fread(RAM, 1, size - 4, file) != size - 4) return -1;
-    REGISTERS[ESB].m32 += size;
-    REGISTERS[ESP].m32 += size;
+    MACHINE_ROM_SIZE = size;
 
     fclose(file);
     return 0;
@@ -86,18 +119,499 @@ static inline char read_b() { return RAM[REGISTERS[EIP].m32++]; }
 static inline int read_s(){ return RAM[REGISTERS[EIP].m32++] + (RAM[REGISTERS[EIP].m32++] << 8); }
 static inline int read_i(){ return RAM[REGISTERS[EIP].m32++] + (RAM[REGISTERS[EIP].m32++] << 8) + (RAM[REGISTERS[EIP].m32++] << 16) + (RAM[REGISTERS[EIP].m32++] << 24); }
 
+/*******************************************************************/
+/******************************* bus *******************************/
+/*******************************************************************/
+
+// Devices are attached to the machine through the bus:
+// an interrupt number is dispatched to the one handler registered for it,
+// and address ranges of RAM can be mapped to a device which is told before they are read and after they are written.
+// Mapped ranges must sit at the top of RAM so ordinary accesses are filtered out by a single compare against the lowest mapping.
+
+// device handler results:
+#define DEVICE_OK     0
+#define DEVICE_HALT   1  // stop the machine
+#define DEVICE_CRASH -1  // crash the machine, the device prints why
+#define DEVICE_WAIT   2  // the device is not ready, park the CPU for a moment and run the interrupt again
+
+#define BUS_MAX_MAPPINGS 16
+
+// handles an interrupt, returns one of the DEVICE_* results
+typedef int (*InterruptHandler)();
+// told about an access to size bytes at the address
+typedef void (*MemoryHandler)(int address, int size);
+
+typedef struct Mapping
+{
+    int start, end; // [start, end)
+    MemoryHandler read;  // may be NULL
+    MemoryHandler write; // may be NULL
+}Mapping;
+
+static InterruptHandler INTERRUPT_HANDLERS[256];
+static pthread_mutex_t BUS_LOCK = PTHREAD_MUTEX_INITIALIZER; // interrupts run one at a time across CPUs
+static Mapping BUS_MAPPINGS[BUS_MAX_MAPPINGS];
+static int BUS_MAPPING_COUNT = 0;
+static int BUS_LOWEST_MAPPING = RAM_SIZE; // the lowest mapped address
+
+int bus_interrupt(unsigned char number, InterruptHandler handler) {
+    if(INTERRUPT_HANDLERS[number]) {
+        printf("Error: Interrupt [%i] is already attached to a device.\n", number);
+        return -1;
+    }
+    INTERRUPT_HANDLERS[number] = handler;
+    return 0;
+}
+
+int bus_map(int start, int end, MemoryHandler read, MemoryHandler write) {
+    if(BUS_MAPPING_COUNT == BUS_MAX_MAPPINGS || start < 0 || end > RAM_SIZE || start >= end) {
+        printf("Error: Could not map [%i] to [%i].\n", start, end);
+        return -1;
+    }
+    Mapping* mapping = &BUS_MAPPINGS[BUS_MAPPING_COUNT++];
+    mapping->start = start;
+    mapping->end = end;
+    mapping->read = read;
+    mapping->write = write;
+    if(start < BUS_LOWEST_MAPPING) BUS_LOWEST_MAPPING = start;
+    return 0;
+}
+
+static void bus_dispatch(int address, int size, int write) {
+    int i = 0;
+    for(; i < BUS_MAPPING_COUNT; i++) {
+        const Mapping* mapping = &BUS_MAPPINGS[i];
+        MemoryHandler handler = write ? mapping->write : mapping->read;
+        if(handler && address < mapping->end && address + size > mapping->start) handler(address, size);
+    }
+}
+
+// called before size bytes at the address are read and after they are written by the guest
+static inline void bus_read(int address, int size) {
+    if(address + size > BUS_LOWEST_MAPPING) bus_dispatch(address, size, 0);
+}
+
+static inline void bus_write(int address, int size) {
+    if(address + size > BUS_LOWEST_MAPPING) bus_dispatch(address, size, 1);
+}
+
+static _Thread_local unsigned int BUS_WAITS = 0; // interrupts in a row which returned DEVICE_WAIT
+
+// park the CPU while a device is not ready:
+// give up the host thread a few times and then sleep, doubling up to a millisecond
+void bus_wait() {
+    if(BUS_WAITS < 16) sched_yield();
+    else {
+        unsigned int shift = BUS_WAITS - 16 < 10 ? BUS_WAITS - 16 : 10;
+        struct timespec pause = { 0, 1000L << shift };
+        nanosleep(&pause, NULL);
+    }
+    BUS_WAITS ++;
+}
+
+// interrupt requests:
+// any host thread may raise a request, CPU 0 takes it before its next instruction
+
+void input_wake();
+void crash(const char* format, ...);
+
+static atomic_uint IRQ_PENDING = 0; // one bit per request line
+static atomic_int IRQ_SOURCES = 0;  // asynchronous sources which may still raise requests (keeps a halted machine alive)
+static _Thread_local int IRQ_ENABLED = 1; // cleared while a handler runs, and always on CPUs other than 0
+static int IRQ_VECTORS = -1;        // the address of the vector table, or -1 before one is set
+
+void irq_raise(int line) {
+    atomic_fetch_or(&IRQ_PENDING, 1u << line);
+    input_wake(); // the machine may be halted
+}
+
+// push EIP and FLG and jump to the handler of the lowest pending request
+// returns DEVICE_CRASH if there is no room on the stack
+int irq_enter() {
+    unsigned int pending = atomic_load(&IRQ_PENDING);
+    int line = 0;
+    while(!(pending & (1u << line))) line++;
+    atomic_fetch_and(&IRQ_PENDING, ~(1u << line));
+
+    int handler = 0;
+    if(IRQ_VECTORS >= 0) memcpy(&handler, &RAM[IRQ_VECTORS + line * sizeof(int)], sizeof(int));
+    if(handler == 0) return DEVICE_OK; // nobody is listening
+
+    if(REGISTERS[ESP].m32 + 2 * (int) sizeof(int) > RAM_SIZE) {
+        crash("Interrupt request stack overflow.\n");
+        return DEVICE_CRASH;
+    }
+    memcpy(&RAM[REGISTERS[ESP].m32], &REGISTERS[EIP].m32, sizeof(int));
+    memcpy(&RAM[REGISTERS[ESP].m32 + 4], &REGISTERS[FLG].m32, sizeof(int));
+    REGISTERS[ESP].m32 += 8;
+    REGISTERS[EIP].m32 = handler;
+    IRQ_ENABLED = 0;
+    dprintf("IRQ %i -> %i\n", line, handler);
+    return DEVICE_OK;
+}
+
+int irq_set_vectors() {
+    if(REGISTERS[ESI].m32 < 0 || REGISTERS[ESI].m32 > RAM_SIZE - IRQ_LINES * (int) sizeof(int)) {
+        crash("Invalid vector table address [%i]\n", REGISTERS[ESI].m32);
+        return DEVICE_CRASH;
+    }
+    IRQ_VECTORS = REGISTERS[ESI].m32;
+    return DEVICE_OK;
+}
+
+/*******************************************************************/
+/******************************* bus *******************************/
+/*******************************************************************/
+
+/*******************************************************************/
+/***************************** console *****************************/
+/*******************************************************************/
+
+#define CONSOLE_BUFFER_SIZE 65536
+
+static FILE* CONSOLE_OUTPUT; // where the console is written to
+static int CONSOLE_LINE_FLUSH = 0; // flush on every new line (for interactive consoles)
+static char CONSOLE_BUFFER[CONSOLE_BUFFER_SIZE];
+static unsigned int CONSOLE_LENGTH = 0;
+
+void console_flush() {
+    if(CONSOLE_LENGTH == 0) return;
+    fwrite(CONSOLE_BUFFER, 1, CONSOLE_LENGTH, CONSOLE_OUTPUT);
+    fflush(CONSOLE_OUTPUT);
+    CONSOLE_LENGTH = 0;
+}
+
+// print why the guest crashed, after the guest output buffered before it
+void crash(const char* format, ...) {
+    console_flush();
+    fputs("VM Crash: ", stdout);
+    va_list arguments;
+    va_start(arguments, format);
+    vprintf(format, arguments);
+    va_end(arguments);
+}
+
+int console_init(const char* path) {
+    if(path) {
+        CONSOLE_OUTPUT = fopen(path, "wb");
+        if(!CONSOLE_OUTPUT) {
+            printf("Error: Could not open console output [%s] for writing.\n", path);
+            return -1;
+        }
+    }
+    else {
+        CONSOLE_OUTPUT = stdout;
+        CONSOLE_LINE_FLUSH = isatty(fileno(stdout));
+    }
+    atexit(console_flush); // the machine can exit from anywhere
+    return 0;
+}
+
+void console_write(const char* data, unsigned int size) {
+    if(size > CONSOLE_BUFFER_SIZE - CONSOLE_LENGTH) {
+        console_flush();
+        if(size >= CONSOLE_BUFFER_SIZE) { // too big to buffer
+            fwrite(data, 1, size, CONSOLE_OUTPUT);
+            return;
+        }
+    }
+    memcpy(CONSOLE_BUFFER + CONSOLE_LENGTH, data, size);
+    CONSOLE_LENGTH += size;
+    if(CONSOLE_LINE_FLUSH && memchr(data, '\n', size)) console_flush();
+}
+
+static inline void console_put(char c) {
+    if(CONSOLE_LENGTH == CONSOLE_BUFFER_SIZE) console_flush();
+    CONSOLE_BUFFER[CONSOLE_LENGTH++] = c;
+    if(CONSOLE_LINE_FLUSH && c == '\n') console_flush();
+}
+
+int console_print_int() {
+    char text[16];
+    int length = snprintf(text, sizeof(text), "%i", REGISTERS[EAX].m32);
+    console_write(text, length);
+    return DEVICE_OK;
+}
+
+int console_print_char() {
+    console_put((char) REGISTERS[EAX].m32);
+    return DEVICE_OK;
+}
+
+int console_print_string() {
+    if(REGISTERS[ESI].m32 < 0 || REGISTERS[ESI].m32 >= RAM_SIZE || REGISTERS[EAX].m32 < 0 || REGISTERS[EAX].m32 > RAM_SIZE - REGISTERS[ESI].m32) {
+        crash("Invalid print string registers: ESI=[%i] EAX=[%i]\n", REGISTERS[ESI].m32, REGISTERS[EAX].m32);
+        return DEVICE_CRASH;
+    }
+    if(REGISTERS[EAX].m32 > 0) { // EAX bytes long
+        console_write((char*) &RAM[REGISTERS[ESI].m32], REGISTERS[EAX].m32);
+    }
+    else { // null terminated
+        unsigned char* end = memchr(&RAM[REGISTERS[ESI].m32], 0, RAM_SIZE - REGISTERS[ESI].m32);
+        if(!end) end = &RAM[RAM_SIZE];
+        console_write((char*) &RAM[REGISTERS[ESI].m32], end - &RAM[REGISTERS[ESI].m32]);
+    }
+    return DEVICE_OK;
+}
+
+int console_attach() {
+    if(bus_interrupt(PRINT_INT, console_print_int) != 0) return -1;
+    if(bus_interrupt(PRINT_CHAR, console_print_char) != 0) return -1;
+    if(bus_interrupt(PRINT_STRING, console_print_string) != 0) return -1;
+    return 0;
+}
+
+/*******************************************************************/
+/***************************** console *****************************/
+/*******************************************************************/
+
+/*******************************************************************/
+/****************************** input ******************************/
+/*******************************************************************/
+
+#define INPUT_RING_SIZE 4096 // must be a power of 2
+
+// a single producer single consumer lock-free byte queue
+typedef struct Ring
+{
+    unsigned char* data;
+    unsigned int size; // must be a power of 2
+    atomic_uint head; // the next byte to write, only moved by the producer
+    atomic_uint tail; // the next byte to read, only moved by the consumer
+}Ring;
+
+static unsigned char INPUT_STDIN_DATA[INPUT_RING_SIZE];
+static unsigned char INPUT_KEYBOARD_DATA[INPUT_RING_SIZE];
+static Ring INPUT_STDIN = { INPUT_STDIN_DATA, INPUT_RING_SIZE };       // filled by the stdin thread
+static Ring INPUT_KEYBOARD = { INPUT_KEYBOARD_DATA, INPUT_RING_SIZE }; // filled by POLL from the window's key events
+static atomic_int INPUT_EOF = 0; // set once stdin has been closed
+static atomic_int INPUT_HALTED = 0; // set while CPU 0 is halted, so only then does anything have to wake it
+#ifdef SOFTWARE_GPU
+static pthread_mutex_t INPUT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t INPUT_SIGNAL = PTHREAD_COND_INITIALIZER; // signalled to wake the machine when it is halted
+#else
+static Uint32 INPUT_WAKE_EVENT; // pushed to wake the machine when it is halted
+#endif
+
+void input_wake();
+
+// the number of bytes waiting to be popped
+static inline unsigned int ring_used(Ring* ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire) - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+// push up to size bytes, returns the number of bytes pushed
+unsigned int ring_push(Ring* ring, const void* data, unsigned int size) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    unsigned int space = ring->size - (head - tail);
+    if(size > space) size = space;
+
+    unsigned int start = head & (ring->size - 1);
+    unsigned int first = ring->size - start;
+    if(first > size) first = size;
+    memcpy(ring->data + start, data, first);
+    memcpy(ring->data, (const unsigned char*) data + first, size - first);
+
+    atomic_store_explicit(&ring->head, head + size, memory_order_release);
+    return size;
+}
+
+// pop up to size bytes, returns the number of bytes popped
+unsigned int ring_pop(Ring* ring, void* data, unsigned int size) {
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if(size > head - tail) size = head - tail;
+
+    unsigned int start = tail & (ring->size - 1);
+    unsigned int first = ring->size - start;
+    if(first > size) first = size;
+    memcpy(data, ring->data + start, first);
+    memcpy((unsigned char*) data + first, ring->data, size - first);
+
+    atomic_store_explicit(&ring->tail, tail + size, memory_order_release);
+    return size;
+}
+
+// reads stdin into the input ring so the machine never blocks on it
+void* input_thread(void* argument) {
+    unsigned char buffer[256];
+    while(1) {
+        ssize_t size = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if(size <= 0) break;
+
+        unsigned int pushed = 0;
+        while(pushed < size) {
+            pushed += ring_push(&INPUT_STDIN, buffer + pushed, size - pushed);
+            input_wake();
+            if(pushed < size) usleep(1000); // wait for the guest to make room
+        }
+    }
+    atomic_store(&INPUT_EOF, 1);
+    input_wake();
+    return NULL;
+}
+
+int input_init() {
+#ifndef SOFTWARE_GPU
+    INPUT_WAKE_EVENT = SDL_RegisterEvents(1);
+#endif
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, input_thread, NULL) != 0) {
+        puts("Error: Could not create the input thread.");
+        return -1;
+    }
+    pthread_detach(thread); // the thread may be blocked reading when the machine exits
+    return 0;
+}
+
+// returns 1 if there is input the guest has not read yet
+int input_pending() {
+    return ring_used(&INPUT_KEYBOARD) != 0 || ring_used(&INPUT_STDIN) != 0;
+}
+
+#ifdef SOFTWARE_GPU
+
+// wake the machine if it is halted
+// the caller makes its input or request visible first, input_halt sets INPUT_HALTED before it looks for them
+void input_wake() {
+    if(!atomic_load(&INPUT_HALTED)) return;
+    pthread_mutex_lock(&INPUT_LOCK);
+    pthread_cond_broadcast(&INPUT_SIGNAL);
+    pthread_mutex_unlock(&INPUT_LOCK);
+}
+
+// there is no window so stdin is the only source of events
+int input_poll() { return 0; }
+
+// block the host until there is input for the machine
+// returns 1 if the machine should stop
+int input_halt() {
+    pthread_mutex_lock(&INPUT_LOCK);
+    atomic_store(&INPUT_HALTED, 1);
+    while(!input_pending() && !atomic_load(&IRQ_PENDING) && atomic_load(&MACHINE_RUNNING) && !(atomic_load(&INPUT_EOF) && !atomic_load(&IRQ_SOURCES))) {
+        pthread_cond_wait(&INPUT_SIGNAL, &INPUT_LOCK);
+    }
+    // once stdin is closed and no timer is running nothing can wake the machine again
+    int stop = !input_pending() && !atomic_load(&IRQ_PENDING);
+    atomic_store(&INPUT_HALTED, 0);
+    pthread_mutex_unlock(&INPUT_LOCK);
+    return stop;
+}
+
+#else
+
+// handle a window event, returns 1 if the machine should stop
+int input_event(SDL_Event* event) {
+    switch(event->type) {
+        case SDL_QUIT:
+            return 1;
+        case SDL_TEXTINPUT:
+            ring_push(&INPUT_KEYBOARD, (unsigned char*) event->text.text, strlen(event->text.text));
+            break;
+        case SDL_KEYDOWN: // keys which do not produce text input
+            if(event->key.keysym.sym == SDLK_RETURN) ring_push(&INPUT_KEYBOARD, (unsigned char*) "\n", 1);
+            else if(event->key.keysym.sym == SDLK_BACKSPACE) ring_push(&INPUT_KEYBOARD, (unsigned char*) "\b", 1);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+// wake the machine if it is halted
+// SDL_PushEvent is thread safe so this can be used from any host thread,
+// the caller makes its input or request visible first, input_halt sets INPUT_HALTED before it looks for them
+void input_wake() {
+    if(!atomic_exchange(&INPUT_HALTED, 0)) return; // running, or another thread has already woken it
+    SDL_Event event;
+    memset(&event, 0, sizeof(SDL_Event));
+    event.type = INPUT_WAKE_EVENT;
+    SDL_PushEvent(&event);
+}
+
+// handle the window's events, returns 1 if the machine should stop
+int input_poll() {
+    SDL_Event event;
+    while(SDL_PollEvent(&event)) {
+        if(input_event(&event) != 0) return 1;
+    }
+    return 0;
+}
+
+// block the host until there is input or an event for the machine
+// returns 1 if the machine should stop
+int input_halt() {
+    SDL_Event event;
+    atomic_store(&INPUT_HALTED, 1);
+    if(input_pending() || atomic_load(&IRQ_PENDING)) {
+        atomic_store(&INPUT_HALTED, 0);
+        return 0;
+    }
+    int result = SDL_WaitEvent(&event);
+    atomic_store(&INPUT_HALTED, 0);
+    if(result == 0) return 0;
+    if(input_event(&event) != 0) return 1;
+    // handle anything else which arrived at the same time
+    return input_poll();
+}
+
+#endif
+
+// HLT on the CPUs other than 0, which do not take interrupt requests or window events
+// returns 1 if the CPU should stop
+int input_halt_secondary() {
+    struct timespec pause = { 0, 1000000 };
+    while(!input_pending() && atomic_load(&MACHINE_RUNNING)) {
+        if(atomic_load(&INPUT_EOF)) return 1; // nothing can wake the CPU
+        nanosleep(&pause, NULL);
+    }
+    return 0;
+}
+
+// copy up to size bytes of input to the destination
+// returns the number of bytes copied, or -1 if there is no input left and stdin was closed
+int input_read(unsigned char* destination, unsigned int size) {
+    unsigned int count = ring_pop(&INPUT_KEYBOARD, destination, size);
+    count += ring_pop(&INPUT_STDIN, destination + count, size - count);
+    if(count == 0 && atomic_load(&INPUT_EOF) && ring_used(&INPUT_STDIN) == 0) return -1;
+    return count;
+}
+
+int input_read_interrupt() {
+    if(REGISTERS[EDI].m32 < 0 || REGISTERS[EDI].m32 >= RAM_SIZE || REGISTERS[EAX].m32 < 0 || REGISTERS[EAX].m32 > RAM_SIZE - REGISTERS[EDI].m32) {
+        crash("Invalid read input registers: EDI=[%i] EAX=[%i]\n", REGISTERS[EDI].m32, REGISTERS[EAX].m32);
+        return DEVICE_CRASH;
+    }
+    REGISTERS[EAX].m32 = input_read(&RAM[REGISTERS[EDI].m32], REGISTERS[EAX].m32);
+    if(REGISTERS[EAX].m32 > 0) bus_write(REGISTERS[EDI].m32, REGISTERS[EAX].m32);
+    return DEVICE_OK;
+}
+
+// check if any events were made
+int input_poll_interrupt() {
+    return input_poll() != 0 ? DEVICE_HALT : DEVICE_OK;
+}
+
+int input_attach() {
+    if(bus_interrupt(READ_INPUT, input_read_interrupt) != 0) return -1;
+    if(bus_interrupt(POLL, input_poll_interrupt) != 0) return -1;
+    return 0;
+}
+
+/*******************************************************************/
+/****************************** input ******************************/
+/*******************************************************************/
+
 /*******************************************************************/
 /******************************* gpu *******************************/
 /*******************************************************************/
 
-#define GPU_MAX_VBO_SIZE 256
+void text_render(const unsigned char* ram);
 
-GLuint GPU_DEFAULT_SHADER;
-GLint GPU_VERTEX_SOURCE;
-GLint GPU_COLOUR_SOURCE;
-GLint GPU_MATRIX_SOURCE;
-GLuint GPU_VBO, GPU_VAO;
 float GPU_RGB[3] = {0};
+unsigned int GPU_PRIMITIVE = PRIMITIVE_POINTS;
 float GPU_PROJECTION_MATRIX[16] = {
     2.0f / ((float) CONSOLE_WIDTH), 0, 0, 0,
     0, -2.0f / ((float) CONSOLE_HEIGHT), 0, 0,
@@ -105,259 +619,1845 @@ float GPU_PROJECTION_MATRIX[16] = {
     -1, 1, 0, 1
 };
 
-void gpu_error_check() {
-    int error = 0;
-    switch(error) {
-        case 0: break;
-        default:
-            printf("GPU GL Error: %i\n", error);
-            break;
+// The backend runs on its own render thread:
+// the machine pushes DRAW, SET_COLOR, BLIT and REDRAW commands onto a lock-free command ring (copying the vertices and pixels in)
+// and carries on executing while the render thread draws them.
+// On the render thread the draws are queued up and submitted to the backend once per REDRAW,
+// consecutive draws with the same colour and primitive are merged into a single batch.
+typedef struct GPUBatch
+{
+    float rgb[3];       // the colour of the batch
+    unsigned int primitive; // the PRIMITIVE_* mode of the batch
+    unsigned int first; // the first vertex of the batch
+    unsigned int count; // the number of vertices in the batch
+}GPUBatch;
+
+#define GPU_QUEUE_INITIAL_SIZE 1024 // vertices
+
+float* GPU_VERTICES = NULL; // 2 floats per vertex
+unsigned int GPU_VERTEX_COUNT = 0;
+unsigned int GPU_VERTEX_CAPACITY = 0;
+GPUBatch* GPU_BATCHES = NULL;
+unsigned int GPU_BATCH_COUNT = 0;
+unsigned int GPU_BATCH_CAPACITY = 0;
+
+// render thread commands:
+#define GPU_COMMAND_DRAW    0 // followed by the vertices
+#define GPU_COMMAND_COLOUR  1 // followed by 3 floats
+#define GPU_COMMAND_PRESENT 2
+#define GPU_COMMAND_QUIT    3
+#define GPU_COMMAND_PRIMITIVE 4 // followed by the PRIMITIVE_* mode
+#define GPU_COMMAND_LAYER   5 // followed by a GPULayerCommand and its pixels
+
+typedef struct GPUCommand
+{
+    unsigned int type; // one of the GPU_COMMAND_* types
+    unsigned int size; // the size of the data following the command in bytes
+}GPUCommand;
+
+#define GPU_RING_SIZE 1048576 // must be a power of 2
+// the most vertices sent in one draw command, larger draws are split up
+#define GPU_RING_MAX_VERTICES ((GPU_RING_SIZE / 2) / (2 * sizeof(float)))
+
+static unsigned char GPU_RING_DATA[GPU_RING_SIZE];
+static Ring GPU_RING = { GPU_RING_DATA, GPU_RING_SIZE };
+// the ring is lock-free, these are only used to put a thread to sleep when it has nothing to do
+static pthread_mutex_t GPU_RING_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t GPU_RING_SIGNAL = PTHREAD_COND_INITIALIZER;
+static atomic_int GPU_PRODUCER_WAITING = 0;
+static atomic_int GPU_CONSUMER_WAITING = 0;
+static pthread_t GPU_THREAD;
+
+// statistics
+unsigned int GPU_DRAWS_ISSUED = 0;    // DRAW interrupts
+unsigned int GPU_DRAWS_SUBMITTED = 0; // batches drawn by the backend
+unsigned int GPU_FRAMES = 0;
+unsigned int GPU_RING_PEAK = 0;         // the most bytes waiting in the ring
+unsigned long long GPU_RING_TOTAL = 0;  // the sum of the bytes waiting at each command
+unsigned int GPU_RING_COMMANDS = 0;
+unsigned int GPU_RING_STALLS = 0;       // times the machine had to wait for room in the ring
+unsigned int GPU_BLITS = 0;
+unsigned long long GPU_LAYER_PIXELS = 0; // pixels written to the bitmap layer
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+// The bitmap layer:
+// BLIT and the text grid convert their pixels on the machine thread and send them down the command ring as LAYER
+// commands, so they reach the layer in order with the draws and REDRAWs around them. The layer belongs to the render
+// thread, which writes the commands into this RGBA image and marks the rectangles they changed.
+// Every frame the whole layer is drawn under the frame's draws. Pixels with an alpha of 0 are transparent.
+#define GPU_DIRTY_RECTS 16
+
+typedef struct GPURect
+{
+    int left, top, right, bottom; // [left, right) x [top, bottom)
+}GPURect;
+
+// a LAYER command is followed by the rectangle's pixels, row by row
+typedef struct GPULayerCommand
+{
+    GPURect rect;
+    unsigned int replace; // 1 to copy every pixel, 0 to keep the layer under transparent pixels
+}GPULayerCommand;
+
+// the most pixels sent in one LAYER command, larger rectangles are split into bands of rows
+#define GPU_LAYER_COMMAND_PIXELS ((GPU_RING_SIZE / 2 - sizeof(GPULayerCommand)) / sizeof(unsigned int))
+
+unsigned int* GPU_LAYER = NULL; // CONSOLE_WIDTH x CONSOLE_HEIGHT pixels, allocated by the first LAYER command
+GPURect GPU_DIRTY[GPU_DIRTY_RECTS];
+unsigned int GPU_DIRTY_COUNT = 0;
+
+// the machine's side of the layer: a LAYER command being filled in
+static unsigned int GPU_LAYER_STAGING[(GPU_RING_SIZE / 2) / sizeof(unsigned int)];
+static unsigned int* const GPU_LAYER_STAGING_PIXELS = GPU_LAYER_STAGING + sizeof(GPULayerCommand) / sizeof(unsigned int);
+
+static void gpu_command(unsigned int type, const void* data, unsigned int size);
+
+// mark a rectangle of the layer as changed
+// overlapping rectangles are merged, and once the list is full everything is merged into one
+void gpu_layer_dirty(GPURect rect) {
+    unsigned int i = 0;
+    while(i < GPU_DIRTY_COUNT) {
+        GPURect* other = &GPU_DIRTY[i];
+        if(rect.left <= other->right && other->left <= rect.right && rect.top <= other->bottom && other->top <= rect.bottom) {
+            if(other->left < rect.left) rect.left = other->left;
+            if(other->top < rect.top) rect.top = other->top;
+            if(other->right > rect.right) rect.right = other->right;
+            if(other->bottom > rect.bottom) rect.bottom = other->bottom;
+            // the grown rectangle may now touch rectangles already checked
+            GPU_DIRTY[i] = GPU_DIRTY[--GPU_DIRTY_COUNT];
+            i = 0;
+            continue;
+        }
+        i++;
     }
+    if(GPU_DIRTY_COUNT == GPU_DIRTY_RECTS) {
+        for(i = 0; i < GPU_DIRTY_COUNT; i++) {
+            if(GPU_DIRTY[i].left < rect.left) rect.left = GPU_DIRTY[i].left;
+            if(GPU_DIRTY[i].top < rect.top) rect.top = GPU_DIRTY[i].top;
+            if(GPU_DIRTY[i].right > rect.right) rect.right = GPU_DIRTY[i].right;
+            if(GPU_DIRTY[i].bottom > rect.bottom) rect.bottom = GPU_DIRTY[i].bottom;
+        }
+        GPU_DIRTY_COUNT = 0;
+    }
+    GPU_DIRTY[GPU_DIRTY_COUNT++] = rect;
 }
 
-void gpu_init_shaders() {
-    GLuint shaders[2];
-    shaders[0] = glCreateShader(GL_VERTEX_SHADER);
-    shaders[1] = glCreateShader(GL_FRAGMENT_SHADER);
-    static const char* VERTEX_SHADER_SOURCE[] = {
-        "#version 330\n",
-        "in vec2 vertex;\n",
-        "uniform mat4 matrix;\n"
-        "void main() {\n",
-        "   gl_PointSize = 10.0f;\n"
-        "   gl_Position = matrix * vec4(vertex.x, vertex.y, 0, 1);\n",
-        "}\n"
-    };
-    static const char* FRAGMENT_SHADER_SOURCE[] = {
-        "#version 330\n",
-        "uniform vec3 colour;\n",
-        "out vec4 c_out;\n"
-        "void main() {\n",
-        "   c_out = vec4(colour, 1);\n",
-        "}\n"
-    };
-    glShaderSource(shaders[0], sizeof(VERTEX_SHADER_SOURCE) / sizeof(char*), VERTEX_SHADER_SOURCE, NULL);
-    glShaderSource(shaders[1], sizeof(FRAGMENT_SHADER_SOURCE) / sizeof(char*), FRAGMENT_SHADER_SOURCE, NULL);
-    glCompileShader(shaders[0]);
-    glCompileShader(shaders[1]);
-    unsigned int i = 0;
-    for(; i < 2; i++) {
-        GLint status = 0;
-        glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &status);
-        if(status == GL_FALSE) {
-            int length = 0;
-            glGetShaderiv(shaders[i], GL_INFO_LOG_LENGTH, &length);
-            char* error = (char*) malloc(length);
-            if(!error){ puts("Memory allocation failure."); exit(-1); }
-            glGetShaderInfoLog(shaders[i], length, &length, error);
-            printf("Error: GPU %s shader error:\n%s\n", i == 0 ? "vertex" : "fragment", error);
-            free(error);
-            exit(-1);
+// allocate the layer if nothing has used it yet
+void gpu_layer_open() {
+    if(GPU_LAYER) return;
+    GPU_LAYER = (unsigned int*) calloc(CONSOLE_WIDTH * CONSOLE_HEIGHT, sizeof(unsigned int));
+    if(!GPU_LAYER) { puts("Memory allocation failure."); exit(-1); }
+}
+
+// copy count pixels, skipping the transparent source pixels
+static inline void gpu_copy_span(unsigned int* destination, const unsigned int* source, int count) {
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+    __m128i zero = _mm_setzero_si128();
+    for(; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*) (source + i));
+        __m128i d = _mm_loadu_si128((const __m128i*) (destination + i));
+        __m128i transparent = _mm_cmpeq_epi32(_mm_and_si128(s, alpha), zero);
+        _mm_storeu_si128((__m128i*) (destination + i), _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, s)));
+    }
+#elif defined(__ARM_NEON)
+    uint32x4_t alpha = vdupq_n_u32(0xFF000000);
+    for(; i + 4 <= count; i += 4) {
+        uint32x4_t s = vld1q_u32(source + i);
+        uint32x4_t opaque = vtstq_u32(s, alpha);
+        vst1q_u32(destination + i, vbslq_u32(opaque, s, vld1q_u32(destination + i)));
+    }
+#endif
+    for(; i < count; i++) if(source[i] & 0xFF000000) destination[i] = source[i];
+}
+
+// convert count pixels of an RGBX row into opaque layer pixels
+// pixels matching the key (when keyed) are made transparent
+static inline void gpu_convert_span(unsigned int* destination, const unsigned char* source, int count, int keyed, unsigned int key) {
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+    __m128i rgb = _mm_set1_epi32(0x00FFFFFF);
+    __m128i k = _mm_set1_epi32((int) key);
+    for(; i + 4 <= count; i += 4) {
+        __m128i s = _mm_and_si128(_mm_loadu_si128((const __m128i*) (source + i * 4)), rgb);
+        __m128i p = _mm_or_si128(s, alpha);
+        if(keyed) p = _mm_andnot_si128(_mm_cmpeq_epi32(s, k), p);
+        _mm_storeu_si128((__m128i*) (destination + i), p);
+    }
+#elif defined(__ARM_NEON)
+    uint32x4_t alpha = vdupq_n_u32(0xFF000000);
+    uint32x4_t rgb = vdupq_n_u32(0x00FFFFFF);
+    uint32x4_t k = vdupq_n_u32(key);
+    for(; i + 4 <= count; i += 4) {
+        uint32x4_t s = vandq_u32(vld1q_u32((const uint32_t*) (source + i * 4)), rgb);
+        uint32x4_t p = vorrq_u32(s, alpha);
+        if(keyed) p = vbicq_u32(p, vceqq_u32(s, k));
+        vst1q_u32(destination + i, p);
+    }
+#endif
+    for(; i < count; i++) {
+        unsigned int s = (source[i * 4] | (source[i * 4 + 1] << 8) | (source[i * 4 + 2] << 16));
+        destination[i] = keyed && s == key ? 0 : s | 0xFF000000;
+    }
+}
+
+// send the band of rows staged in GPU_LAYER_STAGING_PIXELS to the render thread
+void gpu_layer_send(GPURect rect, unsigned int replace) {
+    GPULayerCommand command = { rect, replace };
+    memcpy(GPU_LAYER_STAGING, &command, sizeof(command));
+    gpu_command(GPU_COMMAND_LAYER, GPU_LAYER_STAGING, sizeof(command) + (rect.right - rect.left) * (rect.bottom - rect.top) * sizeof(unsigned int));
+}
+
+// copy a bitmap described by the descriptor in RAM onto the layer
+// returns -1 if the descriptor is invalid
+int gpu_blit(const unsigned char* ram, int ram_size, int address) {
+    if(address < 0 || address + BLIT_DESCRIPTOR_SIZE > ram_size) return -1;
+    int source, palette;
+    unsigned short width, height;
+    short x, y;
+    unsigned int key;
+    memcpy(&source, ram + address, 4);
+    memcpy(&palette, ram + address + 4, 4);
+    memcpy(&width, ram + address + 8, 2);
+    memcpy(&height, ram + address + 10, 2);
+    memcpy(&x, ram + address + 12, 2);
+    memcpy(&y, ram + address + 14, 2);
+    int format = ram[address + 16];
+    int scale = ram[address + 17] == 0 ? 1 : ram[address + 17];
+    int keyed = ram[address + 18] & BLIT_COLOUR_KEY;
+    memcpy(&key, ram + address + 20, 4);
+
+    int bytes = format / 8;
+    if(format != 8 && format != 24 && format != 32) return -1;
+    if(source < 0 || (long) source + (long) width * height * bytes > ram_size) return -1;
+    if(format == 8 && (palette < 0 || palette + 256 * 3 > ram_size)) return -1;
+    GPU_BLITS ++;
+
+    // clip the scaled bitmap to the screen
+    GPURect rect = { x, y, x + width * scale, y + height * scale };
+    if(rect.left < 0) rect.left = 0;
+    if(rect.top < 0) rect.top = 0;
+    if(rect.right > CONSOLE_WIDTH) rect.right = CONSOLE_WIDTH;
+    if(rect.bottom > CONSOLE_HEIGHT) rect.bottom = CONSOLE_HEIGHT;
+    if(rect.left >= rect.right || rect.top >= rect.bottom) return 0;
+
+    // only the source columns which land on the screen are converted
+    int first = (rect.left - x) / scale;
+    int last = (rect.right - 1 - x) / scale + 1;
+    unsigned int converted[CONSOLE_WIDTH];
+    unsigned int colours[256];
+    int i;
+    if(format == 8) {
+        const unsigned char* p = ram + palette;
+        for(i = 0; i < 256; i++) colours[i] = p[i * 3] | (p[i * 3 + 1] << 8) | (p[i * 3 + 2] << 16) | 0xFF000000;
+        if(keyed) colours[key & 0xFF] = 0;
+    }
+
+    // the rows are converted into the staging buffer and sent in bands which fit in the ring
+    int columns = rect.right - rect.left;
+    int band = GPU_LAYER_COMMAND_PIXELS / columns;
+    GPURect part = rect;
+    int row, source_row = -1;
+    for(row = rect.top; row < rect.bottom; row++) {
+        unsigned int* destination = GPU_LAYER_STAGING_PIXELS + (row - part.top) * columns;
+        if((row - y) / scale != source_row) {
+            source_row = (row - y) / scale;
+            const unsigned char* s = ram + source + ((long) source_row * width + first) * bytes;
+            unsigned int* d = scale > 1 ? converted : destination; // unscaled rows are converted in place
+            int count = last - first;
+            switch(format) {
+                case 8:
+                    for(i = 0; i < count; i++) d[i] = colours[s[i]];
+                    break;
+                case 24:
+                    for(i = 0; i < count; i++) {
+                        unsigned int c = s[i * 3] | (s[i * 3 + 1] << 8) | (s[i * 3 + 2] << 16);
+                        d[i] = keyed && c == key ? 0 : c | 0xFF000000;
+                    }
+                    break;
+                case 32:
+                    gpu_convert_span(d, s, count, keyed, key);
+                    break;
+            }
+        }
+        if(scale > 1) {
+            for(i = rect.left; i < rect.right; i++) destination[i - rect.left] = converted[(i - x) / scale - first];
         }
+        if(row + 1 == rect.bottom || row + 1 - part.top == band) {
+            part.bottom = row + 1;
+            gpu_layer_send(part, 0);
+            part.top = row + 1;
+        }
+    }
+    return 0;
+}
+
+void gpu_layer_free() {
+    if(GPU_LAYER) free(GPU_LAYER);
+}
+
+#ifdef SOFTWARE_GPU
+
+// software rasterizer
+// draws with the same semantics as the shaders below into an in-memory framebuffer
+
+#define GPU_POINT_SIZE 10
+
+// The frame is rasterized in tiles:
+// every primitive is first binned into the tiles its bounding box touches,
+// then a pool of worker threads rasterize whole tiles in parallel, each tile drawing its primitives in order.
+#define GPU_TILE_SIZE 64
+#define GPU_TILES_X ((CONSOLE_WIDTH + GPU_TILE_SIZE - 1) / GPU_TILE_SIZE)
+#define GPU_TILES_Y ((CONSOLE_HEIGHT + GPU_TILE_SIZE - 1) / GPU_TILE_SIZE)
+#define GPU_MAX_WORKERS 16
+// frames with fewer binned primitives than this are rasterized on the render thread alone
+#define GPU_PARALLEL_THRESHOLD 64
+
+// one primitive binned into a tile
+typedef struct GPUTileItem
+{
+    unsigned int vertex;    // the first (projected) vertex of the primitive
+    unsigned int primitive; // PRIMITIVE_POINTS, PRIMITIVE_LINES (for lines and line strips) or PRIMITIVE_TRIANGLES
+    unsigned int colour;
+}GPUTileItem;
+
+typedef struct GPUTile
+{
+    GPUTileItem* items;
+    unsigned int count;
+    unsigned int capacity;
+}GPUTile;
+
+unsigned int* GPU_FRAMEBUFFER; // CONSOLE_WIDTH x CONSOLE_HEIGHT RGBA pixels, row 0 is the top of the screen
+const char* GPU_DUMP_PATH = NULL; // if set, the framebuffer is written here as a PPM image on every redraw
+
+GPUTile GPU_TILES[GPU_TILES_X * GPU_TILES_Y];
+float* GPU_SCREEN_VERTICES = NULL; // the queued vertices projected into framebuffer coordinates
+unsigned int GPU_SCREEN_CAPACITY = 0;
+
+// the worker pool
+pthread_t GPU_WORKERS[GPU_MAX_WORKERS];
+int GPU_WORKER_COUNT = 0;
+pthread_mutex_t GPU_WORK_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t GPU_WORK_START = PTHREAD_COND_INITIALIZER;
+pthread_cond_t GPU_WORK_DONE = PTHREAD_COND_INITIALIZER;
+unsigned int GPU_WORK_GENERATION = 0; // bumped to start the workers on a frame
+int GPU_WORK_BUSY = 0;                // workers still rasterizing the frame
+int GPU_WORK_QUIT = 0;
+atomic_uint GPU_NEXT_TILE;            // the next tile to be claimed by a worker
+
+// pack a colour into a framebuffer pixel (R, G, B, A in memory order)
+static inline unsigned int gpu_pixel(const float* rgb) {
+    unsigned int r = (unsigned int) (rgb[0] * 255.0f + 0.5f);
+    unsigned int g = (unsigned int) (rgb[1] * 255.0f + 0.5f);
+    unsigned int b = (unsigned int) (rgb[2] * 255.0f + 0.5f);
+    return r | (g << 8) | (b << 16) | 0xFF000000;
+}
+
+// fill count pixels of a row with the colour
+static inline void gpu_fill_span(unsigned int* row, int count, unsigned int colour) {
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i c = _mm_set1_epi32((int) colour);
+    for(; i + 4 <= count; i += 4) _mm_storeu_si128((__m128i*) (row + i), c);
+#elif defined(__ARM_NEON)
+    uint32x4_t c = vdupq_n_u32(colour);
+    for(; i + 4 <= count; i += 4) vst1q_u32(row + i, c);
+#endif
+    for(; i < count; i++) row[i] = colour;
+}
+
+// project a vertex through the projection matrix into framebuffer coordinates
+static inline void gpu_project(const float* vertex, float* x, float* y) {
+    const float* m = GPU_PROJECTION_MATRIX; // column major
+    float w = m[3] * vertex[0] + m[7] * vertex[1] + m[15];
+    float nx = (m[0] * vertex[0] + m[4] * vertex[1] + m[12]) / w;
+    float ny = (m[1] * vertex[0] + m[5] * vertex[1] + m[13]) / w;
+    *x = (nx + 1.0f) * 0.5f * CONSOLE_WIDTH;
+    *y = (1.0f - ny) * 0.5f * CONSOLE_HEIGHT;
+}
+
+// the pixel bounds of a tile, the tile's primitives are clipped to these
+typedef struct GPUClip
+{
+    int left, top, right, bottom; // [left, right) x [top, bottom)
+}GPUClip;
+
+// clamp a float before converting it to a pixel index so huge values do not overflow
+static inline int gpu_clamp(float value, int low, int high) {
+    if(value < low) return low;
+    if(value > high) return high;
+    return (int) value;
+}
+
+// fill the pixels whose centers are inside the rectangle [x0, x1) x [y0, y1)
+static void gpu_fill_rect(float x0, float y0, float x1, float y1, unsigned int colour, const GPUClip* clip) {
+    int left = (int) ceilf(x0 - 0.5f), right = (int) ceilf(x1 - 0.5f);
+    int top = (int) ceilf(y0 - 0.5f), bottom = (int) ceilf(y1 - 0.5f);
+    if(left < clip->left) left = clip->left;
+    if(top < clip->top) top = clip->top;
+    if(right > clip->right) right = clip->right;
+    if(bottom > clip->bottom) bottom = clip->bottom;
+    for(; top < bottom; top++) {
+        if(left < right) gpu_fill_span(GPU_FRAMEBUFFER + top * CONSOLE_WIDTH + left, right - left, colour);
+    }
+}
+
+// draw a 1 pixel wide line, stepping along the major axis one pixel center at a time
+// only the steps inside the clip are visited so every tile draws exactly its share of the line
+static void gpu_draw_line(const float* a, const float* b, unsigned int colour, const GPUClip* clip) {
+    float dx = b[0] - a[0], dy = b[1] - a[1];
+    int i, end;
+    if(fabsf(dx) >= fabsf(dy)) {
+        if(dx == 0) return;
+        if(dx < 0) { const float* t = a; a = b; b = t; dx = -dx; dy = -dy; }
+        float slope = dy / dx;
+        i = gpu_clamp(ceilf(a[0] - 0.5f), clip->left, clip->right);
+        end = gpu_clamp(ceilf(b[0] - 0.5f), clip->left, clip->right);
+        for(; i < end; i++) {
+            int y = (int) floorf(a[1] + (i + 0.5f - a[0]) * slope);
+            if(y >= clip->top && y < clip->bottom) GPU_FRAMEBUFFER[y * CONSOLE_WIDTH + i] = colour;
+        }
+    }
+    else {
+        if(dy < 0) { const float* t = a; a = b; b = t; dx = -dx; dy = -dy; }
+        float slope = dx / dy;
+        i = gpu_clamp(ceilf(a[1] - 0.5f), clip->top, clip->bottom);
+        end = gpu_clamp(ceilf(b[1] - 0.5f), clip->top, clip->bottom);
+        for(; i < end; i++) {
+            int x = (int) floorf(a[0] + (i + 0.5f - a[1]) * slope);
+            if(x >= clip->left && x < clip->right) GPU_FRAMEBUFFER[i * CONSOLE_WIDTH + x] = colour;
+        }
+    }
+}
+
+// fill the pixels whose centers are inside the triangle
+// each row is clipped against the 3 edge functions to find the covered span, which is then filled in one go
+// pixels exactly on an edge are owned by only one of the two triangles sharing it
+static void gpu_fill_triangle(const float* v0, const float* v1, const float* v2, unsigned int colour, const GPUClip* clip) {
+    float area = (v1[0] - v0[0]) * (v2[1] - v0[1]) - (v1[1] - v0[1]) * (v2[0] - v0[0]);
+    if(area == 0) return;
+    if(area < 0) { const float* t = v1; v1 = v2; v2 = t; }
+
+    // edge i is inside where a[i] * x + b[i] * y + c[i] >= 0 (or > 0 if the edge does not own its pixels)
+    const float* v[3] = { v0, v1, v2 };
+    float a[3], b[3], c[3];
+    int owned[3], i;
+    for(i = 0; i < 3; i++) {
+        const float* p = v[i];
+        const float* q = v[(i + 1) % 3];
+        a[i] = p[1] - q[1];
+        b[i] = q[0] - p[0];
+        c[i] = -(a[i] * p[0] + b[i] * p[1]);
+        owned[i] = a[i] > 0 || (a[i] == 0 && b[i] > 0);
+    }
+
+    float top = fminf(v0[1], fminf(v1[1], v2[1])), bottom = fmaxf(v0[1], fmaxf(v1[1], v2[1]));
+    int row = gpu_clamp(ceilf(top - 0.5f), clip->top, clip->bottom);
+    int last = gpu_clamp(ceilf(bottom - 0.5f), clip->top, clip->bottom);
+    for(; row < last; row++) {
+        float y = row + 0.5f;
+        int left = clip->left, right = clip->right;
+        for(i = 0; i < 3 && left < right; i++) {
+            float t = b[i] * y + c[i];
+            if(a[i] == 0) {
+                if(t < 0 || (t == 0 && !owned[i])) left = right;
+                continue;
+            }
+            // the pixel center x + 0.5 must lie on the inside of bound
+            float bound = -t / a[i] - 0.5f;
+            if(a[i] > 0) {
+                int start = owned[i] ? gpu_clamp(ceilf(bound), clip->left, clip->right) : gpu_clamp(floorf(bound) + 1, clip->left, clip->right);
+                if(start > left) left = start;
+            }
+            else {
+                int stop = owned[i] ? gpu_clamp(floorf(bound) + 1, clip->left, clip->right) : gpu_clamp(ceilf(bound), clip->left, clip->right);
+                if(stop < right) right = stop;
+            }
+        }
+        if(left < right) gpu_fill_span(GPU_FRAMEBUFFER + row * CONSOLE_WIDTH + left, right - left, colour);
+    }
+}
+
+// draw all the primitives binned into a tile
+static void gpu_raster_tile(unsigned int index) {
+    const GPUTile* tile = &GPU_TILES[index];
+    GPUClip clip;
+    clip.left = (index % GPU_TILES_X) * GPU_TILE_SIZE;
+    clip.top = (index / GPU_TILES_X) * GPU_TILE_SIZE;
+    clip.right = clip.left + GPU_TILE_SIZE > CONSOLE_WIDTH ? CONSOLE_WIDTH : clip.left + GPU_TILE_SIZE;
+    clip.bottom = clip.top + GPU_TILE_SIZE > CONSOLE_HEIGHT ? CONSOLE_HEIGHT : clip.top + GPU_TILE_SIZE;
+
+    unsigned int i = 0;
+    for(; i < tile->count; i++) {
+        const GPUTileItem* item = &tile->items[i];
+        const float* v = GPU_SCREEN_VERTICES + item->vertex * 2;
+        switch(item->primitive) {
+            case PRIMITIVE_POINTS:
+                gpu_fill_rect(v[0] - GPU_POINT_SIZE / 2.0f, v[1] - GPU_POINT_SIZE / 2.0f, v[0] + GPU_POINT_SIZE / 2.0f, v[1] + GPU_POINT_SIZE / 2.0f, item->colour, &clip);
+                break;
+            case PRIMITIVE_LINES:
+                gpu_draw_line(v, v + 2, item->colour, &clip);
+                break;
+            case PRIMITIVE_TRIANGLES:
+                gpu_fill_triangle(v, v + 2, v + 4, item->colour, &clip);
+                break;
+        }
+    }
+}
+
+// claim and rasterize tiles until there are none left
+static void gpu_raster_tiles() {
+    unsigned int index;
+    while((index = atomic_fetch_add(&GPU_NEXT_TILE, 1)) < GPU_TILES_X * GPU_TILES_Y) {
+        if(GPU_TILES[index].count > 0) gpu_raster_tile(index);
+    }
+}
+
+void* gpu_worker(void* argument) {
+    unsigned int generation = 0;
+    pthread_mutex_lock(&GPU_WORK_LOCK);
+    while(1) {
+        while(GPU_WORK_GENERATION == generation && !GPU_WORK_QUIT) pthread_cond_wait(&GPU_WORK_START, &GPU_WORK_LOCK);
+        if(GPU_WORK_QUIT) break;
+        generation = GPU_WORK_GENERATION;
+        pthread_mutex_unlock(&GPU_WORK_LOCK);
+
+        gpu_raster_tiles();
+
+        pthread_mutex_lock(&GPU_WORK_LOCK);
+        if(--GPU_WORK_BUSY == 0) pthread_cond_signal(&GPU_WORK_DONE);
+    }
+    pthread_mutex_unlock(&GPU_WORK_LOCK);
+    return NULL;
+}
+
+// add a primitive to every tile its bounding box touches
+static void gpu_bin(unsigned int vertex, unsigned int primitive, unsigned int colour, float x0, float y0, float x1, float y1) {
+    if(x1 < 0 || y1 < 0 || x0 >= CONSOLE_WIDTH || y0 >= CONSOLE_HEIGHT) return;
+    int tx0 = gpu_clamp(x0, 0, CONSOLE_WIDTH - 1) / GPU_TILE_SIZE, tx1 = gpu_clamp(x1, 0, CONSOLE_WIDTH - 1) / GPU_TILE_SIZE;
+    int ty0 = gpu_clamp(y0, 0, CONSOLE_HEIGHT - 1) / GPU_TILE_SIZE, ty1 = gpu_clamp(y1, 0, CONSOLE_HEIGHT - 1) / GPU_TILE_SIZE;
+    int x, y;
+    for(y = ty0; y <= ty1; y++) {
+        for(x = tx0; x <= tx1; x++) {
+            GPUTile* tile = &GPU_TILES[y * GPU_TILES_X + x];
+            if(tile->count >= tile->capacity) {
+                tile->capacity = tile->capacity == 0 ? 64 : tile->capacity * 2;
+                tile->items = (GPUTileItem*) realloc(tile->items, sizeof(GPUTileItem) * tile->capacity);
+                if(!tile->items) { puts("Memory expansion failure error."); exit(-1); }
+            }
+            GPUTileItem* item = &tile->items[tile->count++];
+            item->vertex = vertex;
+            item->primitive = primitive;
+            item->colour = colour;
+        }
+    }
+}
+
+int gpu_open() {
+    GPU_FRAMEBUFFER = (unsigned int*) malloc(sizeof(unsigned int) * CONSOLE_WIDTH * CONSOLE_HEIGHT);
+    if(!GPU_FRAMEBUFFER) { puts("Memory allocation failure."); return -1; }
+    float black[3] = {0, 0, 0};
+    gpu_fill_span(GPU_FRAMEBUFFER, CONSOLE_WIDTH * CONSOLE_HEIGHT, gpu_pixel(black));
+
+    // the render thread rasterizes as well, so it gets one worker less than there are cores
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores > 1 ? (int) cores - 1 : 0;
+    if(workers > GPU_MAX_WORKERS) workers = GPU_MAX_WORKERS;
+    for(; GPU_WORKER_COUNT < workers; GPU_WORKER_COUNT++) {
+        if(pthread_create(&GPU_WORKERS[GPU_WORKER_COUNT], NULL, gpu_worker, NULL) != 0) break;
+    }
+    return 0;
+}
+
+void gpu_submit(const float* vertices, unsigned int vertex_count, const GPUBatch* batches, unsigned int batch_count) {
+    if(vertex_count > GPU_SCREEN_CAPACITY) {
+        GPU_SCREEN_CAPACITY = vertex_count;
+        GPU_SCREEN_VERTICES = (float*) realloc(GPU_SCREEN_VERTICES, sizeof(float) * 2 * GPU_SCREEN_CAPACITY);
+        if(!GPU_SCREEN_VERTICES) { puts("Memory expansion failure error."); exit(-1); }
+    }
+    unsigned int b, i, binned = 0;
+    for(i = 0; i < vertex_count; i++) gpu_project(vertices + i * 2, GPU_SCREEN_VERTICES + i * 2, GPU_SCREEN_VERTICES + i * 2 + 1);
+    for(i = 0; i < GPU_TILES_X * GPU_TILES_Y; i++) GPU_TILES[i].count = 0;
+
+    for(b = 0; b < batch_count; b++) {
+        const GPUBatch* batch = &batches[b];
+        unsigned int colour = gpu_pixel(batch->rgb);
+        unsigned int end = batch->first + batch->count;
+        const float* v;
+        switch(batch->primitive) {
+            case PRIMITIVE_POINTS:
+                for(i = batch->first; i < end; i++) {
+                    v = GPU_SCREEN_VERTICES + i * 2;
+                    gpu_bin(i, PRIMITIVE_POINTS, colour, v[0] - GPU_POINT_SIZE / 2.0f, v[1] - GPU_POINT_SIZE / 2.0f, v[0] + GPU_POINT_SIZE / 2.0f, v[1] + GPU_POINT_SIZE / 2.0f);
+                }
+                break;
+            case PRIMITIVE_LINES:
+            case PRIMITIVE_LINE_STRIP:
+                for(i = batch->first; i + 1 < end; i += batch->primitive == PRIMITIVE_LINES ? 2 : 1) {
+                    v = GPU_SCREEN_VERTICES + i * 2;
+                    gpu_bin(i, PRIMITIVE_LINES, colour, fminf(v[0], v[2]) - 1, fminf(v[1], v[3]) - 1, fmaxf(v[0], v[2]) + 1, fmaxf(v[1], v[3]) + 1);
+                }
+                break;
+            case PRIMITIVE_TRIANGLES:
+                for(i = batch->first; i + 2 < end; i += 3) {
+                    v = GPU_SCREEN_VERTICES + i * 2;
+                    gpu_bin(i, PRIMITIVE_TRIANGLES, colour, fminf(v[0], fminf(v[2], v[4])) - 1, fminf(v[1], fminf(v[3], v[5])) - 1, fmaxf(v[0], fmaxf(v[2], v[4])) + 1, fmaxf(v[1], fmaxf(v[3], v[5])) + 1);
+                }
+                break;
+        }
+    }
+    for(i = 0; i < GPU_TILES_X * GPU_TILES_Y; i++) binned += GPU_TILES[i].count;
+
+    atomic_store(&GPU_NEXT_TILE, 0);
+    if(GPU_WORKER_COUNT == 0 || binned < GPU_PARALLEL_THRESHOLD) {
+        gpu_raster_tiles();
+        return;
+    }
+    pthread_mutex_lock(&GPU_WORK_LOCK);
+    GPU_WORK_BUSY = GPU_WORKER_COUNT;
+    GPU_WORK_GENERATION ++;
+    pthread_cond_broadcast(&GPU_WORK_START);
+    pthread_mutex_unlock(&GPU_WORK_LOCK);
+
+    gpu_raster_tiles();
+
+    pthread_mutex_lock(&GPU_WORK_LOCK);
+    while(GPU_WORK_BUSY > 0) pthread_cond_wait(&GPU_WORK_DONE, &GPU_WORK_LOCK);
+    pthread_mutex_unlock(&GPU_WORK_LOCK);
+}
+
+// write the framebuffer as a binary PPM image
+int gpu_dump(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        printf("Error: Could not open [%s] for writing.\n", path);
+        return -1;
+    }
+    fprintf(file, "P6\n%i %i\n255\n", CONSOLE_WIDTH, CONSOLE_HEIGHT);
+    unsigned char row[CONSOLE_WIDTH * 3];
+    int x, y;
+    for(y = 0; y < CONSOLE_HEIGHT; y++) {
+        const unsigned char* pixels = (const unsigned char*) (GPU_FRAMEBUFFER + y * CONSOLE_WIDTH);
+        for(x = 0; x < CONSOLE_WIDTH; x++) {
+            row[x * 3 + 0] = pixels[x * 4 + 0];
+            row[x * 3 + 1] = pixels[x * 4 + 1];
+            row[x * 3 + 2] = pixels[x * 4 + 2];
+        }
+        fwrite(row, 1, sizeof(row), file);
+    }
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+GPURect GPU_LAYER_BOUNDS = { 0, 0, 0, 0 }; // every pixel the layer has ever been written to
+
+// draw the bitmap layer under the frame, as the OpenGL backend draws its layer texture over the whole window:
+// the layer is copied over every pixel it covers, leaving the framebuffer under its transparent pixels
+void gpu_update_layer() {
+    unsigned int i = 0;
+    for(; i < GPU_DIRTY_COUNT; i++) {
+        const GPURect* rect = &GPU_DIRTY[i];
+        if(GPU_LAYER_BOUNDS.left == GPU_LAYER_BOUNDS.right) GPU_LAYER_BOUNDS = *rect;
+        if(rect->left < GPU_LAYER_BOUNDS.left) GPU_LAYER_BOUNDS.left = rect->left;
+        if(rect->top < GPU_LAYER_BOUNDS.top) GPU_LAYER_BOUNDS.top = rect->top;
+        if(rect->right > GPU_LAYER_BOUNDS.right) GPU_LAYER_BOUNDS.right = rect->right;
+        if(rect->bottom > GPU_LAYER_BOUNDS.bottom) GPU_LAYER_BOUNDS.bottom = rect->bottom;
+    }
+    GPU_DIRTY_COUNT = 0;
+
+    int row = GPU_LAYER_BOUNDS.top;
+    for(; row < GPU_LAYER_BOUNDS.bottom; row++) {
+        gpu_copy_span(GPU_FRAMEBUFFER + row * CONSOLE_WIDTH + GPU_LAYER_BOUNDS.left, GPU_LAYER + row * CONSOLE_WIDTH + GPU_LAYER_BOUNDS.left,
+            GPU_LAYER_BOUNDS.right - GPU_LAYER_BOUNDS.left);
+    }
+}
+
+void gpu_present() {
+    if(GPU_DUMP_PATH) gpu_dump(GPU_DUMP_PATH);
+}
+
+// called on the render thread when it starts and stops
+void gpu_thread_begin() {}
+void gpu_thread_end() {}
+
+void gpu_close() {
+    pthread_mutex_lock(&GPU_WORK_LOCK);
+    GPU_WORK_QUIT = 1;
+    pthread_cond_broadcast(&GPU_WORK_START);
+    pthread_mutex_unlock(&GPU_WORK_LOCK);
+    int i = 0;
+    for(; i < GPU_WORKER_COUNT; i++) pthread_join(GPU_WORKERS[i], NULL);
+    for(i = 0; i < GPU_TILES_X * GPU_TILES_Y; i++) free(GPU_TILES[i].items);
+    free(GPU_SCREEN_VERTICES);
+    if(GPU_FRAMEBUFFER) free(GPU_FRAMEBUFFER);
+}
+
+#else
+
+#define GPU_VBO_INITIAL_SIZE 256 // floats
+
+SDL_Window* GPU_WINDOW;
+SDL_GLContext GPU_CONTEXT;
+GLuint GPU_DEFAULT_SHADER;
+GLuint GPU_LAYER_SHADER;  // draws the bitmap layer texture over the whole window
+GLuint GPU_LAYER_TEXTURE = 0; // created once the layer is first used
+GLint GPU_VERTEX_SOURCE;
+GLint GPU_COLOUR_SOURCE;
+GLint GPU_MATRIX_SOURCE;
+GLuint GPU_VBO, GPU_VAO;
+unsigned int GPU_VBO_SIZE = GPU_VBO_INITIAL_SIZE; // the size of the streaming vertex buffer in floats
+
+void gpu_error_check() {
+    int error = 0;
+    switch(error) {
+        case 0: break;
+        default:
+            printf("GPU GL Error: %i\n", error);
+            break;
+    }
+}
+
+GLuint gpu_create_program(const char** vertex_source, int vertex_lines, const char** fragment_source, int fragment_lines) {
+    GLuint shaders[2];
+    shaders[0] = glCreateShader(GL_VERTEX_SHADER);
+    shaders[1] = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(shaders[0], vertex_lines, vertex_source, NULL);
+    glShaderSource(shaders[1], fragment_lines, fragment_source, NULL);
+    glCompileShader(shaders[0]);
+    glCompileShader(shaders[1]);
+    unsigned int i = 0;
+    for(; i < 2; i++) {
+        GLint status = 0;
+        glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &status);
+        if(status == GL_FALSE) {
+            int length = 0;
+            glGetShaderiv(shaders[i], GL_INFO_LOG_LENGTH, &length);
+            char* error = (char*) malloc(length);
+            if(!error){ puts("Memory allocation failure."); exit(-1); }
+            glGetShaderInfoLog(shaders[i], length, &length, error);
+            printf("Error: GPU %s shader error:\n%s\n", i == 0 ? "vertex" : "fragment", error);
+            free(error);
+            exit(-1);
+        }
+    }
+    GLuint program = glCreateProgram();
+    glAttachShader(program, shaders[0]);
+    glAttachShader(program, shaders[1]);
+    glLinkProgram(program);
+
+    GLint status = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if(status == GL_FALSE) {
+        int length = 0;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+        char* error = (char*) malloc(length);
+        if(!error){ puts("Memory allocation failure."); exit(-1); }
+        glGetShaderInfoLog(program, length, &length, error);
+        printf("Error: GPU program linking failure:\n%s\n", error);
+        free(error);
+        glDeleteShader(shaders[0]);
+        glDeleteShader(shaders[1]);
+        exit(-1);
+    }
+
+    glDetachShader(program, shaders[0]);
+    glDetachShader(program, shaders[1]);
+    glDeleteShader(shaders[0]);
+    glDeleteShader(shaders[1]);
+    gpu_error_check();
+    return program;
+}
+
+void gpu_init_shaders() {
+    static const char* VERTEX_SHADER_SOURCE[] = {
+        "#version 330\n",
+        "in vec2 vertex;\n",
+        "uniform mat4 matrix;\n"
+        "void main() {\n",
+        "   gl_PointSize = 10.0f;\n"
+        "   gl_Position = matrix * vec4(vertex.x, vertex.y, 0, 1);\n",
+        "}\n"
+    };
+    static const char* FRAGMENT_SHADER_SOURCE[] = {
+        "#version 330\n",
+        "uniform vec3 colour;\n",
+        "out vec4 c_out;\n"
+        "void main() {\n",
+        "   c_out = vec4(colour, 1);\n",
+        "}\n"
+    };
+    GPU_DEFAULT_SHADER = gpu_create_program(VERTEX_SHADER_SOURCE, sizeof(VERTEX_SHADER_SOURCE) / sizeof(char*), FRAGMENT_SHADER_SOURCE, sizeof(FRAGMENT_SHADER_SOURCE) / sizeof(char*));
+
+    // a window sized quad as a 4 vertex triangle strip, generated from the vertex ids
+    static const char* LAYER_VERTEX_SHADER_SOURCE[] = {
+        "#version 330\n",
+        "out vec2 uv;\n",
+        "void main() {\n",
+        "   vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n",
+        "   uv = vec2(corner.x, 1 - corner.y);\n",
+        "   gl_Position = vec4(corner * 2 - 1, 0, 1);\n",
+        "}\n"
+    };
+    static const char* LAYER_FRAGMENT_SHADER_SOURCE[] = {
+        "#version 330\n",
+        "uniform sampler2D layer;\n",
+        "in vec2 uv;\n",
+        "out vec4 c_out;\n"
+        "void main() {\n",
+        "   c_out = texture(layer, uv);\n",
+        "}\n"
+    };
+    GPU_LAYER_SHADER = gpu_create_program(LAYER_VERTEX_SHADER_SOURCE, sizeof(LAYER_VERTEX_SHADER_SOURCE) / sizeof(char*), LAYER_FRAGMENT_SHADER_SOURCE, sizeof(LAYER_FRAGMENT_SHADER_SOURCE) / sizeof(char*));
+}
+
+void gpu_init() {
+    glGenBuffers(1, &GPU_VBO);
+    glBindBuffer(GL_ARRAY_BUFFER, GPU_VBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * GPU_VBO_SIZE, NULL, GL_STREAM_DRAW);
+
+    glGenVertexArrays(1, &GPU_VAO);
+    glBindVertexArray(GPU_VAO);
+
+    gpu_init_shaders();
+    GPU_VERTEX_SOURCE = glGetAttribLocation(GPU_DEFAULT_SHADER,  "vertex");
+    GPU_COLOUR_SOURCE = glGetUniformLocation(GPU_DEFAULT_SHADER, "colour");
+    GPU_MATRIX_SOURCE = glGetUniformLocation(GPU_DEFAULT_SHADER, "matrix");
+    if(GPU_VERTEX_SOURCE == -1 || GPU_COLOUR_SOURCE == -1 || GPU_MATRIX_SOURCE == -1) {
+        puts("Error: GPU source(s) not found in default shader.");
+        exit(-1);
+    }
+    glUseProgram(GPU_DEFAULT_SHADER);
+    glBindBuffer(GL_ARRAY_BUFFER, GPU_VBO);
+    glEnableVertexAttribArray(GPU_VERTEX_SOURCE);
+    glVertexAttribPointer(GPU_VERTEX_SOURCE, 2, GL_FLOAT, GL_FALSE, 0, (void*) 0);
+    glUniformMatrix4fv(GPU_MATRIX_SOURCE, 1, GL_FALSE, GPU_PROJECTION_MATRIX);
+    glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+    gpu_error_check();
+}
+
+// upload all the queued vertices in one go and draw each batch out of the buffer
+void gpu_submit(const float* vertices, unsigned int vertex_count, const GPUBatch* batches, unsigned int batch_count) {
+    while(vertex_count * 2 > GPU_VBO_SIZE) GPU_VBO_SIZE *= 2;
+    // orphan the old storage so the driver does not wait for the last frame's draws
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * GPU_VBO_SIZE, NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float) * vertex_count * 2, vertices);
+    static const GLenum modes[] = { GL_POINTS, GL_LINES, GL_LINE_STRIP, GL_TRIANGLES };
+    unsigned int i = 0;
+    for(; i < batch_count; i++) {
+        glUniform3fv(GPU_COLOUR_SOURCE, 1, batches[i].rgb);
+        glDrawArrays(modes[batches[i].primitive], batches[i].first, batches[i].count);
+    }
+    gpu_error_check();
+}
+
+// upload the dirty rectangles of the bitmap layer and draw the layer under the frame
+void gpu_update_layer() {
+    if(!GPU_LAYER) return;
+    if(GPU_LAYER_TEXTURE == 0) {
+        glGenTextures(1, &GPU_LAYER_TEXTURE);
+        glBindTexture(GL_TEXTURE_2D, GPU_LAYER_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, CONSOLE_WIDTH, CONSOLE_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        // the first upload is the whole layer
+        GPURect all = { 0, 0, CONSOLE_WIDTH, CONSOLE_HEIGHT };
+        GPU_DIRTY[0] = all;
+        GPU_DIRTY_COUNT = 1;
+    }
+    glBindTexture(GL_TEXTURE_2D, GPU_LAYER_TEXTURE);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, CONSOLE_WIDTH);
+    unsigned int i = 0;
+    for(; i < GPU_DIRTY_COUNT; i++) {
+        const GPURect* rect = &GPU_DIRTY[i];
+        glTexSubImage2D(GL_TEXTURE_2D, 0, rect->left, rect->top, rect->right - rect->left, rect->bottom - rect->top,
+            GL_RGBA, GL_UNSIGNED_BYTE, GPU_LAYER + rect->top * CONSOLE_WIDTH + rect->left);
+    }
+    GPU_DIRTY_COUNT = 0;
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glUseProgram(GPU_LAYER_SHADER);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glUseProgram(GPU_DEFAULT_SHADER);
+    glDisable(GL_BLEND);
+    gpu_error_check();
+}
+
+void gpu_free() {
+    if(glIsBuffer(GPU_VBO) == GL_TRUE) glDeleteBuffers(1, &GPU_VBO);
+    if(glIsVertexArray(GPU_VAO) == GL_TRUE) glDeleteVertexArrays(1, &GPU_VAO);
+    if(glIsTexture(GPU_LAYER_TEXTURE) == GL_TRUE) glDeleteTextures(1, &GPU_LAYER_TEXTURE);
+    if(glIsProgram(GPU_LAYER_SHADER) == GL_TRUE) glDeleteProgram(GPU_LAYER_SHADER);
+    if(glIsProgram(GPU_DEFAULT_SHADER) == GL_TRUE) glDeleteProgram(GPU_DEFAULT_SHADER);
+    gpu_error_check();
+}
+
+// create the window and its opengl context
+int gpu_open() {
+    if(SDL_Init(SDL_INIT_EVERYTHING) != 0) {
+        printf("SDL initalization error:\n%s\n", SDL_GetError());
+        return -1;
+    }
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+    GPU_WINDOW = SDL_CreateWindow("Virtual Machine", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, CONSOLE_WIDTH, CONSOLE_HEIGHT, SDL_WINDOW_SHOWN);
+    if(GPU_WINDOW == NULL) {
+        printf("SDL window creation error:\n%s\n", SDL_GetError());
+        return -1;
+    }
+    GPU_CONTEXT = SDL_GL_CreateContext(GPU_WINDOW);
+    if(GPU_CONTEXT == NULL) {
+        printf("SDL opengl context creation error:\n%s\n", SDL_GetError());
+        return -1;
+    }
+
+    gpu_init();
+    // the context is handed over to the render thread
+    SDL_GL_MakeCurrent(GPU_WINDOW, NULL);
+    return 0;
+}
+
+void gpu_present() {
+    SDL_GL_SwapWindow(GPU_WINDOW);
+}
+
+// called on the render thread when it starts and stops
+void gpu_thread_begin() {
+    SDL_GL_MakeCurrent(GPU_WINDOW, GPU_CONTEXT);
+}
+
+void gpu_thread_end() {
+    gpu_free();
+    SDL_GL_MakeCurrent(GPU_WINDOW, NULL);
+}
+
+void gpu_close() {
+    SDL_GL_DeleteContext(GPU_CONTEXT);
+    SDL_DestroyWindow(GPU_WINDOW);
+    SDL_Quit();
+}
+
+#endif
+
+// queue count vertices to be drawn in the current colour
+// returns where the vertices should be written to
+float* gpu_queue_vertices(unsigned int count) {
+    if(GPU_VERTEX_COUNT + count > GPU_VERTEX_CAPACITY) {
+        if(GPU_VERTEX_CAPACITY == 0) GPU_VERTEX_CAPACITY = GPU_QUEUE_INITIAL_SIZE;
+        while(GPU_VERTEX_COUNT + count > GPU_VERTEX_CAPACITY) GPU_VERTEX_CAPACITY *= 2;
+        GPU_VERTICES = (float*) realloc(GPU_VERTICES, sizeof(float) * 2 * GPU_VERTEX_CAPACITY);
+        if(!GPU_VERTICES) { puts("Memory expansion failure error."); exit(-1); }
+    }
+    // line strips are never merged since that would join them up,
+    // lines and triangles only when the last batch ends on a whole primitive
+    static const unsigned int primitive_size[] = { 1, 2, 0, 3 };
+    GPUBatch* last = GPU_BATCH_COUNT > 0 ? &GPU_BATCHES[GPU_BATCH_COUNT - 1] : NULL;
+    if(last && last->primitive == GPU_PRIMITIVE && GPU_PRIMITIVE != PRIMITIVE_LINE_STRIP && last->count % primitive_size[GPU_PRIMITIVE] == 0 && memcmp(last->rgb, GPU_RGB, sizeof(GPU_RGB)) == 0) {
+        // the vertices follow on from the last batch so it can be extended
+        last->count += count;
+    }
+    else {
+        if(GPU_BATCH_COUNT >= GPU_BATCH_CAPACITY) {
+            GPU_BATCH_CAPACITY = GPU_BATCH_CAPACITY == 0 ? 64 : GPU_BATCH_CAPACITY * 2;
+            GPU_BATCHES = (GPUBatch*) realloc(GPU_BATCHES, sizeof(GPUBatch) * GPU_BATCH_CAPACITY);
+            if(!GPU_BATCHES) { puts("Memory expansion failure error."); exit(-1); }
+        }
+        last = &GPU_BATCHES[GPU_BATCH_COUNT++];
+        memcpy(last->rgb, GPU_RGB, sizeof(GPU_RGB));
+        last->primitive = GPU_PRIMITIVE;
+        last->first = GPU_VERTEX_COUNT;
+        last->count = count;
+    }
+    GPU_VERTEX_COUNT += count;
+    return GPU_VERTICES + (GPU_VERTEX_COUNT - count) * 2;
+}
+
+// submit everything queued since the last frame
+void gpu_flush() {
+    if(GPU_BATCH_COUNT > 0) gpu_submit(GPU_VERTICES, GPU_VERTEX_COUNT, GPU_BATCHES, GPU_BATCH_COUNT);
+    GPU_DRAWS_SUBMITTED += GPU_BATCH_COUNT;
+    GPU_FRAMES ++;
+    GPU_VERTEX_COUNT = 0;
+    GPU_BATCH_COUNT = 0;
+}
+
+// wake the other side of the ring if it is asleep waiting
+static void gpu_ring_notify(atomic_int* waiting) {
+    atomic_thread_fence(memory_order_seq_cst); // the ring update must be visible before checking
+    if(atomic_load_explicit(waiting, memory_order_relaxed)) {
+        pthread_mutex_lock(&GPU_RING_LOCK);
+        pthread_cond_broadcast(&GPU_RING_SIGNAL);
+        pthread_mutex_unlock(&GPU_RING_LOCK);
+    }
+}
+
+// block the render thread until size bytes are in the ring and pop them
+static void gpu_ring_read(void* data, unsigned int size) {
+    if(ring_used(&GPU_RING) < size) {
+        pthread_mutex_lock(&GPU_RING_LOCK);
+        atomic_store(&GPU_CONSUMER_WAITING, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while(ring_used(&GPU_RING) < size) pthread_cond_wait(&GPU_RING_SIGNAL, &GPU_RING_LOCK);
+        atomic_store(&GPU_CONSUMER_WAITING, 0);
+        pthread_mutex_unlock(&GPU_RING_LOCK);
+    }
+    ring_pop(&GPU_RING, data, size);
+    gpu_ring_notify(&GPU_PRODUCER_WAITING);
+}
+
+// push a command onto the ring, blocking the machine if the render thread is too far behind
+static void gpu_command(unsigned int type, const void* data, unsigned int size) {
+    GPUCommand command = { type, size };
+    unsigned int total = sizeof(GPUCommand) + size;
+    unsigned int used = ring_used(&GPU_RING);
+
+    if(GPU_RING_SIZE - used < total) {
+        GPU_RING_STALLS ++;
+        pthread_mutex_lock(&GPU_RING_LOCK);
+        atomic_store(&GPU_PRODUCER_WAITING, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while(GPU_RING_SIZE - ring_used(&GPU_RING) < total) pthread_cond_wait(&GPU_RING_SIGNAL, &GPU_RING_LOCK);
+        atomic_store(&GPU_PRODUCER_WAITING, 0);
+        pthread_mutex_unlock(&GPU_RING_LOCK);
+    }
+
+    ring_push(&GPU_RING, &command, sizeof(GPUCommand));
+    if(size > 0) ring_push(&GPU_RING, data, size);
+    gpu_ring_notify(&GPU_CONSUMER_WAITING);
+
+    used += total;
+    if(used > GPU_RING_PEAK) GPU_RING_PEAK = used;
+    GPU_RING_TOTAL += used;
+    GPU_RING_COMMANDS ++;
+}
+
+// write a LAYER command from the ring into the layer
+void gpu_layer_read() {
+    GPULayerCommand command;
+    gpu_ring_read(&command, sizeof(command));
+    gpu_layer_open();
+    unsigned int pixels[CONSOLE_WIDTH];
+    int columns = command.rect.right - command.rect.left;
+    int row = command.rect.top;
+    for(; row < command.rect.bottom; row++) {
+        unsigned int* destination = GPU_LAYER + row * CONSOLE_WIDTH + command.rect.left;
+        if(command.replace) gpu_ring_read(destination, columns * sizeof(unsigned int));
+        else {
+            gpu_ring_read(pixels, columns * sizeof(unsigned int));
+            gpu_copy_span(destination, pixels, columns);
+        }
+    }
+    gpu_layer_dirty(command.rect);
+    GPU_LAYER_PIXELS += columns * (command.rect.bottom - command.rect.top);
+}
+
+void* gpu_thread(void* argument) {
+    gpu_thread_begin();
+
+    GPUCommand command;
+    while(1) {
+        gpu_ring_read(&command, sizeof(GPUCommand));
+        switch(command.type) {
+            case GPU_COMMAND_DRAW:
+                GPU_DRAWS_ISSUED ++;
+                // the vertices go straight from the ring into the queue
+                if(command.size > 0) gpu_ring_read(gpu_queue_vertices(command.size / (2 * sizeof(float))), command.size);
+                break;
+
+            case GPU_COMMAND_COLOUR:
+                gpu_ring_read(GPU_RGB, sizeof(GPU_RGB));
+                break;
+
+            case GPU_COMMAND_PRIMITIVE:
+                gpu_ring_read(&GPU_PRIMITIVE, sizeof(GPU_PRIMITIVE));
+                break;
+
+            case GPU_COMMAND_LAYER:
+                gpu_layer_read();
+                break;
+
+            case GPU_COMMAND_PRESENT:
+                gpu_update_layer();
+                gpu_flush();
+                gpu_present();
+                break;
+
+            case GPU_COMMAND_QUIT:
+                gpu_thread_end();
+                return NULL;
+        }
+    }
+}
+
+int gpu_thread_start() {
+    if(pthread_create(&GPU_THREAD, NULL, gpu_thread, NULL) != 0) {
+        puts("Error: Could not create the render thread.");
+        return -1;
+    }
+    return 0;
+}
+
+// finish everything on the ring and stop the render thread
+void gpu_thread_stop() {
+    gpu_command(GPU_COMMAND_QUIT, NULL, 0);
+    pthread_join(GPU_THREAD, NULL);
+}
+
+// the machine's side of the gpu:
+static unsigned int GPU_DRAW_PRIMITIVE = PRIMITIVE_POINTS; // the primitive last sent to the render thread
+
+void gpu_set_colour(const unsigned char* rgb) {
+    float colour[3] = { rgb[0] / 255.0f, rgb[1] / 255.0f, rgb[2] / 255.0f };
+    gpu_command(GPU_COMMAND_COLOUR, colour, sizeof(colour));
+}
+
+void gpu_set_primitive(unsigned int primitive) {
+    GPU_DRAW_PRIMITIVE = primitive;
+    gpu_command(GPU_COMMAND_PRIMITIVE, &primitive, sizeof(primitive));
+}
+
+// draws too large for the ring are split on whole primitives, so the parts merge back into one batch,
+// and each part of a line strip begins with the last vertex of the part before
+void gpu_draw(const void* data, unsigned int count) {
+    static const unsigned int primitive_size[] = { 1, 2, 1, 3 };
+    unsigned int limit = GPU_RING_MAX_VERTICES - GPU_RING_MAX_VERTICES % primitive_size[GPU_DRAW_PRIMITIVE];
+    const float* vertices = (const float*) data;
+    while(1) {
+        unsigned int chunk = count > limit ? limit : count;
+        gpu_command(GPU_COMMAND_DRAW, vertices, chunk * 2 * sizeof(float));
+        if(chunk == count) break;
+        if(GPU_DRAW_PRIMITIVE == PRIMITIVE_LINE_STRIP) chunk--;
+        vertices += chunk * 2;
+        count -= chunk;
+    }
+}
+
+void gpu_redraw() {
+    gpu_command(GPU_COMMAND_PRESENT, NULL, 0);
+}
+
+void gpu_stats() {
+    printf("GPU: %u draws issued, %u batches submitted over %u frames.\n", GPU_DRAWS_ISSUED, GPU_DRAWS_SUBMITTED, GPU_FRAMES);
+    printf("GPU ring: %u commands, peak %u of %u bytes used, %llu bytes used on average, %u producer stalls.\n",
+        GPU_RING_COMMANDS, GPU_RING_PEAK, GPU_RING_SIZE, GPU_RING_COMMANDS ? GPU_RING_TOTAL / GPU_RING_COMMANDS : 0, GPU_RING_STALLS);
+    printf("GPU layer: %u blits, %llu pixels written to the layer.\n", GPU_BLITS, GPU_LAYER_PIXELS);
+}
+
+int gpu_redraw_interrupt() {
+    text_render(RAM);
+    gpu_redraw();
+    return DEVICE_OK;
+}
+
+int gpu_set_colour_interrupt() {
+    if(REGISTERS[ESI].m32 < 0 || REGISTERS[ESI].m32 > RAM_SIZE - 3) {
+        crash("Invalid colour address [%i]\n", REGISTERS[ESI].m32);
+        return DEVICE_CRASH;
+    }
+    dprintf("New color = %i %i %i\n", RAM[REGISTERS[ESI].m32], RAM[REGISTERS[ESI].m32+1], RAM[REGISTERS[ESI].m32+2]);
+    gpu_set_colour(&RAM[REGISTERS[ESI].m32]);
+    return DEVICE_OK;
+}
+
+int gpu_set_primitive_interrupt() {
+    if(REGISTERS[EAX].m32 < PRIMITIVE_POINTS || REGISTERS[EAX].m32 > PRIMITIVE_TRIANGLES) {
+        crash("Invalid primitive [%i]\n", REGISTERS[EAX].m32);
+        return DEVICE_CRASH;
+    }
+    gpu_set_primitive(REGISTERS[EAX].m32);
+    return DEVICE_OK;
+}
+
+int gpu_blit_interrupt() {
+    if(gpu_blit(RAM, RAM_SIZE, REGISTERS[ESI].m32) != 0) {
+        crash("Invalid blit descriptor at [%i]\n", REGISTERS[ESI].m32);
+        return DEVICE_CRASH;
+    }
+    return DEVICE_OK;
+}
+
+int gpu_draw_interrupt() {
+    if(REGISTERS[ESI].m32 < 0 || REGISTERS[EAX].m32 < 0 || REGISTERS[ESI].m32 + (long) REGISTERS[EAX].m32 * 2 * sizeof(float) > RAM_SIZE) {
+        crash("Invalid draw registers: ESI=[%i] EAX=[%i]\n", REGISTERS[ESI].m32, REGISTERS[EAX].m32);
+        return DEVICE_CRASH;
+    }
+    gpu_draw(&RAM[REGISTERS[ESI].m32], REGISTERS[EAX].m32);
+    return DEVICE_OK;
+}
+
+int gpu_attach() {
+    if(bus_interrupt(DRAW, gpu_draw_interrupt) != 0) return -1;
+    if(bus_interrupt(REDRAW, gpu_redraw_interrupt) != 0) return -1;
+    if(bus_interrupt(SET_COLOR, gpu_set_colour_interrupt) != 0) return -1;
+    if(bus_interrupt(SET_PRIMITIVE, gpu_set_primitive_interrupt) != 0) return -1;
+    if(bus_interrupt(BLIT, gpu_blit_interrupt) != 0) return -1;
+    return 0;
+}
+
+void gpu_queue_free() {
+    if(GPU_VERTICES) free(GPU_VERTICES);
+    if(GPU_BATCHES) free(GPU_BATCHES);
+}
+
+/*******************************************************************/
+/******************************* gpu *******************************/
+/*******************************************************************/
+
+/*******************************************************************/
+/****************************** text *******************************/
+/*******************************************************************/
+
+#define TEXT_CELLS (TEXT_COLUMNS * TEXT_ROWS)
+
+// the cells written to since the last redraw, one bit per cell
+static unsigned char TEXT_DIRTY[TEXT_CELLS / 8];
+static int TEXT_CHANGED = 0;
+unsigned int TEXT_CELLS_DRAWN = 0;
+
+// the CGA colours as layer pixels
+static const unsigned int TEXT_PALETTE[16] = {
+    0xFF000000, 0xFFAA0000, 0xFF00AA00, 0xFFAAAA00, 0xFF0000AA, 0xFFAA00AA, 0xFF0055AA, 0xFFAAAAAA,
+    0xFF555555, 0xFFFF5555, 0xFF55FF55, 0xFFFFFF55, 0xFF5555FF, 0xFFFF55FF, 0xFF55FFFF, 0xFFFFFFFF
+};
+
+// mark the cells covering size bytes at the address as changed
+void text_mark(int address, int size) {
+    int first = (address - TEXT_ADDRESS) / 2;
+    int last = (address + size - 1 - TEXT_ADDRESS) / 2;
+    if(first < 0) first = 0;
+    if(last >= TEXT_CELLS) last = TEXT_CELLS - 1;
+    // any CPU may write to the screen
+    for(; first <= last; first++) __atomic_fetch_or(&TEXT_DIRTY[first >> 3], 1 << (first & 7), __ATOMIC_RELEASE);
+    __atomic_store_n(&TEXT_CHANGED, 1, __ATOMIC_RELEASE);
+}
+
+
+// draw one cell into pixels which are stride pixels wide
+static void text_draw_cell(const unsigned char* cell, unsigned int* pixels, int stride) {
+    int x, y;
+    if(cell[0] == 0) {
+        for(y = 0; y < FONT_HEIGHT; y++, pixels += stride) memset(pixels, 0, sizeof(unsigned int) * FONT_WIDTH);
+        return;
+    }
+    unsigned int colours[2] = { TEXT_PALETTE[cell[1] >> 4], TEXT_PALETTE[cell[1] & 15] };
+    const unsigned char* glyph = FONT[(cell[0] >= FONT_FIRST && cell[0] <= FONT_LAST ? cell[0] : '?') - FONT_FIRST];
+    for(y = 0; y < FONT_HEIGHT; y++, pixels += stride) {
+        for(x = 0; x < FONT_WIDTH; x++) pixels[x] = colours[(glyph[y] >> (7 - x)) & 1];
+    }
+}
+
+// draw the changed cells and send them to the layer, called on the machine thread before a redraw
+// each row sends the span from its first to its last changed cell, drawing the unchanged cells inside it again
+void text_render(const unsigned char* ram) {
+    if(!__atomic_exchange_n(&TEXT_CHANGED, 0, __ATOMIC_ACQUIRE)) return;
+    const unsigned char* grid = ram + TEXT_ADDRESS;
+
+    int row, column;
+    for(row = 0; row < TEXT_ROWS; row++) {
+        int left = TEXT_COLUMNS, right = 0;
+        unsigned char dirty = 0;
+        for(column = 0; column < TEXT_COLUMNS; column++) {
+            int cell = row * TEXT_COLUMNS + column;
+            // take 8 cells at a time, skipping them if they are clean
+            if((cell & 7) == 0) {
+                dirty = __atomic_exchange_n(&TEXT_DIRTY[cell >> 3], 0, __ATOMIC_ACQUIRE);
+                if(dirty == 0) {
+                    column += 7;
+                    continue;
+                }
+            }
+            if(!(dirty & (1 << (cell & 7)))) continue;
+            if(column < left) left = column;
+            right = column + 1;
+        }
+        if(left >= right) continue;
+        for(column = left; column < right; column++) {
+            text_draw_cell(grid + (row * TEXT_COLUMNS + column) * 2, GPU_LAYER_STAGING_PIXELS + (column - left) * FONT_WIDTH, (right - left) * FONT_WIDTH);
+            TEXT_CELLS_DRAWN ++;
+        }
+        GPURect rect = { left * FONT_WIDTH, row * FONT_HEIGHT, right * FONT_WIDTH, (row + 1) * FONT_HEIGHT };
+        gpu_layer_send(rect, 1);
+    }
+}
+
+int text_attach() {
+    return bus_map(TEXT_ADDRESS, TEXT_ADDRESS + TEXT_SIZE, NULL, text_mark);
+}
+
+void text_stats() {
+    printf("Text: %u cells redrawn.\n", TEXT_CELLS_DRAWN);
+}
+
+/*******************************************************************/
+/****************************** text *******************************/
+/*******************************************************************/
+
+/*******************************************************************/
+/****************************** disk *******************************/
+/*******************************************************************/
+
+static Drive* DRIVE; // the virtual hard drive
+
+// read the disk from EAX to EBX and push it onto the stack
+int disk_read_interrupt() {
+    dprintf("READ: %i to %i\n", REGISTERS[EAX].m32, REGISTERS[EBX].m32);
+    if(REGISTERS[EAX].m32 < 0 || REGISTERS[EBX].m32 < 0 || REGISTERS[EAX].m32 >= REGISTERS[EBX].m32) {
+        crash("Invalid read registers: EAX=[%i] EBX=[%i]\n", REGISTERS[EAX].m32, REGISTERS[EBX].m32);
+    }
+
+    if(REGISTERS[EBX].m32 - REGISTERS[EAX].m32 + REGISTERS[ESP].m32 > RAM_SIZE) {
+        crash("READ_DISK stack overflow.\n");
+        return DEVICE_CRASH;
+    }
+
+    if(drive_read(DRIVE, REGISTERS[EAX].m32, &RAM[REGISTERS[ESP].m32], REGISTERS[EBX].m32 - REGISTERS[EAX].m32) != 0) {
+        crash("READ_DISK failure.\n");
+        return DEVICE_CRASH;
+    }
+    bus_write(REGISTERS[ESP].m32, REGISTERS[EBX].m32 - REGISTERS[EAX].m32);
+
+    REGISTERS[ESP].m32 += REGISTERS[EBX].m32 - REGISTERS[EAX].m32;
+    return DEVICE_OK;
+}
+
+// pop the data off the stack and write it to the disk from EAX to EBX
+int disk_write_interrupt() {
+    dprintf("WRITE: %i to %i\n", REGISTERS[EAX].m32, REGISTERS[EBX].m32);
+    if(REGISTERS[EAX].m32 < 0 || REGISTERS[EBX].m32 < 0 || REGISTERS[EAX].m32 >= REGISTERS[EBX].m32) {
+        crash("Invalid write registers: EAX=[%i] EBX=[%i]\n", REGISTERS[EAX].m32, REGISTERS[EBX].m32);
+        return DEVICE_CRASH;
+    }
+
+    if(REGISTERS[ESP].m32 - (REGISTERS[EBX].m32 - REGISTERS[EAX].m32) < REGISTERS[ESB].m32) {
+        crash("WRITE_DISK stack underflow.\n");
+        return DEVICE_CRASH;
+    }
+
+    // the data is popped off the top of the stack
+    REGISTERS[ESP].m32 -= REGISTERS[EBX].m32 - REGISTERS[EAX].m32;
+    bus_read(REGISTERS[ESP].m32, REGISTERS[EBX].m32 - REGISTERS[EAX].m32);
+    if(drive_write(DRIVE, REGISTERS[EAX].m32, &RAM[REGISTERS[ESP].m32], REGISTERS[EBX].m32 - REGISTERS[EAX].m32) != 0) {
+        crash("WRITE_DISK failure.\n");
+        return DEVICE_CRASH;
+    }
+    return DEVICE_OK;
+}
+
+int disk_attach() {
+    if(bus_interrupt(READ_DISK, disk_read_interrupt) != 0) return -1;
+    if(bus_interrupt(WRITE_DISK, disk_write_interrupt) != 0) return -1;
+    return 0;
+}
+
+/*******************************************************************/
+/****************************** disk *******************************/
+/*******************************************************************/
+
+/*******************************************************************/
+/****************************** timer ******************************/
+/*******************************************************************/
+
+// instruction timers are checked by the CPU which set them against its instruction counter,
+// microsecond timers are run by a host thread which raises the request and wakes the machine
+static _Thread_local unsigned long long TIMER_DEADLINE = ~0ULL; // the instruction count of the next tick
+static _Thread_local unsigned int TIMER_PERIOD = 0;
+
+static pthread_mutex_t TIMER_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t TIMER_SIGNAL = PTHREAD_COND_INITIALIZER;
+static int TIMER_RUNNING = 0;                 // the microsecond timer is enabled
+static unsigned int TIMER_MICROSECONDS_PERIOD = 0;
+static unsigned int TIMER_GENERATION = 0;     // bumped on every change so a sleeping thread notices
+static int TIMER_THREAD_STARTED = 0;
+atomic_uint TIMER_TICKS = 0;
+
+// called by the machine once the instruction counter reaches TIMER_DEADLINE
+static inline void timer_tick() {
+    TIMER_DEADLINE += TIMER_PERIOD;
+    TIMER_TICKS ++;
+    atomic_fetch_or(&IRQ_PENDING, 1u << IRQ_TIMER);
+}
+
+void* timer_thread(void* argument) {
+    struct timespec next, now;
+    pthread_mutex_lock(&TIMER_LOCK);
+    while(1) {
+        while(!TIMER_RUNNING) pthread_cond_wait(&TIMER_SIGNAL, &TIMER_LOCK);
+        unsigned int generation = TIMER_GENERATION;
+        long period = TIMER_MICROSECONDS_PERIOD * 1000L;
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        while(TIMER_RUNNING && generation == TIMER_GENERATION) {
+            pthread_mutex_unlock(&TIMER_LOCK);
+            // sleep until the next deadline so the period does not drift
+            next.tv_nsec += period;
+            next.tv_sec += next.tv_nsec / 1000000000L;
+            next.tv_nsec %= 1000000000L;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long wait = (next.tv_sec - now.tv_sec) * 1000000000L + (next.tv_nsec - now.tv_nsec);
+            if(wait > 0) {
+                struct timespec sleep = { wait / 1000000000L, wait % 1000000000L };
+                nanosleep(&sleep, NULL);
+            }
+            pthread_mutex_lock(&TIMER_LOCK);
+            if(TIMER_RUNNING && generation == TIMER_GENERATION) {
+                TIMER_TICKS ++;
+                irq_raise(IRQ_TIMER);
+            }
+        }
+    }
+    return NULL;
+}
+
+int timer_set() {
+    int mode = REGISTERS[EAX].m32;
+    unsigned int period = (unsigned int) REGISTERS[EBX].m32;
+    if(mode < TIMER_OFF || mode > TIMER_MICROSECONDS || (mode != TIMER_OFF && (REGISTERS[EBX].m32 <= 0))) {
+        crash("Invalid timer registers: EAX=[%i] EBX=[%i]\n", REGISTERS[EAX].m32, REGISTERS[EBX].m32);
+        return DEVICE_CRASH;
+    }
+
+    TIMER_PERIOD = mode == TIMER_INSTRUCTIONS ? period : 0;
+    TIMER_DEADLINE = mode == TIMER_INSTRUCTIONS ? MACHINE_INSTRUCTIONS + period : ~0ULL;
+
+    pthread_mutex_lock(&TIMER_LOCK);
+    int running = mode == TIMER_MICROSECONDS;
+    if(running != TIMER_RUNNING) atomic_fetch_add(&IRQ_SOURCES, running ? 1 : -1);
+    TIMER_RUNNING = running;
+    TIMER_MICROSECONDS_PERIOD = period;
+    TIMER_GENERATION ++;
+    if(running && !TIMER_THREAD_STARTED) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, timer_thread, NULL) != 0) {
+            pthread_mutex_unlock(&TIMER_LOCK);
+            crash("Could not create the timer thread.\n");
+            return DEVICE_CRASH;
+        }
+        pthread_detach(thread); // the thread may be asleep when the machine exits
+        TIMER_THREAD_STARTED = 1;
+    }
+    pthread_cond_signal(&TIMER_SIGNAL);
+    pthread_mutex_unlock(&TIMER_LOCK);
+    return DEVICE_OK;
+}
+
+int timer_read_counter() {
+    unsigned long long value;
+    struct timespec now;
+    switch(REGISTERS[EAX].m32) {
+        case COUNTER_INSTRUCTIONS:
+            value = MACHINE_INSTRUCTIONS;
+            break;
+        case COUNTER_CYCLES:
+            value = MACHINE_CYCLES;
+            break;
+        case COUNTER_NANOSECONDS:
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            value = now.tv_sec * 1000000000ULL + now.tv_nsec;
+            break;
+        default:
+            crash("Invalid counter [%i]\n", REGISTERS[EAX].m32);
+            return DEVICE_CRASH;
     }
-    GPU_DEFAULT_SHADER = glCreateProgram();
-    glAttachShader(GPU_DEFAULT_SHADER, shaders[0]);
-    glAttachShader(GPU_DEFAULT_SHADER, shaders[1]);
-    glLinkProgram(GPU_DEFAULT_SHADER);
+    REGISTERS[EAX].m32 = (int) (unsigned int) value;
+    REGISTERS[EDX].m32 = (int) (unsigned int) (value >> 32);
+    return DEVICE_OK;
+}
 
-    GLint status = 0;
-    glGetProgramiv(GPU_DEFAULT_SHADER, GL_LINK_STATUS, &status);
-    if(status == GL_FALSE) {
-        int length = 0;
-        glGetProgramiv(GPU_DEFAULT_SHADER, GL_INFO_LOG_LENGTH, &length);
-        char* error = (char*) malloc(length);
-        if(!error){ puts("Memory allocation failure."); exit(-1); }
-        glGetShaderInfoLog(GPU_DEFAULT_SHADER, length, &length, error);
-        printf("Error: GPU program linking failure:\n%s\n", error);
-        free(error);
-        glDeleteShader(shaders[0]);
-        glDeleteShader(shaders[1]);
-        exit(-1);
+int timer_attach() {
+    if(bus_interrupt(SET_TIMER, timer_set) != 0) return -1;
+    if(bus_interrupt(READ_COUNTER, timer_read_counter) != 0) return -1;
+    return 0;
+}
+
+void timer_stats() {
+    unsigned long long instructions = 0, cycles = 0;
+    int cpu;
+    for(cpu = 0; cpu < CPU_COUNT; cpu++) {
+        instructions += CPU_INSTRUCTIONS[cpu];
+        cycles += CPU_CYCLES[cpu];
     }
+    printf("Timer: %u ticks, %llu instructions, %llu modelled cycles.\n", atomic_load(&TIMER_TICKS), instructions, cycles);
+    if(CPU_COUNT == 1) return;
+    for(cpu = 0; cpu < CPU_COUNT; cpu++) printf("CPU %i: %llu instructions, %llu modelled cycles.\n", cpu, CPU_INSTRUCTIONS[cpu], CPU_CYCLES[cpu]);
+}
 
-    glDetachShader(GPU_DEFAULT_SHADER, shaders[0]);
-    glDetachShader(GPU_DEFAULT_SHADER, shaders[1]);
-    glDeleteShader(shaders[0]);
-    glDeleteShader(shaders[1]);
-    gpu_error_check();
+/*******************************************************************/
+/****************************** timer ******************************/
+/*******************************************************************/
+
+/*******************************************************************/
+/***************************** channel *****************************/
+/*******************************************************************/
+
+// a channel is a single producer, single consumer ring of messages in shared memory,
+// each message is its length (an unsigned int) followed by its bytes.
+// a new shared memory object is filled with zeroes, which is an empty channel
+typedef struct ChannelShared
+{
+    atomic_uint head; // the next byte to write, only moved by the sender
+    atomic_uint tail; // the next byte to read, only moved by the receiver
+    unsigned char data[CHANNEL_SIZE];
+}ChannelShared;
+
+typedef struct Channel
+{
+    char* name;            // the shared memory object, NULL if the channel is not attached
+    ChannelShared* shared;
+    int received;          // the machine has received from the channel
+}Channel;
+
+static Channel CHANNELS[CHANNEL_MAX];
+static atomic_ullong CHANNEL_MESSAGES_SENT = 0, CHANNEL_MESSAGES_RECEIVED = 0, CHANNEL_BYTES = 0;
+
+// parse a -channel n:name option
+int channel_option(const char* option) {
+    char* end;
+    long number = strtol(option, &end, 10);
+    if(end == option || *end != ':' || end[1] == 0 || number < 0 || number >= CHANNEL_MAX) {
+        printf("Error: Expected -channel n:name with n from 0 to %i, got [%s].\n", CHANNEL_MAX - 1, option);
+        return -1;
+    }
+    end++;
+    // shared memory object names start with a slash
+    free(CHANNELS[number].name);
+    CHANNELS[number].name = (char*) malloc(strlen(end) + 2);
+    if(!CHANNELS[number].name) return -1;
+    sprintf(CHANNELS[number].name, "%s%s", end[0] == '/' ? "" : "/", end);
+    return 0;
 }
 
-void gpu_init() {
-    glGenBuffers(1, &GPU_VBO);
-    glBindBuffer(GL_ARRAY_BUFFER, GPU_VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * GPU_MAX_VBO_SIZE, NULL, GL_STREAM_DRAW);
+int channel_open() {
+    int c;
+    for(c = 0; c < CHANNEL_MAX; c++) {
+        if(!CHANNELS[c].name) continue;
+        int fd = shm_open(CHANNELS[c].name, O_RDWR | O_CREAT, 0600);
+        if(fd < 0) {
+            printf("Error: Could not open channel [%s].\n", CHANNELS[c].name);
+            return -1;
+        }
+        // extending the object is harmless if the other machine already did
+        struct stat status;
+        if(fstat(fd, &status) != 0 || (status.st_size < (off_t) sizeof(ChannelShared) && ftruncate(fd, sizeof(ChannelShared)) != 0)) {
+            close(fd);
+            printf("Error: Could not size channel [%s].\n", CHANNELS[c].name);
+            return -1;
+        }
+        CHANNELS[c].shared = (ChannelShared*) mmap(NULL, sizeof(ChannelShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(CHANNELS[c].shared == MAP_FAILED) {
+            CHANNELS[c].shared = NULL;
+            printf("Error: Could not map channel [%s].\n", CHANNELS[c].name);
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    glGenVertexArrays(1, &GPU_VAO);
-    glBindVertexArray(GPU_VAO);
+// copy into and out of the ring at the position, wrapping around the end
+static void channel_copy_in(ChannelShared* shared, unsigned int position, const void* source, unsigned int size) {
+    unsigned int start = position & (CHANNEL_SIZE - 1);
+    unsigned int first = CHANNEL_SIZE - start;
+    if(first > size) first = size;
+    memcpy(shared->data + start, source, first);
+    memcpy(shared->data, (const unsigned char*) source + first, size - first);
+}
 
-    gpu_init_shaders();
-    GPU_VERTEX_SOURCE = glGetAttribLocation(GPU_DEFAULT_SHADER,  "vertex");
-    GPU_COLOUR_SOURCE = glGetUniformLocation(GPU_DEFAULT_SHADER, "colour");
-    GPU_MATRIX_SOURCE = glGetUniformLocation(GPU_DEFAULT_SHADER, "matrix");
-    if(GPU_VERTEX_SOURCE == -1 || GPU_COLOUR_SOURCE == -1 || GPU_MATRIX_SOURCE == -1) {
-        puts("Error: GPU source(s) not found in default shader.");
-        exit(-1);
+static void channel_copy_out(ChannelShared* shared, unsigned int position, void* destination, unsigned int size) {
+    unsigned int start = position & (CHANNEL_SIZE - 1);
+    unsigned int first = CHANNEL_SIZE - start;
+    if(first > size) first = size;
+    memcpy(destination, shared->data + start, first);
+    memcpy((unsigned char*) destination + first, shared->data, size - first);
+}
+
+// returns the channel in EBX, or NULL if it is not attached
+static Channel* channel_get() {
+    int c = REGISTERS[EBX].m32;
+    if(c < 0 || c >= CHANNEL_MAX || !CHANNELS[c].shared) {
+        crash("Channel [%i] is not attached.\n", c);
+        return NULL;
     }
-    glUseProgram(GPU_DEFAULT_SHADER);
-    glBindBuffer(GL_ARRAY_BUFFER, GPU_VBO);
-    glEnableVertexAttribArray(GPU_VERTEX_SOURCE);
-    glVertexAttribPointer(GPU_VERTEX_SOURCE, 2, GL_FLOAT, GL_FALSE, 0, (void*) 0);
-    glUniformMatrix4fv(GPU_MATRIX_SOURCE, 1, GL_FALSE, GPU_PROJECTION_MATRIX);
-    glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
-    gpu_error_check();
+    return &CHANNELS[c];
 }
 
-void gpu_draw(void* data, unsigned int count) {
-    printf("DRAW %i\n", count);
-    printf("Coordinates: %f %f\n", *((float*) data), *(((float*) data) + 1));
-    printf("%f %f\n", *(((float*) data) + 2), *(((float*) data) + 3));
-    printf("%f %f\n", *(((float*) data) + 4), *(((float*) data) + 5));
-    if(count > GPU_MAX_VBO_SIZE) {
-        puts("Error: Elements to draw exceeds maximum gpu limit.");
-        exit(-1);
+int channel_send_interrupt() {
+    Channel* channel = channel_get();
+    if(!channel) return DEVICE_CRASH;
+    int address = REGISTERS[ESI].m32, size = REGISTERS[EAX].m32;
+    if(address < 0 || address >= RAM_SIZE || size < 0 || size > RAM_SIZE - address || size > CHANNEL_SIZE - (int) sizeof(int)) {
+        crash("Invalid send registers: ESI=[%i] EAX=[%i]\n", address, size);
+        return DEVICE_CRASH;
     }
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * GPU_MAX_VBO_SIZE, NULL, GL_STREAM_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float) * count * 2, data);
-    glUniform3fv(GPU_COLOUR_SOURCE, 1, GPU_RGB);
-    glDrawArrays(GL_POINTS, 0, count);
-    gpu_error_check();
+
+    ChannelShared* shared = channel->shared;
+    unsigned int head = atomic_load_explicit(&shared->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&shared->tail, memory_order_acquire);
+    if(CHANNEL_SIZE - (head - tail) < sizeof(int) + size) return DEVICE_WAIT; // full, wait for the receiver
+
+    bus_read(address, size);
+    unsigned int length = size;
+    channel_copy_in(shared, head, &length, sizeof(int));
+    channel_copy_in(shared, head + sizeof(int), &RAM[address], size);
+    atomic_store_explicit(&shared->head, head + sizeof(int) + size, memory_order_release);
+
+    CHANNEL_MESSAGES_SENT ++;
+    CHANNEL_BYTES += size;
+    return DEVICE_OK;
 }
 
-void gpu_free() {
-    if(glIsBuffer(GPU_VBO) == GL_TRUE) glDeleteBuffers(1, &GPU_VBO);
-    if(glIsVertexArray(GPU_VAO) == GL_TRUE) glDeleteVertexArrays(1, &GPU_VAO);
-    if(glIsProgram(GPU_DEFAULT_SHADER) == GL_TRUE) glDeleteProgram(GPU_DEFAULT_SHADER);
-    gpu_error_check();
+int channel_receive_interrupt() {
+    Channel* channel = channel_get();
+    if(!channel) return DEVICE_CRASH;
+    int address = REGISTERS[EDI].m32, size = REGISTERS[EAX].m32;
+    if(address < 0 || address >= RAM_SIZE || size < 0 || size > RAM_SIZE - address) {
+        crash("Invalid receive registers: EDI=[%i] EAX=[%i]\n", address, size);
+        return DEVICE_CRASH;
+    }
+
+    ChannelShared* shared = channel->shared;
+    channel->received = 1;
+    unsigned int tail = atomic_load_explicit(&shared->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&shared->head, memory_order_acquire);
+    if(head == tail) return DEVICE_WAIT; // empty, park until the sender catches up
+
+    // the mapping may be left over from a crashed run or shared with a peer which disagrees about its layout,
+    // so a message which does not fit between tail and head is never copied out
+    unsigned int used = head - tail;
+    unsigned int length = 0;
+    if(used >= sizeof(int) && used <= CHANNEL_SIZE) channel_copy_out(shared, tail, &length, sizeof(int));
+    if(used < sizeof(int) || used > CHANNEL_SIZE || length > used - sizeof(int)) {
+        crash("Corrupt channel [%i]: %u bytes queued, message of %u bytes.\n", (int) (channel - CHANNELS), used, length);
+        return DEVICE_CRASH;
+    }
+    if(length < (unsigned int) size) size = length;
+    channel_copy_out(shared, tail + sizeof(int), &RAM[address], size);
+    atomic_store_explicit(&shared->tail, tail + sizeof(int) + length, memory_order_release);
+    bus_write(address, size);
+
+    REGISTERS[EAX].m32 = length;
+    CHANNEL_MESSAGES_RECEIVED ++;
+    return DEVICE_OK;
+}
+
+int channel_attach() {
+    if(bus_interrupt(SEND, channel_send_interrupt) != 0) return -1;
+    if(bus_interrupt(RECV, channel_receive_interrupt) != 0) return -1;
+    return 0;
+}
+
+// the receiving machine removes the name of a channel when it exits so the next pipeline starts with an empty channel,
+// a sender which is still attached keeps its mapping
+void channel_close() {
+    int c;
+    for(c = 0; c < CHANNEL_MAX; c++) {
+        if(CHANNELS[c].shared) munmap(CHANNELS[c].shared, sizeof(ChannelShared));
+        if(CHANNELS[c].received) shm_unlink(CHANNELS[c].name);
+        free(CHANNELS[c].name);
+    }
+}
+
+void channel_stats() {
+    printf("Channels: %llu messages sent, %llu received, %llu bytes sent.\n",
+        atomic_load(&CHANNEL_MESSAGES_SENT), atomic_load(&CHANNEL_MESSAGES_RECEIVED), atomic_load(&CHANNEL_BYTES));
 }
 
 /*******************************************************************/
-/******************************* gpu *******************************/
+/***************************** channel *****************************/
 /*******************************************************************/
 
-int main()
-{
-    // allocate the heap
-    RAM = (unsigned char*) malloc(RAM_SIZE);
-    if(!RAM) return -1;
-    memset(RAM, 0, RAM_SIZE); // 0 - initalize the memory
+int machine_exit() {
+    return DEVICE_HALT;
+}
 
-    if(readROM() != 0)
-    {
-        puts("ROM reading exception.");
+/*******************************************************************/
+/****************************** tasks ******************************/
+/*******************************************************************/
+
+// every CPU has its own run queue of the control block addresses of the tasks waiting to run
+// the context a CPU starts in is a task too, its registers are kept on the host while it waits
+#define TASK_INITIAL -1
+
+static _Thread_local int TASK_QUEUE[TASK_MAX];
+static _Thread_local unsigned int TASK_HEAD = 0, TASK_TAIL = 0;
+static _Thread_local int TASK_CURRENT = TASK_INITIAL;
+static _Thread_local REG32 TASK_INITIAL_REGISTERS[REGISTER_COUNT];
+
+static atomic_uint TASKS_STARTED = 0;
+static atomic_ullong TASK_SWITCHES = 0;
+
+static int task_check(int tcb) {
+    if(tcb < 0 || tcb > RAM_SIZE - TASK_SIZE) {
+        crash("Invalid task control block address [%i]\n", tcb);
         return -1;
     }
+    return 0;
+}
 
-    // open the file descriptor for the hard-drive:
-    FILE* DRIVE = fopen("DRIVE", "rb");
-    if(!DRIVE) {
-        puts("Error opening virtual machine drive file.");
+// save the registers of the running task into its control block
+static void task_save() {
+    if(TASK_CURRENT == TASK_INITIAL) memcpy(TASK_INITIAL_REGISTERS, REGISTERS, sizeof(REGISTERS));
+    else memcpy(&RAM[TASK_CURRENT], REGISTERS, sizeof(REGISTERS));
+}
+
+// load the registers of the next task in the run queue
+static void task_next() {
+    TASK_CURRENT = TASK_QUEUE[TASK_HEAD++ % TASK_MAX];
+    if(TASK_CURRENT == TASK_INITIAL) memcpy(REGISTERS, TASK_INITIAL_REGISTERS, sizeof(REGISTERS));
+    else memcpy(REGISTERS, &RAM[TASK_CURRENT], sizeof(REGISTERS));
+    TASK_SWITCHES ++;
+}
+
+// TASK: queue a task with its control block at tcb, running from ESI with its stack at EDI
+int task_start(int tcb) {
+    if(task_check(tcb) != 0) return -1;
+    if(REGISTERS[ESI].m32 < 0 || REGISTERS[ESI].m32 >= RAM_SIZE || REGISTERS[EDI].m32 < 0 || REGISTERS[EDI].m32 > RAM_SIZE - (int) sizeof(int)) {
+        crash("Invalid task registers: ESI=[%i] EDI=[%i]\n", REGISTERS[ESI].m32, REGISTERS[EDI].m32);
+        return -1;
+    }
+    if(TASK_TAIL - TASK_HEAD == TASK_MAX) {
+        crash("Too many tasks.\n");
         return -1;
     }
 
-    // create the screen:
-    if(SDL_Init(SDL_INIT_EVERYTHING) != 0) {
-        printf("SDL initalization error:\n%s\n", SDL_GetError());
+    REG32 task[REGISTER_COUNT];
+    memcpy(task, REGISTERS, sizeof(task));
+    task[EIP].m32 = REGISTERS[ESI].m32;
+    task[ESB].m32 = REGISTERS[EDI].m32;
+    task[ESP].m32 = REGISTERS[EDI].m32 + sizeof(int);
+    task[FLG].m32 = 0;
+    int value = TASK_EXIT; // returning from the entry point ends the task
+    memcpy(&RAM[REGISTERS[EDI].m32], &value, sizeof(int));
+    memcpy(&RAM[tcb], task, sizeof(task));
+    value = TASK_RUNNING;
+    memcpy(&RAM[tcb + TASK_STATE], &value, sizeof(int));
+
+    TASK_QUEUE[TASK_TAIL++ % TASK_MAX] = tcb;
+    TASKS_STARTED ++;
+    return 0;
+}
+
+// YIELD: move the running task to the back of the run queue and switch to the next one
+void task_yield() {
+    if(TASK_HEAD == TASK_TAIL) return; // nothing else to run
+    task_save();
+    int current = TASK_CURRENT;
+    task_next(); // free the next task's slot first, a full queue has no other room for the running task
+    TASK_QUEUE[TASK_TAIL++ % TASK_MAX] = current;
+}
+
+// JOIN: yield until the task with its control block at tcb has finished
+// the JOIN of length size is run again each time the waiting task is switched back to
+int task_join(int tcb, int size) {
+    if(task_check(tcb) != 0) return -1;
+    int state;
+    memcpy(&state, &RAM[tcb + TASK_STATE], sizeof(int));
+    if(state == TASK_DONE) return 0;
+    if(tcb == TASK_CURRENT || TASK_HEAD == TASK_TAIL) {
+        crash("Joining task [%i] would never return.\n", tcb);
         return -1;
     }
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
-    SDL_Window* window = SDL_CreateWindow("Virtual Machine", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, CONSOLE_WIDTH, CONSOLE_HEIGHT, SDL_WINDOW_SHOWN);
-    if(window == NULL) {
-        printf("SDL window creation error:\n%s\n", SDL_GetError());
+    REGISTERS[EIP].m32 -= size;
+    task_yield();
+    return 0;
+}
+
+// called when the running task returns to TASK_EXIT
+// returns 1 if the CPU has no tasks left to run
+int task_exit() {
+    if(TASK_CURRENT != TASK_INITIAL) {
+        int state = TASK_DONE;
+        memcpy(&RAM[TASK_CURRENT + TASK_STATE], &state, sizeof(int));
+    }
+    if(TASK_HEAD == TASK_TAIL) return 1;
+    task_next();
+    return 0;
+}
+
+void task_stats() {
+    printf("Tasks: %u started, %llu switches.\n", atomic_load(&TASKS_STARTED), atomic_load(&TASK_SWITCHES));
+}
+
+/*******************************************************************/
+/****************************** tasks ******************************/
+/*******************************************************************/
+
+/*******************************************************************/
+/******************************* cpu *******************************/
+/*******************************************************************/
+
+// the atomic instructions take 32 bit registers and an aligned int in RAM at EDI
+// returns -1 if the operands are invalid
+static int cpu_atomic_operands(unsigned char v0, unsigned char v1) {
+    if(v0 > EDI || v1 > EDI) {
+        crash("Invalid atomic operation operands: [%i] and [%i].\n", v0, v1);
         return -1;
     }
-    SDL_GLContext context = SDL_GL_CreateContext(window);
-    if(context == NULL) {
-        printf("SDL opengl context creation error:\n%s\n", SDL_GetError());
+    if(REGISTERS[EDI].m32 < 0 || REGISTERS[EDI].m32 > RAM_SIZE - (int) sizeof(int) || (REGISTERS[EDI].m32 & 3) != 0) {
+        crash("Invalid atomic operation address [%i].\n", REGISTERS[EDI].m32);
         return -1;
     }
+    return 0;
+}
 
-    gpu_init();
+// run a CPU on the calling host thread until it stops
+// returns -1 if the machine crashed
+int cpu_run(int id)
+{
+    CPU_ID = id;
+    bind_registers();
+    REGISTERS[EIP].m32 = MACHINE_ENTRY;
+    REGISTERS[ESB].m32 = MACHINE_ROM_SIZE + id * CPU_STACK_SIZE;
+    REGISTERS[ESP].m32 = REGISTERS[ESB].m32;
+    REGISTERS[EAX].m32 = id;
+    IRQ_ENABLED = id == 0;
 
     int RUNNING = 1; // runing boolean
     int i; // a temporary use integer
     unsigned char OP, v0, v1; // temporary use characters
-    SDL_Event event;
 
-    while(RUNNING)
+    while(RUNNING && atomic_load_explicit(&MACHINE_RUNNING, memory_order_relaxed))
     {
+        if(MACHINE_INSTRUCTIONS >= TIMER_DEADLINE) timer_tick();
+        if(IRQ_ENABLED && atomic_load_explicit(&IRQ_PENDING, memory_order_relaxed)) {
+            if(irq_enter() != DEVICE_OK) return -1;
+        }
+
         // increment the stack pointer for the next bit
         OP = read_b();
+        MACHINE_INSTRUCTIONS ++;
+        MACHINE_CYCLES += OPCODE_CYCLES[OP];
 
         switch(OP)
         {
+            case NOP: // also the padding the assembler adds for #align
+                break;
+
             case INT:
                 v0 = read_b();
                 dprintf("INT %i\n", v0);
-                switch(v0)
-                {
-                    case EXIT:
-                        RUNNING = 0;
-                        break;
-
-                    case PRINT_INT:
-                        printf("%i", REGISTERS[EAX].m32);
-                        break;
-
-                    case PRINT_CHAR:
-                        printf("%c", (char) REGISTERS[EAX].m32);
-                        break;
-
-                    case READ_DISK:
-                        dprintf("READ: %i to %i\n", REGISTERS[EAX].m32, REGISTERS[EBX].m32);
-                        if(REGISTERS[EAX].m32 < 0 || REGISTERS[EBX].m32 < 0 || REGISTERS[EAX].m32 >= REGISTERS[EBX].m32) {
-                            printf("VM Crash: Invalid read registers: EAX=[%i] EBX=[%i]\n", REGISTERS[EAX].m32, REGISTERS[EBX].m32);
-                        }
-
-                        if(fseek(DRIVE, REGISTERS[EAX].m32, SEEK_SET) != 0) {
-                            printf("VM Crash: Invalid READ_DISK start position [%i].\n", REGISTERS[EAX].m32);
-                            return -1;
-                        }
-
-                        if(REGISTERS[EBX].m32 - REGISTERS[EAX].m32 + REGISTERS[ESP].m32 > RAM_SIZE) {
-                            puts("VM Crash: READ_DISK stack overflow.");
-                            return -1;
-                        }
-
-                        if(fread(&RAM[REGISTERS[ESP].m32], 1, REGISTERS[EBX].m32 - REGISTERS[EAX].m32, DRIVE) != REGISTERS[EBX].m32 - REGISTERS[EAX].m32) {
-                            puts("VM Crash: READ_DISK failure.");
-                            return -1;
-                        }
-
-                        REGISTERS[ESP].m32 += REGISTERS[EBX].m32 - REGISTERS[EAX].m32;
-                        break;
-
-                    case POLL: // check if any events were made:
-                        while(SDL_PollEvent(&event)) {
-                            switch(event.type) {
-                                case SDL_QUIT:
-                                    RUNNING = 0;
-                                    break;
-                                default:
-                                    break;
-                            }
-                        }
-
-                    case REDRAW:
-                        SDL_GL_SwapWindow(window);
-                        break;
-
-                    case SET_COLOR:
-                        printf("first number = %i\n", RAM[REGISTERS[ESI].m32]);
-                        GPU_RGB[0] = RAM[REGISTERS[ESI].m32] / 255.0f;
-                        GPU_RGB[1] = RAM[REGISTERS[ESI].m32+1] / 255.0f;
-                        GPU_RGB[2] = RAM[REGISTERS[ESI].m32+2] / 255.0f;
-                        printf("New color = %f %f %f\n", GPU_RGB[0], GPU_RGB[1], GPU_RGB[2]);
-                        break;
-
-                    case DRAW:
-                        gpu_draw(&RAM[REGISTERS[ESI].m32], REGISTERS[EAX].m32);
-                        break;
-
-                    default:
-                        printf("VM Crash: Bad interrupt [%i]\n", v0);
-                        return -1;
+                if(!INTERRUPT_HANDLERS[v0]) {
+                    crash("Bad interrupt [%i]\n", v0);
+                    return -1;
+                }
+                pthread_mutex_lock(&BUS_LOCK);
+                i = INTERRUPT_HANDLERS[v0]();
+                pthread_mutex_unlock(&BUS_LOCK);
+                if(i == DEVICE_CRASH) return -1;
+                if(i == DEVICE_WAIT) {
+                    REGISTERS[EIP].m32 -= 2; // run the INT again
+                    bus_wait();
+                }
+                else BUS_WAITS = 0;
+                if(i == DEVICE_HALT) {
+                    atomic_store(&MACHINE_RUNNING, 0);
+                    input_wake(); // CPU 0 may be halted
                 }
                 break;
 
@@ -391,7 +2491,7 @@ int main()
                     case EDI: REGISTERS[EDI].m32 = read_i(); dprintf("%i\n", REGISTERS[EDI].m32); break;
 
                     default:
-                        printf("VM Crash: Bad move destination register [%i]\n", v0);
+                        crash("Bad move destination register [%i]\n", v0);
                         return -1;
                 }
                 break;
@@ -410,7 +2510,7 @@ int main()
                     case CH:
                     case DH:
                         if(v1 < AL || v1 > DH) { // check if both registers are the same bit types
-                            printf("VM Crash: Invalid copy operation operands: [%i] and [%i].\n", v0, v1);
+                            crash("Invalid copy operation operands: [%i] and [%i].\n", v0, v1);
                             return -1;
                         }
                         *REG8[v0 - REG8_OFFSET] = *REG8[v1 - REG8_OFFSET];
@@ -421,7 +2521,7 @@ int main()
                     case CX:
                     case DX:
                         if(v1 < AX || v1 > DX) { // check if both registers are the same bit types
-                            printf("VM Crash: Invalid copy operation operands: [%i] and [%i].\n", v0, v1);
+                            crash("Invalid copy operation operands: [%i] and [%i].\n", v0, v1);
                             return -1;
                         }
                         *REG16[v0 - REG16_OFFSET] = *REG16[v1 - REG16_OFFSET];
@@ -434,14 +2534,14 @@ int main()
                     case ESP:
                     case ESI:
                         if(v1 < EAX || v1 > EDI) { // check if both registers are the same bit types
-                            printf("VM Crash: Invalid copy operation operands: [%i] and [%i].\n", v0, v1);
+                            crash("Invalid copy operation operands: [%i] and [%i].\n", v0, v1);
                             return -1;
                         }
                         REGISTERS[(int) v0].m32 = REGISTERS[(int) v1].m32;
                         break;
 
                     default:
-                        printf("VM Crash: Bad copy source register [%i].\n", v0);
+                        crash("Bad copy source register [%i].\n", v0);
                         return -1;
                 }
                 break;
@@ -483,7 +2583,7 @@ int main()
                         break;
 
                     default:
-                        printf("VM Crash: Bad increment register [%i]\n", v0);
+                        crash("Bad increment register [%i]\n", v0);
                         return -1;
                 }
                 break;
@@ -522,7 +2622,7 @@ int main()
                         break;
 
                     default:
-                        printf("VM Crash: Bad increment register [%i]\n", v0);
+                        crash("Bad increment register [%i]\n", v0);
                         return -1;
                 }
                 break;
@@ -541,7 +2641,7 @@ int main()
                     case CH:
                     case DH:
                         if(v1 < AL || v1 > DH) {
-                            printf("VM Crash: Invalid add operation operands: [%i] and [%i].\n", v0, v1);
+                            crash("Invalid add operation operands: [%i] and [%i].\n", v0, v1);
                             return -1;
                         }
                         *REG8[v0 - REG8_OFFSET] += *REG8[v1 - REG8_OFFSET];
@@ -552,7 +2652,7 @@ int main()
                     case CX:
                     case DX:
                         if(v1 < AX || v1 > DX) {
-                            printf("VM Crash: Invalid add operation operands: [%i] and [%i].\n", v0, v1);
+                            crash("Invalid add operation operands: [%i] and [%i].\n", v0, v1);
                             return -1;
                         }
                         *REG16[v0 - REG16_OFFSET] += *REG16[v1 - REG16_OFFSET];
@@ -566,14 +2666,14 @@ int main()
                     case ESI:
                     case EDI:
                         if(v1 < EAX || v1 > EDI) {
-                            printf("VM Crash: Invalid add operation operands: [%i] and [%i].\n", v0, v1);
+                            crash("Invalid add operation operands: [%i] and [%i].\n", v0, v1);
                             return -1;
                         }
                         REGISTERS[(int) v0].m32 += REGISTERS[(int) v1].m32;
                         break;
 
                     default:
-                        printf("VM Crash: Bad add source register [%i].\n", v0);
+                        crash("Bad add source register [%i].\n", v0);
                         return -1;
                 }
                 break;
@@ -592,7 +2692,7 @@ int main()
                     case CH:
                     case DH:
                         if(v1 < AL || v1 > DH) {
-                            printf("VM Crash: Invalid sub operation operands: [%i] and [%i].\n", v0, v1);
+                            crash("Invalid sub operation operands: [%i] and [%i].\n", v0, v1);
                             return -1;
                         }
                         *REG8[v0 - REG8_OFFSET] -= *REG8[v1 - REG8_OFFSET];
@@ -603,7 +2703,7 @@ int main()
                     case CX:
                     case DX:
                         if(v1 < AX || v1 > DX) {
-                            printf("VM Crash: Invalid sub operation operands: [%i] and [%i].\n", v0, v1);
+                            crash("Invalid sub operation operands: [%i] and [%i].\n", v0, v1);
                             return -1;
                         }
                         *REG16[v0 - REG16_OFFSET] -= *REG16[v1 - REG16_OFFSET];
@@ -617,14 +2717,14 @@ int main()
                     case ESI:
                     case EDI:
                         if(v1 < EAX || v1 > EDI) {
-                            printf("VM Crash: Invalid sub operation operands: [%i] and [%i].\n", v0, v1);
+                            crash("Invalid sub operation operands: [%i] and [%i].\n", v0, v1);
                             return -1;
                         }
                         REGISTERS[(int) v0].m32 -= REGISTERS[(int) v1].m32;
                         break;
 
                     default:
-                        printf("VM Crash: Bad sub source register [%i].\n", v0);
+                        crash("Bad sub source register [%i].\n", v0);
                         return -1;
                 }
                 break;
@@ -658,6 +2758,28 @@ int main()
                 if(!(REGISTERS[FLG].m32 & EQ_FLAG)) REGISTERS[EIP].m32 = i;
                 break;
 
+            // short branches jump relative to the end of the instruction
+            case JMP8:
+            case JEQ8:
+            case JLE8:
+            case JGE8:
+            case JNE8:
+            case JMP16:
+            case JEQ16:
+            case JLE16:
+            case JGE16:
+            case JNE16:
+                i = OP < JMP16 ? (signed char) read_b() : (short) read_s();
+                dprintf("J%i %+i\n", OP, i);
+                switch(OP < JMP16 ? OP - JMP8 + JMP : OP - JMP16 + JMP) {
+                    case JMP: REGISTERS[EIP].m32 += i; break;
+                    case JEQ: if(REGISTERS[FLG].m32 & EQ_FLAG) REGISTERS[EIP].m32 += i; break;
+                    case JLE: if(REGISTERS[FLG].m32 & LS_FLAG) REGISTERS[EIP].m32 += i; break;
+                    case JGE: if(REGISTERS[FLG].m32 & GT_FLAG) REGISTERS[EIP].m32 += i; break;
+                    case JNE: if(!(REGISTERS[FLG].m32 & EQ_FLAG)) REGISTERS[EIP].m32 += i; break;
+                }
+                break;
+
             case CMP:
                 v0 = read_b();
                 v1 = read_b();
@@ -673,7 +2795,7 @@ int main()
                     case CH:
                     case DH:
                         if(v1 < AL || v1 > DH) {
-                            printf("VM Crash: Invalid cmp operation operands: [%i] and [%i].\n", v0, v1);
+                            crash("Invalid cmp operation operands: [%i] and [%i].\n", v0, v1);
                             return -1;
                         }
                         dprintf("%i vs %i\n", *REG8[v0 - REG8_OFFSET], *REG8[v1 - REG8_OFFSET]);
@@ -688,7 +2810,7 @@ int main()
                     case CX:
                     case DX:
                         if(v1 < AX || v1 > DX) {
-                            printf("VM Crash: Invalid cmp operation operands: [%i] and [%i].\n", v0, v1);
+                            crash("Invalid cmp operation operands: [%i] and [%i].\n", v0, v1);
                             return -1;
                         }
                         dprintf("%i vs %i\n", *REG16[v0 - REG16_OFFSET], *REG16[v1 - REG16_OFFSET]);
@@ -706,7 +2828,7 @@ int main()
                     case ESI:
                     case EDI:
                         if(v1 < EAX || v1 > EDI) {
-                            printf("VM Crash: Invalid cmp operation operands: [%i] and [%i].\n", v0, v1);
+                            crash("Invalid cmp operation operands: [%i] and [%i].\n", v0, v1);
                             return -1;
                         }
                         dprintf("%i vs %i\n", REGISTERS[v0].m32, REGISTERS[v1].m32);
@@ -717,7 +2839,7 @@ int main()
                         break;
 
                     default:
-                        printf("VM Crash: Bad cmp source register [%i].\n", v0);
+                        crash("Bad cmp source register [%i].\n", v0);
                         return -1;
                 }
                 break;
@@ -767,7 +2889,7 @@ int main()
                         else REGISTERS[FLG].m32 |= GT_FLAG;
                         break;
                     default:
-                        printf("VM Crash: Invalid register [%i].\n", v0);
+                        crash("Invalid register [%i].\n", v0);
                         return -1;
                 }
                 break;
@@ -812,7 +2934,7 @@ int main()
                         break;
 
                     default:
-                        printf("VM Crash: Invalid push register [%i].\n", v0);
+                        crash("Invalid push register [%i].\n", v0);
                         return -1;
                 }
                 break;
@@ -855,7 +2977,7 @@ int main()
                         break;
 
                     default:
-                        printf("VM Crash: Invalid pop register [%i].\n", v0);
+                        crash("Invalid pop register [%i].\n", v0);
                         return -1;
                 }
                 break;
@@ -880,7 +3002,7 @@ int main()
                     case BX:
                     case CX:
                     case DX:
-                        memcpy(&RAM[REGISTERS[EDI].m32], &REG16[v0 - REG16_OFFSET], sizeof(short));
+                        memcpy(&RAM[REGISTERS[EDI].m32], REG16[v0 - REG16_OFFSET], sizeof(short));
                         break;
 
                     case EAX:
@@ -895,14 +3017,16 @@ int main()
                         break;
 
                     default:
-                        printf("VM Crash: Invalid set operation register [%i].\n", v0);
+                        crash("Invalid set operation register [%i].\n", v0);
                         return -1;
                 }
+                bus_write(REGISTERS[EDI].m32, sizeof(int));
                 break;
 
             case FETCH:
                 v0 = read_b();
                 dprintf("FETCH %i -> ", v0);
+                bus_read(REGISTERS[ESI].m32, sizeof(int));
                 switch(v0)
                 {
                     case AL:
@@ -938,7 +3062,7 @@ int main()
                         break;
 
                     default:
-                        printf("VM Crash: Invalid get operation register [%i].\n", v0);
+                        crash("Invalid get operation register [%i].\n", v0);
                         return -1;
                 }
                 break;
@@ -954,27 +3078,216 @@ int main()
                 dprintf("Set EIP: %i\n", i);
                 break;
 
+            case CALL8:
+            case CALL16:
+                i = OP == CALL8 ? (signed char) read_b() : (short) read_s();
+                memcpy(&RAM[REGISTERS[ESP].m32], &REGISTERS[EIP].m32, sizeof(int));
+                REGISTERS[ESP].m32 += 4;
+                REGISTERS[EIP].m32 += i;
+                dprintf("CALL %+i\n", i);
+                break;
+
+            case HLT:
+                dprintf("HLT at %i\n", REGISTERS[EIP].m32 - 1);
+                if((id == 0 ? input_halt() : input_halt_secondary()) != 0) RUNNING = 0;
+                break;
+
             case RET:
                 memcpy(&REGISTERS[EIP].m32, &RAM[REGISTERS[ESP].m32 - 4], sizeof(int));
                 REGISTERS[ESP].m32 -= 4;
                 dprintf("RET -> %i\n", REGISTERS[EIP].m32);
+                if(REGISTERS[EIP].m32 == TASK_EXIT && task_exit() != 0) RUNNING = 0;
+                break;
+
+            case IRET:
+                if(REGISTERS[ESP].m32 - 8 < REGISTERS[ESB].m32) {
+                    crash("IRET stack underflow.\n");
+                    return -1;
+                }
+                memcpy(&REGISTERS[FLG].m32, &RAM[REGISTERS[ESP].m32 - 4], sizeof(int));
+                memcpy(&REGISTERS[EIP].m32, &RAM[REGISTERS[ESP].m32 - 8], sizeof(int));
+                REGISTERS[ESP].m32 -= 8;
+                IRQ_ENABLED = id == 0;
+                dprintf("IRET -> %i\n", REGISTERS[EIP].m32);
+                break;
+
+            case CAS:
+                v0 = read_b();
+                v1 = read_b();
+                dprintf("CAS %i %i\n", v0, v1);
+                if(cpu_atomic_operands(v0, v1) != 0) return -1;
+                bus_read(REGISTERS[EDI].m32, sizeof(int));
+                if(__atomic_compare_exchange_n((int*) &RAM[REGISTERS[EDI].m32], &REGISTERS[(int) v0].m32, REGISTERS[(int) v1].m32, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                    REGISTERS[FLG].m32 = EQ_FLAG;
+                    bus_write(REGISTERS[EDI].m32, sizeof(int));
+                }
+                else REGISTERS[FLG].m32 = 0;
+                break;
+
+            case XADD:
+                v0 = read_b();
+                dprintf("XADD %i\n", v0);
+                if(cpu_atomic_operands(v0, v0) != 0) return -1;
+                i = REGISTERS[EDI].m32;
+                bus_read(i, sizeof(int));
+                REGISTERS[(int) v0].m32 = __atomic_fetch_add((int*) &RAM[i], REGISTERS[(int) v0].m32, __ATOMIC_SEQ_CST);
+                bus_write(i, sizeof(int));
+                break;
+
+            case XCHG:
+                v0 = read_b();
+                dprintf("XCHG %i\n", v0);
+                if(cpu_atomic_operands(v0, v0) != 0) return -1;
+                i = REGISTERS[EDI].m32;
+                bus_read(i, sizeof(int));
+                REGISTERS[(int) v0].m32 = __atomic_exchange_n((int*) &RAM[i], REGISTERS[(int) v0].m32, __ATOMIC_SEQ_CST);
+                bus_write(i, sizeof(int));
+                break;
+
+            case FENCE:
+                atomic_thread_fence(memory_order_seq_cst);
+                break;
+
+            case TASK:
+            case JOIN:
+                v0 = read_b();
+                dprintf("%s %i\n", OP == TASK ? "TASK" : "JOIN", v0);
+                if(v0 > EDI) {
+                    crash("Bad task register [%i]\n", v0);
+                    return -1;
+                }
+                if(OP == TASK) i = task_start(REGISTERS[(int) v0].m32);
+                else i = task_join(REGISTERS[(int) v0].m32, 2);
+                if(i != 0) return -1;
+                break;
+
+            case YIELD:
+                task_yield();
                 break;
 
             default:
-                printf("VM Crash: Invalid op-code [%i].\n", OP);
+                crash("Invalid op-code [%i].\n", OP);
                 return -1;
         }
     }
 
-    fclose(DRIVE);
+    CPU_INSTRUCTIONS[id] = MACHINE_INSTRUCTIONS;
+    CPU_CYCLES[id] = MACHINE_CYCLES;
+    return 0;
+}
+
+// a crash on any CPU stops the machine, main returns -1 once it has shut down
+void cpu_crashed() {
+    atomic_store(&MACHINE_CRASHED, 1);
+    atomic_store(&MACHINE_RUNNING, 0);
+    input_wake(); // CPU 0 may be halted
+}
 
-    SDL_GL_DeleteContext(context);
-    SDL_DestroyWindow(window);
-    SDL_Quit();
+void* cpu_thread(void* argument) {
+    if(cpu_run((int) (long) argument) != 0) cpu_crashed();
+    return NULL;
+}
+
+/*******************************************************************/
+/******************************* cpu *******************************/
+/*******************************************************************/
+
+int main(int argc, char* argv[])
+{
+    const char* drive_path = "DRIVE";
+    const char* console_path = NULL;
+
+    int a = 1;
+    for(; a < argc; a++) {
+        if(strcmp(argv[a], "-drive") == 0 && a + 1 < argc) drive_path = argv[++a];
+        else if(strcmp(argv[a], "-console") == 0 && a + 1 < argc) console_path = argv[++a];
+        else if(strcmp(argv[a], "-stats") == 0) MACHINE_STATS = 1;
+        else if(strcmp(argv[a], "-cpus") == 0 && a + 1 < argc) CPU_COUNT = atoi(argv[++a]);
+        else if(strcmp(argv[a], "-channel") == 0 && a + 1 < argc) {
+            if(channel_option(argv[++a]) != 0) return -1;
+        }
+#ifdef SOFTWARE_GPU
+        else if(strcmp(argv[a], "-dump") == 0 && a + 1 < argc) GPU_DUMP_PATH = argv[++a];
+#endif
+        else {
+            printf("Error: Unknown argument [%s].\n", argv[a]);
+            return -1;
+        }
+    }
+
+    if(CPU_COUNT < 1 || CPU_COUNT > CPU_MAX) {
+        printf("Error: The machine supports 1 to %i CPUs.\n", CPU_MAX);
+        return -1;
+    }
+
+    if(console_init(console_path) != 0) return -1;
+
+    // allocate the heap
+    RAM = (unsigned char*) malloc(RAM_SIZE);
+    if(!RAM) return -1;
+    memset(RAM, 0, RAM_SIZE); // 0 - initalize the memory
+
+    if(readROM() != 0)
+    {
+        puts("ROM reading exception.");
+        return -1;
+    }
+    if(CPU_COUNT > 1 && MACHINE_ROM_SIZE + CPU_COUNT * CPU_STACK_SIZE > TEXT_ADDRESS) {
+        printf("Error: There is no room for the stacks of %i CPUs.\n", CPU_COUNT);
+        return -1;
+    }
+
+    // open the file descriptor for the hard-drive:
+    DRIVE = drive_open(drive_path, 1);
+    if(!DRIVE) {
+        puts("Error opening virtual machine drive file.");
+        return -1;
+    }
 
+    if(channel_open() != 0) return -1;
+
+    // create the screen:
+    if(gpu_open() != 0) return -1;
+    if(gpu_thread_start() != 0) return -1;
+
+    if(input_init() != 0) return -1;
+
+    // attach the devices to the bus:
+    if(bus_interrupt(EXIT, machine_exit) != 0 || bus_interrupt(SET_VECTORS, irq_set_vectors) != 0) return -1;
+    if(console_attach() != 0 || input_attach() != 0 || disk_attach() != 0 || gpu_attach() != 0 || text_attach() != 0 || timer_attach() != 0) return -1;
+    if(channel_attach() != 0) return -1;
+
+    // CPU 0 runs on the main thread, which owns the window
+    pthread_t cpus[CPU_MAX];
+    int cpu;
+    for(cpu = 1; cpu < CPU_COUNT; cpu++) {
+        if(pthread_create(&cpus[cpu], NULL, cpu_thread, (void*) (long) cpu) != 0) {
+            puts("Error: Could not create the CPU threads.");
+            return -1;
+        }
+    }
+    if(cpu_run(0) != 0) cpu_crashed();
+    atomic_store(&MACHINE_RUNNING, 0);
+    for(cpu = 1; cpu < CPU_COUNT; cpu++) pthread_join(cpus[cpu], NULL);
+
+    drive_close(DRIVE);
+    channel_close();
+    console_flush();
+
+    gpu_thread_stop();
+    if(MACHINE_STATS) {
+        gpu_stats();
+        text_stats();
+        timer_stats();
+        task_stats();
+        channel_stats();
+    }
+
+    gpu_queue_free();
+    gpu_layer_free();
+    gpu_close();
     free(RAM);
-    gpu_free();
 
-    return 0;
+    return atomic_load(&MACHINE_CRASHED) ? -1 : 0;
 }
 
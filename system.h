@@ -30,6 +30,27 @@
 #define WRITE  18  // set at
 #define CALL   19  // call
 #define RET    20  // return to the last call's location
+#define HLT    21  // wait for an event
+#define IRET   22  // return from an interrupt request handler
+#define CAS    23  // atomic compare and swap
+#define XADD   24  // atomic fetch and add
+#define XCHG   25  // atomic exchange
+#define FENCE  26  // memory fence
+#define TASK   27  // start a task
+#define YIELD  28  // switch to the next task
+#define JOIN   29  // wait for a task to finish
+#define JMP8   30  // short branches, the assembler picks these for JMP, JEQ, JLE, JGE, JNE and CALL when the target is near
+#define JEQ8   31
+#define JLE8   32
+#define JGE8   33
+#define JNE8   34
+#define CALL8  35
+#define JMP16  36
+#define JEQ16  37
+#define JLE16  38
+#define JGE16  39
+#define JNE16  40
+#define CALL16 41
 
 // Instruction opcode specifications:
 // NOP   - NA
@@ -51,6 +72,17 @@
 // WRITE - byte
 // CALL  - int
 // RET   - NA
+// HLT   - NA
+// IRET  - NA
+// CAS   - byte byte
+// XADD  - byte
+// XCHG  - byte
+// FENCE - NA
+// TASK  - byte
+// YIELD - NA
+// JOIN  - byte
+// JMP8 ... CALL8   - byte
+// JMP16 ... CALL16 - short
 
 // Instruction explanations:
 // NOP - do nothing
@@ -72,6 +104,21 @@
 // WRITE - write the register's value onto the stack (uses the EDI register)
 // CALL - jump to the location in memory and then continue executing from this function call
 // RET - jump to the next address in the stack
+// HLT - suspend the machine until there is input, a window event or a timer
+// IRET - return from an interrupt request handler, restoring FLG and EIP from the stack and unmasking requests
+// CAS - compare the int at EDI to the first register: if they are equal write the second register there and set the equal flag,
+//       otherwise clear the flags and load the int into the first register
+// XADD - add the register to the int at EDI and load the previous value into the register
+// XCHG - swap the register with the int at EDI
+// FENCE - finish every earlier read and write of RAM before any later one
+// NOTE: CAS, XADD and XCHG are atomic across CPUs, they take 32 bit registers and an EDI aligned to 4 bytes
+// TASK - start a task with its control block at the address in the register, running from ESI with its stack at EDI
+// YIELD - save the registers of the running task and switch to the next task in the run queue
+// JOIN - switch to other tasks until the task with its control block at the address in the register has finished
+// JMP8 ... CALL16 - the same as JMP ... CALL, but the target is a signed displacement from the end of the instruction
+// NOTE: source code only uses JMP ... CALL, the assembler shortens branches to labels when it writes the ROM
+//       and moves the code after them, so code addresses are only stable through labels. A branch to a number
+//       turns shortening off.
 
 // ROM setup:
 // Code segment integer (the byte at which the code begins)
@@ -80,6 +127,29 @@
 // Code...
 // ...
 
+// object files begin with this magic string
+#define OBJECT_MAGIC "VMOB"
+
+// Object file layout (compiler -c input output):
+// char[4]        - magic ("VMOB")
+// unsigned int   - code size in bytes
+// unsigned int   - symbol count
+// unsigned int   - relocation count
+// unsigned int   - instruction count
+// unsigned int   - alignment (the largest alignment in the module, the linker places the module at a multiple of it)
+// Code...        - the module assembled as if it began at byte 0
+// Symbols...     - int value, char kind, int line, unsigned short name length, name (not null terminated)
+// Relocations... - int code offset, int symbol index, char size (1, 2 or 4), int line
+// Instructions...- int code offset, int size, int line, int alignment (0, or the alignment of padding)
+//                  so the linker can shorten branches and knows what is data
+// NOTE: a ROM is one flat image so an object has a single code section, #link places it at the current offset
+
+// object symbol kinds:
+// #def values are substituted when the object is written, they are private to the module which defines them
+#define OBJECT_SYMBOL_LABEL  0 // an exported (#export) offset into the module's code, it moves with the module
+#define OBJECT_SYMBOL_IMPORT 2 // a label the module references but does not define
+#define OBJECT_SYMBOL_LOCAL  3 // an offset into the module's code which is not exported, only the module's relocations use it
+
 // note: 8 bit and 16 bit support exists for chars and shorts
 // due to this, you can have all these data types:
 // byte, short, int, float
@@ -130,6 +200,39 @@
 #define POLL       6
 #define REDRAW     7
 #define SET_COLOR  8
+#define WRITE_DISK 9
+#define PRINT_STRING 10
+#define READ_INPUT 11
+#define SET_PRIMITIVE 12
+#define BLIT       13
+#define SET_VECTORS 14
+#define SET_TIMER  15
+#define READ_COUNTER 16
+#define SEND       17
+#define RECV       18
+
+// interrupt requests:
+// Devices raise requests asynchronously. Before the next instruction, the machine pushes EIP then FLG
+// (4 bytes each) and jumps to the handler for the lowest pending request in the vector table.
+// Further requests are masked until the handler returns with IRET.
+#define IRQ_LINES 8  // the number of entries in the vector table
+#define IRQ_TIMER 0  // raised by the timer
+
+// timer modes:
+#define TIMER_OFF          0
+#define TIMER_INSTRUCTIONS 1 // fire every EBX instructions (does not count while halted)
+#define TIMER_MICROSECONDS 2 // fire every EBX microseconds of host time (wakes HLT)
+
+// counters:
+#define COUNTER_INSTRUCTIONS 0 // instructions executed since the machine started
+#define COUNTER_CYCLES       1 // modelled cycles: every opcode has a fixed cost, see OPCODE_CYCLES in machine.c
+#define COUNTER_NANOSECONDS  2 // host monotonic clock in nanoseconds
+
+// draw primitive modes:
+#define PRIMITIVE_POINTS     0 // every vertex is a point
+#define PRIMITIVE_LINES      1 // every 2 vertices are a line
+#define PRIMITIVE_LINE_STRIP 2 // every vertex is joined to the one before by a line
+#define PRIMITIVE_TRIANGLES  3 // every 3 vertices are a filled triangle
 
 // NOTE: This explains the read disk interrupt:
 // This interrupt will read the disk and push the data onto the stack
@@ -137,6 +240,123 @@
 // EAX - Mark the start of the location of the hard drive to read
 // EBX - Mark the end of the location of the hard drive to read
 
+// NOTE: This explains the write disk interrupt:
+// This interrupt will pop the data off the stack and write it to the disk
+// The following registers are used by this interrupt:
+// EAX - Mark the start of the location of the hard drive to write
+// EBX - Mark the end of the location of the hard drive to write
+
+// NOTE: This explains the print string interrupt:
+// This interrupt writes a string from RAM to the console in one go
+// The following registers are used by this interrupt:
+// ESI - The address of the string
+// EAX - The length of the string in bytes, or 0 if the string is null terminated
+
+// NOTE: This explains the read input interrupt:
+// This interrupt copies the buffered keyboard and stdin input to RAM without waiting for more
+// The following registers are used by this interrupt:
+// EDI - The address to copy the input to
+// EAX - The maximum number of bytes to copy
+// On return EAX holds the number of bytes copied, or -1 if stdin was closed and there is no input left
+
+// NOTE: This explains the set primitive interrupt:
+// This interrupt selects how the vertices of the following draws are joined up
+// The following registers are used by this interrupt:
+// EAX - One of the PRIMITIVE_* modes, draws start out as points
+
+// NOTE: This explains the set vectors interrupt:
+// This interrupt points the machine at the interrupt vector table
+// The following registers are used by this interrupt:
+// ESI - The address of IRQ_LINES ints, the address of the handler for each request line (0 ignores the line)
+
+// NOTE: This explains the set timer interrupt:
+// This interrupt programs the timer, which raises IRQ_TIMER every period
+// The following registers are used by this interrupt:
+// EAX - One of the TIMER_* modes
+// EBX - The period, in instructions or microseconds depending on the mode
+
+// NOTE: This explains the read counter interrupt:
+// This interrupt reads one of the 64 bit counters
+// The following registers are used by this interrupt:
+// EAX - One of the COUNTER_* counters
+// On return EAX holds the low 32 bits of the counter and EDX the high 32 bits
+
+// NOTE: This explains the send interrupt:
+// This interrupt copies a range of RAM into a channel as one message, waiting while the channel is full
+// The following registers are used by this interrupt:
+// EBX - The channel number
+// ESI - The address of the message
+// EAX - The length of the message in bytes
+
+// NOTE: This explains the receive interrupt:
+// This interrupt copies the next message out of a channel, parking the machine until one arrives
+// The following registers are used by this interrupt:
+// EBX - The channel number
+// EDI - The address to copy the message to
+// EAX - The maximum number of bytes to copy, the rest of a longer message is dropped
+// On return EAX holds the length of the message
+
+// NOTE: This explains the blit interrupt:
+// This interrupt copies a bitmap from RAM onto the screen's bitmap layer, which is drawn under the draws
+// The following registers are used by this interrupt:
+// ESI - The address of a blit descriptor:
+//
+// Blit descriptor layout:
+// int   - the address of the bitmap, rows are stored top to bottom without padding
+// int   - the address of the palette (256 RGB byte triples) for 8 bit bitmaps
+// short - the width of the bitmap in pixels
+// short - the height of the bitmap in pixels
+// short - the x position on the screen of the top left corner
+// short - the y position on the screen of the top left corner
+// byte  - the format: 8 (palette indices), 24 (RGB bytes) or 32 (RGBX bytes)
+// byte  - the scale: every pixel is drawn as a scale x scale square (0 is treated as 1)
+// byte  - flags: BLIT_COLOUR_KEY
+// byte  - unused
+// int   - the colour key: a palette index for 8 bit bitmaps, otherwise 0x00BBGGRR
+#define BLIT_DESCRIPTOR_SIZE 24
+#define BLIT_COLOUR_KEY 1 // pixels matching the colour key are left transparent
+
+// text console:
+// The last TEXT_SIZE bytes of RAM are a TEXT_COLUMNS x TEXT_ROWS grid of cells, stored row by row.
+// Each cell is 2 bytes: the character, then the attribute (foreground colour in the low 4 bits, background colour in the high 4 bits).
+// Colours are the 16 CGA colours. Cells holding character 0 are transparent.
+// The screen is updated with WRITE, changed cells are drawn on the next REDRAW.
+#define TEXT_COLUMNS 80
+#define TEXT_ROWS    30
+#define TEXT_SIZE    (TEXT_COLUMNS * TEXT_ROWS * 2)
+#define TEXT_ADDRESS (RAM_SIZE - TEXT_SIZE)
+
+// virtual CPUs:
+// The machine can run several CPUs (-cpus N) on separate host threads, sharing the one RAM.
+// Every CPU starts at the beginning of the code with its own registers, EAX holds the number of the CPU (0 to N - 1).
+// The stack of CPU n begins CPU_STACK_SIZE * n bytes after the end of the ROM.
+// Every stack must fit between the end of the ROM and the text grid, so CPU_MAX (31) is only reached with an empty ROM.
+// Interrupts are run one at a time and interrupt requests are only taken by CPU 0.
+// The machine stops when CPU 0 stops or any CPU exits, a HLT on another CPU stops only that CPU once nothing can wake it.
+#define CPU_STACK_SIZE 65536
+#define CPU_MAX (TEXT_ADDRESS / CPU_STACK_SIZE)
+
+// tasks:
+// Tasks are cooperative threads of a CPU, switched between by YIELD and JOIN in round-robin order.
+// A task starts with the registers of the task which started it (EAX - EDX can pass arguments),
+// and ends when it returns from its entry point: TASK pushes TASK_EXIT as the return address at the bottom of its stack.
+// Each task has a control block in RAM holding its registers while it is not running:
+// int[REGISTER_COUNT] - the registers, in register number order (EAX ... FLG)
+// int                 - the state of the task
+#define TASK_STATE   (REGISTER_COUNT * 4) // the offset of the state in a control block
+#define TASK_SIZE    (TASK_STATE + 4)
+#define TASK_RUNNING 1 // running or waiting in the run queue
+#define TASK_DONE    2
+#define TASK_EXIT   -1
+#define TASK_MAX     1024 // the most tasks which may wait in the run queue of a CPU
+
+// channels:
+// Channels are message queues in host shared memory between machines running in separate processes,
+// `machine -channel n:name` attaches channel n to the queue with that name (created if it does not exist yet).
+// Each channel carries messages one way: one machine sends into it and one machine receives from it.
+#define CHANNEL_MAX  8
+#define CHANNEL_SIZE 1048576 // the capacity of a channel in bytes, each message also takes a 4 byte length
+
 // assembly data types:
 // Strings - byte data: "..."
 // Defines: #def name value
@@ -150,5 +370,11 @@
 // Example of an array of shorts:
 // my_array: <short>[1, 2, 3, 4]
 //
+// Labels: name: marks the offset of the next byte, every label and definition may only be defined once
+// Local labels: .name: belongs to the last label without a dot, .name refers to the local label under the current label
+// and parent.name refers to it from anywhere
+// Alignment: arrays of shorts begin at a multiple of 2 bytes and arrays of ints and floats at a multiple of 4,
+// #align n pads to a multiple of n bytes (a power of 2). The padding is NOPs and labels just before it point past it.
+//
 
 #endif